@@ -6,11 +6,21 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <strings.h>
 #include <math.h>
 #include <assert.h>
 #include <inttypes.h>
 
+// rows are padded to a multiple of this many words (one AVX2 vector);
+// gf2_init aligns its matrix to 64 bytes
+#define GF2_ALIGN_WORDS 4
+
+// row kernels for gf2_semi_ech, see gf2_simd()
+#define GF2_SIMD_WORD   0
+#define GF2_SIMD_AVX2   1
+#define GF2_SIMD_AVX512 2
+
 // ----------------------------------------------------------------------
 // data structure for managing information related to solving
 // linear systems over GF(2)...
@@ -21,7 +31,7 @@ typedef struct {
   int n;              // number of (bit) columns
   int b;              // number of rhs columns
   // --- optional paramters (defaults will be computed)
-  int wds;            // width of matrix in words
+  int wds;            // width of matrix in words (default gf2_words(n, b))
   int kmax;           // max number of kernel vectors (user can set to limit them)
   int tablebits;      // number of bits for 4 Russians tables
   // --- flags
@@ -35,11 +45,16 @@ typedef struct {
   void *kernel;       // flattened array of k * wds words
   void *solution;     // if non-null, a particular solution  (b * wds words)
   int  *pivots;       // pivots
+  void *table;        // if non-null, 4 Russians tables (2^tablebits * wds words)
+  int  *tableindex;   // and their indices (2^tablebits ints); otherwise
+                      // gf2_semi_ech allocates them for each call
   // --- computed data
   int rank;           // rank of system
   int corank;         // rank of kernel
 } gf2_t;
 
+int gf2_words(int n, int b);
+int gf2_simd(int level);
 void gf2_init(gf2_t *data);
 void gf2_clear(gf2_t *data);
 int gf2_semi_ech(gf2_t *data);
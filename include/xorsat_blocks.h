@@ -7,21 +7,67 @@
 #ifndef XORSATBLOCK_H
 #define XORSATBLOCK_H
 
+//XORSATFilterBuilderFinalize solves this many blocks first, at the
+//size given by fEfficiency, where each grows a word every time it turns
+//out unsatisfiable. The remaining blocks start with as many extra words
+//as the fewest any of those needed (see XORSATFilterBlockPredictWords),
+//which skips solves nearly every block would fail while leaving
+//efficiency as it was.
+#define XORSATFILTER_CALIBRATION_BLOCKS 16
+
 typedef struct XORSATFilterBlock {
   uint8_t nSolutions;
-  bitvector_t pSolutionsCompressed;
-  XORSATFilterHash_list pHashes;
-  XORSATFilterMetaData_list pMetaData;
+  uint64_t *pSolutionsCompressed;     //nRHSBits per variable, packed (see XORSATFilterBlockSolutionBit)
+  XORSATFilterHash_list pHashes;      //Views into the builder's lists, which own the elements
+  uint8_t *pMetaData;                 //nMetaDataBytes per element of pHashes
   size_t nMetaDataBytes;
   uint32_t nVariables;
   uint8_t bBadBlock;
   uint8_t nLitsPerRow;
+  uint8_t nFormat;
   uint32_t nThreadNumber;
+  uint32_t nDuplicates;               //Set by XORSATFilterSolveBlock
+  uint32_t nConflictingDuplicates;
+  uint32_t nRetries;                  //Unsatisfiable attempts before the block was solved
+  uint64_t nRandomState;              //See XORSATFilterRandom
 } XORSATFilterBlock;
 
 create_c_list_headers(XORSATFilterBlock_list, XORSATFilterBlock)
 
+void XORSATFilterBlockResize(XORSATFilterBlock *pBlock, uint32_t nVariablesPerBlock);
 void XORSATFilterBlockFillToWord(XORSATFilterBlock *pBlock, uint8_t bIncrement);
+void XORSATFilterBlockReleaseElements(XORSATFilterBlock *pBlock);
 void XORSATFilterBlockFree(XORSATFilterBlock *pBlock);
+void XORSATFilterBlockSeedRandom(XORSATFilterBlock *pBlock, uint64_t nSeed, uint32_t nBlock);
+uint32_t XORSATFilterBlockPredictWords(const XORSATFilterBlock *pBlocks, uint32_t nBlocks);
+void XORSATFilterBlockRowRHS(const XORSATFilterBlock *pBlock, size_t i, uint32_t rhs, uint64_t *pRHS, uint32_t nRHSWords);
+uint8_t XORSATFilterBlockCompressSolutions(XORSATFilterBlock *pBlock, const uint64_t *pSolutions, uint32_t nRHSWords);
+
+//Bit j of variable i's solution is bit nBit = i*nRHSBits + j of
+//pSolutionsCompressed, counting from the least significant bit of each
+//word. This is the layout of a WRS block in the filter.
+static inline
+uint8_t XORSATFilterBlockSolutionBit(const XORSATFilterBlock *pBlock, size_t nBit) {
+  return (pBlock->pSolutionsCompressed[nBit >> 6] >> (nBit & 0x3f)) & 1;
+}
+
+//Words a solved block takes in the filter, nRHSBits per variable.
+//nVariables is always a multiple of 64.
+static inline
+uint64_t XORSATFilterBlockFilterWords(const XORSATFilterBlock *pBlock) {
+  return ((uint64_t) pBlock->nVariables * (pBlock->nSolutions + (pBlock->nMetaDataBytes * 8))) >> 6;
+}
+
+//Generator (wyrand) for the random choices made while solving a block,
+//such as the values of free variables. Each block has its own state,
+//seeded from XORSATFilterParameters.nSeed and the block's number, so
+//threads never share a generator and a filter doesn't depend on which
+//thread solved which block.
+static inline
+uint64_t XORSATFilterRandom(uint64_t *pState) {
+  *pState += (uint64_t) 0xa0761d6478bd642f;
+  __uint128_t nProduct = (__uint128_t) *pState * (*pState ^ (uint64_t) 0xe7037ed1a0b428db);
+  return (uint64_t) (nProduct >> 64) ^ (uint64_t) nProduct;
+}
 
 #endif
@@ -0,0 +1,31 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#ifndef XORSATEXTERNAL_H
+#define XORSATEXTERNAL_H
+
+//The spill file of a builder allocated with
+//XORSATFilterBuilderAllocExternal. The builder's lists hold at most
+//nBufferElements elements; when they fill up, their elements are
+//appended to pFile and the lists are emptied. Each element is spilled
+//as its hash followed by its nMetaDataBytes of metadata.
+typedef struct XORSATFilterSpill {
+  char *pDirectory;         //Where spill files are created
+  size_t nMemoryBytes;      //Memory the builder may use, see XORSATFilterBuilderAllocExternal
+  size_t nBufferElements;
+  FILE *pFile;              //Every element spilled so far, in the order added
+  uint64_t nSpilled;
+} XORSATFilterSpill;
+
+XORSATFilterBuilder *XORSATFilterBuilderAllocExternal(size_t nMetaDataBytes, size_t nMemoryBytes, const char *pDirectory);
+uint8_t XORSATFilterBuilderFinalizeToFile(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams, uint32_t nThreads, FILE *pXORSATFilterFile);
+
+uint8_t XORSATFilterSpillFlush(XORSATFilterBuilder *xsfb);
+uint8_t XORSATFilterSpillIfFull(XORSATFilterBuilder *xsfb);
+uint8_t XORSATFilterSpillElements(XORSATFilterSpill *pSpill, const XORSATFilterHash *pHashes, const uint8_t *pMetaData, size_t nElements, size_t nMetaDataBytes);
+void XORSATFilterSpillFree(XORSATFilterSpill *pSpill);
+
+#endif
@@ -14,6 +14,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <pthread.h>
 #include <signal.h>
@@ -26,8 +27,11 @@
 #include "xorsat_hashes.h"
 #include "xorsat_metadata.h"
 #include "xorsat_blocks.h"
+#include "xorsat_schedule.h"
 #include "xorsat_solve.h"
 #include "xorsat_immir_wrap.h"
+#include "xorsat_ribbon.h"
+#include "xorsat_peel.h"
 
 //Example paramters can be found in src/xorsat_blocks.c
 typedef struct XORSATFilterParameters {
@@ -36,6 +40,8 @@ typedef struct XORSATFilterParameters {
                           //  Large numbers provide more easily achievable higher efficiency
                           //  When nLitsPerRow is 2 (preferred) , a very fast hashing
                           //  method by Martin Dietzfelbinger and Stefan Walzer is activated
+                          //  When nLitsPerRow is XORSATFILTER_RIBBON, rows are bands of
+                          //  consecutive variables, which build much faster in large blocks
   uint8_t nSolutions;     //False positive rate of the filter will be approx. 2^-nSolutions
                           //nSolutions must be less than or equal to 32 (for now)
   uint16_t nEltsPerBlock; //Must be less than 65536 due to how variables are created from hashes
@@ -47,6 +53,16 @@ typedef struct XORSATFilterParameters {
   double fEfficiency;     //Desired efficiency, between 0.0 and 1.0
                           //  For best results, set this number to just above the actual achieved efficiency
                           //  This can be determined by testing
+  uint8_t nFormat;        //Bitwise OR of XORSATFILTER_FORMAT_* flags (see include/xorsat_hashes.h)
+                          //  0 (the default) builds filters in the original format
+                          //  XORSATFILTER_FORMAT_FASTRANGE avoids integer division when querying
+  uint8_t bHugePages;     //Allocate the built filter from 2 MB huge pages (hugetlb if reserved,
+                          //  otherwise transparent huge pages), which reduces TLB misses
+                          //  for large filters
+  uint64_t nSeed;         //Seeds the random values given to free variables while solving.
+                          //  The same elements, parameters and nSeed build byte-identical
+                          //  filters, whatever the number of threads. 0 is as good as any
+  uint8_t bPinThreads;    //Pin each thread solving blocks to its own CPU, see include/xorsat_schedule.h
 } XORSATFilterParameters;
 
 // Older parameters from the original paper
@@ -59,17 +75,46 @@ extern XORSATFilterParameters XORSATFilterDWEfficientParameters;
 extern XORSATFilterParameters XORSATFilterDWPaperParameters;
 extern XORSATFilterParameters XORSATFilterDWFastParameters;
 
+// Banded (ribbon) rows, which build in near-linear time, see include/xorsat_hashes.h
+extern XORSATFilterParameters XORSATFilterRibbonParameters;
+
 //Comment out the following to silence progress updates in `XORSATFilterBuilderFinalize`
 #define XORSATFILTER_PRINT_BUILD_PROGRESS
 
+//Counts gathered by XORSATFilterBuilderFinalize
+typedef struct XORSATFilterBuildStats {
+  uint64_t nElements;              //Elements and absences added to the builder
+  uint64_t nDuplicates;            //Elements dropped because an earlier element had the same hash.
+                                   //  These are elements added more than once, or (rarely) distinct
+                                   //  elements whose hashes collide; only hashes are kept, so the
+                                   //  builder can't tell the two apart
+  uint64_t nConflictingDuplicates; //Of those, how many differed from the element kept, either in
+                                   //  metadata or by being an absence; their data is lost
+  uint64_t nBlocks;
+  uint64_t nRetries;               //Block solves that were unsatisfiable, each followed by
+                                   //  growing the block a word and solving it again
+  uint64_t nBlocksRetried;         //Blocks with at least one such retry
+  uint64_t nPredictedWords;        //Words beyond fEfficiency that blocks after the first
+                                   //  XORSATFILTER_CALIBRATION_BLOCKS started with
+} XORSATFilterBuildStats;
+
 typedef struct XORSATFilterBuilder {
   XORSATFilterHash_list pHashes;
   size_t nMetaDataBytes;
-  XORSATFilterMetaData_list pMetaData;
+  uint8_t_list pMetaData;  //nMetaDataBytes per element, see xorsat_metadata.h
   XORSATFilterBlock_list pBlocks;
+  XORSATFilterBuildStats sStats;
+  struct XORSATFilterSpill *pSpill; //NULL unless the builder spills to disk, see xorsat_external.h
 } XORSATFilterBuilder;
 
 
+//Block query kernels, chosen for the querier's parameters by
+//XORSATFilterQuerierInitConstants (see src/xorsat_query.c)
+struct XORSATFilterQuerier;
+typedef uint8_t (*XORSATFilterQueryBlockFunc)(const struct XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock);
+typedef void (*XORSATFilterRetrieveMetadataBlockFunc)(const struct XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData);
+typedef uint8_t (*XORSATFilterQueryAndRetrieveMetadataBlockFunc)(const struct XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData);
+
 typedef struct XORSATFilterQuerier {
   uint64_t *pFilter;
   int16_t *pOffsets;
@@ -78,31 +123,76 @@ typedef struct XORSATFilterQuerier {
   size_t nMetaDataBytes;
   uint16_t nAvgVarsPerBlock;
   uint8_t nLitsPerRow;
-  uint8_t  bMMAP;
+  uint8_t nFormat;
+  uint8_t  bMMAP;         //pFilter (and pOffsets after it) is a single mapping of nMappedBytes
+  size_t nMappedBytes;
+  //Computed from the above by XORSATFilterQuerierInitConstants
+  uint32_t nRHSBits;
+  uint64_t nRHSBitsReciprocal;
+  uint32_t nWRSWindowSlice;
+  XORSATFilterQueryBlockFunc pQueryBlock;
+  XORSATFilterRetrieveMetadataBlockFunc pRetrieveMetadataBlock;
+  XORSATFilterQueryAndRetrieveMetadataBlockFunc pQueryAndRetrieveMetadataBlock;
 } XORSATFilterQuerier;
 
 #include "xorsat_serial.h"
+#include "xorsat_numa.h"
+#include "xorsat_external.h"
 
 XORSATFilterBuilder *XORSATFilterBuilderAlloc(uint32_t nExpectedElements, size_t nMetaDataBytes);
 void XORSATFilterBuilderFree(XORSATFilterBuilder *xsfb);
 uint8_t XORSATFilterBuilderAddElement(XORSATFilterBuilder *xsfb, const void *pElement, size_t nElementBytes, const void *pMetaData);
 uint8_t XORSATFilterBuilderAddAbsence(XORSATFilterBuilder *xsfb, const void *pElement, size_t nElementBytes);
+uint8_t XORSATFilterBuilderAddHash(XORSATFilterBuilder *xsfb, XORSATFilterHash xsfh, const void *pMetaData);
+uint8_t XORSATFilterBuilderAddAbsenceHash(XORSATFilterBuilder *xsfb, XORSATFilterHash xsfh);
+uint8_t XORSATFilterBuilderAddElements(XORSATFilterBuilder *xsfb, const void * const *ppElements, const uint32_t *pElementBytes, const void * const *ppMetaData, uint32_t nElements, uint32_t nThreads);
+uint8_t XORSATFilterBuilderMerge(XORSATFilterBuilder *xsfb, XORSATFilterBuilder *xsfbShard);
 XORSATFilterQuerier *XORSATFilterBuilderFinalize(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams, uint32_t nThreads);
+XORSATFilterBuildStats XORSATFilterBuilderStats(const XORSATFilterBuilder *xsfb);
 
+void XORSATFilterQuerierInitConstants(XORSATFilterQuerier *xsfq);
 void XORSATFilterQuerierFree(XORSATFilterQuerier *xsfq);
 
-uint8_t XORSATFilterQuery(XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes);
-uint8_t *XORSATFilterRetrieveMetadata(XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes);
-
-uint32_t XORSATFilterQueryRate(XORSATFilterQuerier *xsfq);
-uint32_t XORSATFilterMetadataRetrievalRate(XORSATFilterQuerier *xsfq, uint32_t nElementBytes);
-double XORSATFilterFalsePositiveRate(XORSATFilterQuerier *xsfq);
-uint64_t XORSATAncillarySize(XORSATFilterQuerier *xsfq);
-uint64_t XORSATFilterSize(XORSATFilterQuerier *xsfq);
-uint64_t XORSATMetaDataSize(XORSATFilterQuerier *xsfq);
-double XORSATFilterEfficiency(XORSATFilterQuerier *xsfq, uint64_t nElements, double p);
-double XORSATMetaDataEfficiency(XORSATFilterQuerier *xsfq, uint64_t nElements);
-
-uint64_t XORSATFilterGetBlockIndex(XORSATFilterQuerier *xsfq, uint32_t nBlock);
+//Concurrency: a querier is never modified after it is returned by
+//XORSATFilterBuilderFinalize or XORSATFilterDeserialize. Every function
+//below taking a const XORSATFilterQuerier * only reads it, keeps no
+//global or static state and is safe to call on one querier from any
+//number of threads at once, without locking. Only
+//XORSATFilterQuerierFree needs every other user of the querier to be done.
+uint8_t XORSATFilterQuery(const XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes);
+uint8_t *XORSATFilterRetrieveMetadata(const XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes);
+uint8_t XORSATFilterRetrieveMetadataInto(const XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes, uint8_t *pMetaData);
+uint32_t XORSATFilterRetrieveMetadataBatch(const XORSATFilterQuerier *xsfq, const void * const *ppElements, const uint32_t *pElementBytes, uint32_t nElements, uint8_t *pMetaData);
+uint32_t XORSATFilterQueryBatch(const XORSATFilterQuerier *xsfq, const void * const *ppElements, const uint32_t *pElementBytes, uint32_t nElements, uint8_t *pResults);
+uint8_t XORSATFilterQueryHash(const XORSATFilterQuerier *xsfq, XORSATFilterHash xsfh);
+uint8_t *XORSATFilterRetrieveMetadataHash(const XORSATFilterQuerier *xsfq, XORSATFilterHash xsfh);
+uint32_t XORSATFilterQueryHashBatch(const XORSATFilterQuerier *xsfq, const XORSATFilterHash *pHashes, uint32_t nHashes, uint8_t *pResults);
+uint8_t XORSATFilterRetrieveMetadataHashInto(const XORSATFilterQuerier *xsfq, XORSATFilterHash xsfh, uint8_t *pMetaData);
+uint32_t XORSATFilterRetrieveMetadataHashBatch(const XORSATFilterQuerier *xsfq, const XORSATFilterHash *pHashes, uint32_t nHashes, uint8_t *pMetaData);
+
+//Return values of XORSATFilterQueryAndRetrieveMetadata(Hash)
+#define XORSATFILTER_ABSENT  0 //Not in the filter; pMetaData is zeroed
+#define XORSATFILTER_PRESENT 1 //May be in the filter; pMetaData holds its metadata
+#define XORSATFILTER_UNKNOWN 2 //In a block that failed to build, so it may be in
+                               //  the filter but has no metadata; pMetaData is zeroed
+uint8_t XORSATFilterQueryAndRetrieveMetadata(const XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes, uint8_t *pMetaData);
+uint8_t XORSATFilterQueryAndRetrieveMetadataHash(const XORSATFilterQuerier *xsfq, XORSATFilterHash xsfh, uint8_t *pMetaData);
+
+uint32_t XORSATFilterQueryRate(const XORSATFilterQuerier *xsfq);
+uint32_t XORSATFilterQueryBatchRate(const XORSATFilterQuerier *xsfq);
+uint64_t XORSATFilterQueryRateParallel(const XORSATFilterQuerier *xsfq, uint32_t nThreads, uint32_t *pThreadRates);
+uint64_t XORSATFilterIngestionRate(uint32_t nThreads, size_t nMetaDataBytes, uint8_t bShards);
+uint32_t XORSATFilterMetadataRetrievalRate(const XORSATFilterQuerier *xsfq, uint32_t nElementBytes);
+uint32_t XORSATFilterMetadataRetrievalBatchRate(const XORSATFilterQuerier *xsfq);
+double XORSATFilterFalsePositiveRate(const XORSATFilterQuerier *xsfq);
+uint64_t XORSATAncillarySize(const XORSATFilterQuerier *xsfq);
+uint64_t XORSATFilterSize(const XORSATFilterQuerier *xsfq);
+uint64_t XORSATMetaDataSize(const XORSATFilterQuerier *xsfq);
+double XORSATFilterEfficiency(const XORSATFilterQuerier *xsfq, uint64_t nElements, double p);
+double XORSATMetaDataEfficiency(const XORSATFilterQuerier *xsfq, uint64_t nElements);
+
+uint64_t XORSATFilterGetBlockIndex(const XORSATFilterQuerier *xsfq, uint32_t nBlock);
+uint64_t *XORSATFilterMapAnonymous(size_t nBytes, uint32_t nHugePages, size_t *pMappedBytes);
+double XORSATFilterWallTime(void);
 
 #endif
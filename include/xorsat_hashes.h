@@ -34,6 +34,19 @@ typedef struct XORSATFilterHash128 {
   };
 } XORSATFilterHash128;
 
+//Callers that already have a 64-bit hash of each element may build and
+//query with it directly (see XORSATFilterBuilderAddHash and
+//XORSATFilterQueryHash) instead of hashing elements with
+//XORSATFilterGenerateHashesFromElement. The contract is:
+//  - h1 is 63 bits, must be nonzero, and should be uniformly
+//    distributed. XORSATFilterHashFromUint64 converts a 64-bit hash.
+//  - The same hash must be used for an element when building and
+//    when querying. Elements hashed by the library use the low 63
+//    bits of XXH3 seeded with 0x1ae202980e70d8f1 (retrying with
+//    seed+1, seed+2, ... while the result is zero), so the two kinds
+//    of hashes can't be mixed unless the caller does the same.
+//  - present is set by the library; callers may leave it alone.
+//A hash can be computed once and used to query any number of filters.
 typedef struct XORSATFilterHash {
   uint64_t h1:63;
   uint8_t present:1;
@@ -47,10 +60,178 @@ typedef struct XORSATFilterRow {
   uint32_t rhs;
 } XORSATFilterRow;
 
+//nLitsPerRow selecting ribbon rows, a value above the 20 literals a
+//WRS row may have (nLitsPerRow of 1 still means DW rows). Each row is one band of
+//XORSATFILTER_RIBBON_WIDTH consecutive variables starting at nStart;
+//bit i of c[i/64] says whether variable nStart+i is in the row, and
+//bit 0 is always set. Banded rows are solved in near-linear time (see
+//src/xorsat_ribbon.c), so blocks can be much larger than with DW rows.
+#define XORSATFILTER_RIBBON 21
+#define XORSATFILTER_RIBBON_WIDTH 128
+
+typedef struct XORSATFilterRibbonRow {
+  uint64_t c[XORSATFILTER_RIBBON_WIDTH / 64];
+  uint32_t nStart;
+  uint32_t rhs;
+} XORSATFilterRibbonRow;
+
+//Flags for XORSATFilterParameters.nFormat. They change how hashes map
+//to blocks and variables, so they are stored with serialized filters.
+//0 is the original format.
+#define XORSATFILTER_FORMAT_FASTRANGE 0x1 //Multiply-shift instead of modulo when mapping hashes
+#define XORSATFILTER_FORMAT_WRS_WINDOW 0x2 //WRS rows draw all literals from one small window of the block
+#define XORSATFILTER_FORMAT_DW_INTERLEAVED 0x4 //DW filters store the solution bits of each 16-variable window together
+#define XORSATFILTER_FORMAT_ALL       0x7
+
+//A WRS window covers this many bits of a block's solution, so a query
+//touches one or two adjacent cache lines instead of nLitsPerRow
+//random ones. Never fewer than XORSATFILTER_WRS_WINDOW_MIN variables,
+//otherwise blocks with many metadata bits would rarely be solvable.
+#define XORSATFILTER_WRS_WINDOW_BITS 512
+#define XORSATFILTER_WRS_WINDOW_MIN  64
+
 create_c_list_headers(XORSATFilterHash_list, XORSATFilterHash)
 
 XORSATFilterHash XORSATFilterGenerateHashesFromElement(const void *pElement, size_t nElementBytes);
-uint32_t XORSATFilterHashToBlock(XORSATFilterHash hash, uint32_t nBlocks);
-void XORSATFilterGenerateRowFromHash_WRS(XORSATFilterHash xsfh, uint32_t nVariables, uint32_t *pRow, uint8_t nLitsPerRow);
-XORSATFilterRow XORSATFilterGenerateRowFromHash_DW(XORSATFilterHash xsfh, uint32_t nVariables);
+XORSATFilterHash XORSATFilterHashFromUint64(uint64_t nHash);
+uint32_t XORSATFilterHashToBlock(XORSATFilterHash hash, uint32_t nBlocks, uint8_t nFormat);
+uint32_t XORSATFilterWRSWindowSlice(uint32_t nRHSBits, uint8_t nLitsPerRow);
+void XORSATFilterGenerateRowFromHash_WRS(XORSATFilterHash xsfh, uint32_t nVariables, uint32_t *pRow, uint8_t nLitsPerRow, uint8_t nFormat, uint32_t nSlice);
+XORSATFilterRow XORSATFilterGenerateRowFromHash_DW(XORSATFilterHash xsfh, uint32_t nVariables, uint8_t nFormat);
+XORSATFilterRibbonRow XORSATFilterGenerateRowFromHash_Ribbon(XORSATFilterHash xsfh, uint32_t nVariables, uint8_t nFormat);
+
+//Lemire's multiply-shift reduction of an nBits-bit value x into [0, n)
+#define XORSATFILTER_FASTRANGE(x, n, nBits) ((uint32_t) ((((uint64_t) (x)) * (uint64_t) (n)) >> (nBits)))
+
+//Row generation is defined here so the query kernels in
+//src/xorsat_query.c can inline it and fold in their constant
+//parameters. Elsewhere, use the XORSATFilterGenerateRowFromHash_*
+//functions declared above.
+
+//Places a literal drawn from a slice of a WRS window into the block,
+//wrapping windows around the end of the block. Without
+//XORSATFILTER_FORMAT_WRS_WINDOW nOffset is 0 and this is the identity.
+static inline
+uint32_t XORSATFilterWindowVariable(uint32_t nLiteral, uint32_t nOffset, uint32_t nVariables) {
+  nLiteral += nOffset;
+  return nLiteral - ((nLiteral >= nVariables) ? nVariables : 0);
+}
+
+static inline __attribute__((always_inline))
+void XORSATFilterRowFromHash_WRS(XORSATFilterHash xsfh, uint32_t nVariables, uint32_t *pRow, uint8_t nLitsPerRow, uint8_t nFormat, uint32_t nSlice) {
+  uint32_t i = 0;
+  uint32_t nStart = 0;
+  uint32_t nStride = 0;
+  uint32_t nBlockVariables = nVariables;
+
+  //Literals are drawn from the nSlice*nLitsPerRow variables starting at nStart
+  if((nFormat & XORSATFILTER_FORMAT_WRS_WINDOW) && (nSlice * nLitsPerRow) < nVariables) {
+    //Windows may start at any variable and wrap around the end of the
+    //block, so every variable is covered by the same number of windows.
+    //Without wrapping the middle of the block is overloaded and unsolvable.
+    nStart = XORSATFILTER_FASTRANGE((((uint64_t) xsfh.h1) * (uint64_t)0xc2b2ae3d27d4eb4f) >> 32, nVariables, 32);
+    nStride = nSlice;
+    nVariables = nSlice;
+  }
+
+  XORSATFilterHash128 xsfh_128;
+  xsfh_128.h1 = xsfh.h1;
+  xsfh_128.h2 = xsfh_128.h1 ^ 0xc93bd65d1f9ade1a;
+  
+  uint16_t *xsfh_16 = xsfh_128.h16;
+
+  //Can get 5 values with little effort
+  if(nFormat & XORSATFILTER_FORMAT_FASTRANGE) {
+    for(; i < nLitsPerRow && i < 5; i++) {
+      //h16[3] holds the top 15 bits of the 63-bit h1
+      pRow[i] = XORSATFilterWindowVariable(XORSATFILTER_FASTRANGE(xsfh_16[i], nVariables, i == 3 ? 15 : 16), nStart + (i * nStride), nBlockVariables);
+    }
+  } else {
+    for(; i < nLitsPerRow && i < 5; i++) {
+      pRow[i] = XORSATFilterWindowVariable(xsfh_16[i] % nVariables, nStart + (i * nStride), nBlockVariables);
+    }
+  }
+
+  //Spin up an LFSR for larger number of literals
+  for(; i < nLitsPerRow; i++) {
+    //Primitive polynomial 1 + x^2 + x^3 + x^4 + x^8
+    xsfh_128.h1 = xsfh_128.h1 >> 16;
+    xsfh_16[3]  = xsfh_16[4];
+    xsfh_128.h2 = xsfh_128.h2 >> 16;
+    xsfh_16[7] ^= xsfh_16[0] ^ xsfh_16[2] ^ xsfh_16[3] ^ xsfh_16[4];
+
+    if(nFormat & XORSATFILTER_FORMAT_FASTRANGE) {
+      pRow[i] = XORSATFilterWindowVariable(XORSATFILTER_FASTRANGE(xsfh_16[5], nVariables, 16), nStart + (i * nStride), nBlockVariables);
+    } else {
+      pRow[i] = XORSATFilterWindowVariable(xsfh_16[5] % nVariables, nStart + (i * nStride), nBlockVariables);
+    }
+  }
+
+  pRow[i] = xsfh.present ? ((uint32_t *)&xsfh_128)[3] : ~((uint32_t *)&xsfh_128)[3]; //Allow up to 32 solutions
+}
+
+static inline __attribute__((always_inline))
+XORSATFilterRow XORSATFilterRowFromHash_DW(XORSATFilterHash xsfh, uint32_t nVariables, uint8_t nFormat) {
+  XORSATFilterHash128 xsfh_128;
+      
+  xsfh_128.h1 = xsfh.h1;
+  //xsfh_128.h2 = XXH64((uint8_t *)&xsfh_128.h1, 4, (unsigned long long)0x1ae202980e70d8f1);
+  //xsfh_128.h2 = XXH64(NULL, 0, xsfh_128.h1);
+  xsfh_128.h2 = xsfh.h1 ^ 0xc93bd65d1f9ade1a;
+
+  uint16_t *xsfh_16 = xsfh_128.h16;
+  uint32_t *xsfh_32 = xsfh_128.h32;
+
+  uint32_t nBlocks = nVariables >> 4;
+  
+  XORSATFilterRow xsfrow;
+  if(nFormat & XORSATFILTER_FORMAT_FASTRANGE) {
+    uint32_t b2;
+    xsfrow.b1 = XORSATFILTER_FASTRANGE(xsfh_16[2], nBlocks, 16);
+    //h16[3] holds the top 15 bits of the 63-bit h1
+    b2 = XORSATFILTER_FASTRANGE(xsfh_16[3], nBlocks - 1, 15) + 1 + xsfrow.b1;
+    xsfrow.b2 = (b2 >= nBlocks) ? b2 - nBlocks : b2;
+  } else {
+    xsfrow.b1 = xsfh_16[2] % nBlocks;
+    xsfrow.b2 = ((xsfh_16[3] % (nBlocks - 1)) + 1 + xsfrow.b1) % nBlocks;
+  }
+
+  xsfrow.p1 = xsfh_16[4];
+  if(xsfrow.p1 == 0) xsfrow.p1 = 1;
+  xsfrow.p2 = xsfh_16[5];
+  if(xsfrow.p2 == 0) xsfrow.p2 = 1;
+  
+  xsfrow.rhs = xsfh.present ? xsfh_32[3] : ~xsfh_32[3]; //Allow up to 32 solutions
+  return xsfrow;
+}
+
+//The 63-bit hash is stretched over the band's 128 coefficients, its
+//start and the right hand side by multiply-xorshift mixing (the
+//finalizers of SplitMix64 and MurmurHash3). nVariables must be at
+//least XORSATFILTER_RIBBON_WIDTH.
+static inline __attribute__((always_inline))
+XORSATFilterRibbonRow XORSATFilterRowFromHash_Ribbon(XORSATFilterHash xsfh, uint32_t nVariables, uint8_t nFormat) {
+  XORSATFilterRibbonRow xsfrow;
+  uint64_t m1 = xsfh.h1;
+  m1 = (m1 ^ (m1 >> 32)) * (uint64_t)0xd6e8feb86659fd93;
+  m1 ^= m1 >> 32;
+  uint64_t m2 = (m1 ^ (uint64_t)0x9e3779b97f4a7c15) * (uint64_t)0xbf58476d1ce4e5b9;
+  m2 ^= m2 >> 31;
+  uint64_t m3 = (m2 ^ (m2 >> 29)) * (uint64_t)0x94d049bb133111eb;
+  m3 ^= m3 >> 32;
+
+  uint32_t nStarts = nVariables - XORSATFILTER_RIBBON_WIDTH + 1;
+  if(nFormat & XORSATFILTER_FORMAT_FASTRANGE) {
+    xsfrow.nStart = XORSATFILTER_FASTRANGE(m1 >> 32, nStarts, 32);
+  } else {
+    xsfrow.nStart = ((uint32_t) (m1 >> 32)) % nStarts;
+  }
+
+  xsfrow.c[0] = m2 | 1;
+  xsfrow.c[1] = m3;
+
+  xsfrow.rhs = xsfh.present ? (uint32_t) m1 : ~(uint32_t) m1; //Allow up to 32 solutions
+  return xsfrow;
+}
+
 #endif
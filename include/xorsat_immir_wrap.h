@@ -9,8 +9,8 @@
 
 #include "immir.h"
 
-gf2_t *XORSATFilterBuildIMMIRMatrix_DW(XORSATFilterBlock *pBlock);
-gf2_t *XORSATFilterBuildIMMIRMatrix_WRS(XORSATFilterBlock *pBlock);
-uint8_t XORSATFilterFindIMMIRSolutions(gf2_t *pMatrix, bitvector_t *pSolutions);
+gf2_t *XORSATFilterBuildIMMIRMatrix_DW(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch);
+gf2_t *XORSATFilterBuildIMMIRMatrix_Core(const XORSATFilterBlock *pBlock, const uint32_t *pCoreRows, uint32_t nCoreRows, uint32_t nColumns, const uint32_t *pLits, const uint8_t *pNumLits, const uint32_t *pRowBits, XORSATFilterScratch *pScratch);
+uint8_t XORSATFilterFindIMMIRSolutions(gf2_t *pMatrix, uint64_t *pSolutions, uint32_t nRHSWords, uint64_t *pRandomState);
 
 #endif
@@ -7,12 +7,10 @@
 #ifndef XORSATMETADATA_H
 #define XORSATMETADATA_H
 
-typedef struct XORSATFilterMetaData {
-  uint8_t *pMetaData;
-} XORSATFilterMetaData;
+//A builder keeps the metadata of all its elements in one contiguous
+//arena, nMetaDataBytes per element, in the same order as its hashes.
+//Element i's metadata starts at pList + i*nMetaDataBytes.
+uint8_t XORSATFilterMetaDataAppend(uint8_t_list *pArena, const void *pMetaData, size_t nMetaDataBytes);
+uint8_t XORSATFilterMetaDataReserve(uint8_t_list *pArena, size_t nBytes);
 
-create_c_list_headers(XORSATFilterMetaData_list, XORSATFilterMetaData)
-
-void XORSATFilterMetaDataFree(XORSATFilterMetaData *pData);
-  
 #endif
@@ -0,0 +1,33 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#ifndef XORSATNUMA_H
+#define XORSATNUMA_H
+
+//A querier replicated once per NUMA node that has CPUs. Each replica's
+//filter lives in memory bound to its node, and queries made through
+//XORSATFilterNUMALocalQuerier use the replica of the node the calling
+//thread is running on, so no query reads the filter across sockets.
+//Like an XORSATFilterQuerier, it may be queried from any number of
+//threads at once; Reload and Free need every other user to be done.
+typedef struct XORSATFilterNUMAQuerier {
+  uint32_t nNodes;                   //Highest node number + 1
+  uint32_t nCPUs;                    //Highest CPU number + 1
+  int32_t *pCPUNodes;                //Node of each CPU, -1 if unknown
+  XORSATFilterQuerier **ppReplicas;  //One per node, NULL for nodes without CPUs
+} XORSATFilterNUMAQuerier;
+
+XORSATFilterNUMAQuerier *XORSATFilterNUMAQuerierAlloc(const XORSATFilterQuerier *xsfq);
+uint8_t XORSATFilterNUMAQuerierReload(XORSATFilterNUMAQuerier *xsfnq, const XORSATFilterQuerier *xsfq);
+void XORSATFilterNUMAQuerierFree(XORSATFilterNUMAQuerier *xsfnq);
+
+const XORSATFilterQuerier *XORSATFilterNUMALocalQuerier(const XORSATFilterNUMAQuerier *xsfnq);
+const XORSATFilterQuerier *XORSATFilterNUMANodeQuerier(const XORSATFilterNUMAQuerier *xsfnq, uint32_t nNode);
+uint8_t XORSATFilterNUMAQuery(const XORSATFilterNUMAQuerier *xsfnq, const void *pElement, uint32_t nElementBytes);
+
+uint64_t XORSATFilterNUMAQueryRate(const XORSATFilterNUMAQuerier *xsfnq, uint32_t nThreadsPerNode, uint8_t bRemote, uint32_t *pThreadRates);
+
+#endif
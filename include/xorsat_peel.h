@@ -0,0 +1,12 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#ifndef XORSATPEEL_H
+#define XORSATPEEL_H
+
+uint8_t XORSATFilterFindPeeledSolutions(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch);
+
+#endif
@@ -0,0 +1,12 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#ifndef XORSATRIBBON_H
+#define XORSATRIBBON_H
+
+uint8_t XORSATFilterFindRibbonSolutions(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch);
+
+#endif
@@ -0,0 +1,68 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#ifndef XORSATSCHEDULE_H
+#define XORSATSCHEDULE_H
+
+#include "immir.h"
+
+//Buffers of an XORSATFilterScratch, one per array a block solve needs
+//at the same time as the others.
+enum {
+  XORSATFILTER_SCRATCH_DUPLICATES,     //Table of XORSATFilterBlockRemoveDuplicates
+  XORSATFILTER_SCRATCH_MATRIX,         //IMMIR matrix, see XORSATFilterScratchMatrix
+  XORSATFILTER_SCRATCH_PIVOTS,
+  XORSATFILTER_SCRATCH_TABLE,          //4 Russians tables of gf2_semi_ech
+  XORSATFILTER_SCRATCH_TABLE_INDEX,
+  XORSATFILTER_SCRATCH_SOLUTIONS,      //nRHSWords per variable of the block
+  XORSATFILTER_SCRATCH_CORE_SOLUTIONS, //nRHSWords per column of a peeled block's core
+  XORSATFILTER_SCRATCH_BANDS,          //Ribbon bands
+  XORSATFILTER_SCRATCH_LITS,           //The rest belong to XORSATFilterFindPeeledSolutions
+  XORSATFILTER_SCRATCH_NUM_LITS,
+  XORSATFILTER_SCRATCH_ROW_BITS,
+  XORSATFILTER_SCRATCH_PEELED,
+  XORSATFILTER_SCRATCH_DEGREES,
+  XORSATFILTER_SCRATCH_ROW_XORS,
+  XORSATFILTER_SCRATCH_STACK,
+  XORSATFILTER_SCRATCH_ORDER_ROWS,
+  XORSATFILTER_SCRATCH_ORDER_VARS,
+  XORSATFILTER_SCRATCH_COLUMNS,
+  XORSATFILTER_SCRATCH_CORE_ROWS,
+  XORSATFILTER_SCRATCH_BUFFERS
+};
+
+//Memory a worker reuses for every block it solves. A buffer only grows,
+//at least doubling each time, so once a worker has solved its
+//first (largest, see XORSATFilterSchedulerRun) block, solving the rest
+//and retrying unsatisfiable ones allocates nothing but the blocks'
+//solutions.
+typedef struct XORSATFilterScratch {
+  void *ppBuffers[XORSATFILTER_SCRATCH_BUFFERS];
+  size_t pBufferBytes[XORSATFILTER_SCRATCH_BUFFERS];
+  gf2_t sMatrix;
+} XORSATFilterScratch;
+
+void *XORSATFilterScratchBuffer(XORSATFilterScratch *pScratch, uint32_t nBuffer, size_t nBytes);
+void *XORSATFilterScratchZeroed(XORSATFilterScratch *pScratch, uint32_t nBuffer, size_t nBytes);
+void XORSATFilterScratchFree(XORSATFilterScratch *pScratch);
+
+//Workers that solve blocks for XORSATFilterBuilderFinalize and
+//XORSATFilterBuilderFinalizeToFile, each with its own scratch. When
+//bPinThreads is set, worker i runs only on the i-th CPU (modulo their
+//number) the process may use; pCPUs holds each worker's CPU, or -1.
+typedef struct XORSATFilterScheduler {
+  uint32_t nThreads;
+  int32_t *pCPUs;
+  XORSATFilterScratch *pScratch;
+} XORSATFilterScheduler;
+
+XORSATFilterScheduler *XORSATFilterSchedulerAlloc(uint32_t nThreads, uint8_t bPinThreads);
+void XORSATFilterSchedulerRun(XORSATFilterScheduler *pScheduler, XORSATFilterBlock *pBlocks, uint32_t nBlocks);
+void XORSATFilterSchedulerFree(XORSATFilterScheduler *pScheduler);
+
+uint32_t XORSATFilterDefaultThreads(void);
+
+#endif
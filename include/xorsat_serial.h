@@ -7,15 +7,45 @@
 #ifndef XORSATSERIAL_H
 #define XORSATSERIAL_H
 
+//nLitsPerRow is at most 20, or XORSATFILTER_RIBBON (21), so the top
+//bits of its byte in the header hold the filter's XORSATFILTER_FORMAT_*
+//flags. Filters written before these flags existed have them clear and
+//keep their original meaning.
+#define XORSATFILTER_SERIAL_LITS_MASK    0x1f
+#define XORSATFILTER_SERIAL_FORMAT_SHIFT 5
+
 typedef struct XORSATFilterSerialData {
   uint32_t nBlocks;
   uint16_t nAvgVarsPerBlock;
   uint8_t nSolutions;
   size_t nMetaDataBytes;
-  uint8_t nLitsPerRow;  
+  uint8_t nLitsPerRow;  //Low 5 bits: nLitsPerRow, high 3 bits: nFormat
 } XORSATFilterSerialData;
 
-uint8_t XORSATFilterSerialize(FILE *pXORSATFilterFile, XORSATFilterQuerier *xsfq);
+//Flags for XORSATFilterLoadOptions.nFlags. By default a filter file is
+//mapped privately and paged in by the queries that touch it.
+#define XORSATFILTER_LOAD_POPULATE 0x01 //MAP_POPULATE: read the whole file in while loading
+#define XORSATFILTER_LOAD_PRETOUCH 0x02 //Touch every page from nPretouchThreads threads
+#define XORSATFILTER_LOAD_HUGEPAGE 0x04 //madvise(MADV_HUGEPAGE), needs THP support for the file system
+#define XORSATFILTER_LOAD_WILLNEED 0x08 //madvise(MADV_WILLNEED): start reading ahead in the background
+#define XORSATFILTER_LOAD_COPY_2MB 0x10 //Copy into anonymous memory backed by 2 MB huge pages
+#define XORSATFILTER_LOAD_COPY_1GB 0x20 //Copy into anonymous memory backed by 1 GB huge pages
+#define XORSATFILTER_LOAD_MLOCK    0x40 //mlock() the filter so it is never paged out
+#define XORSATFILTER_LOAD_SHARED   0x80 //MAP_SHARED, so processes loading the same file share its pages
+//The COPY flags need pages reserved in /proc/sys/vm/nr_hugepages (or the
+//1 GB equivalent); without them the copy falls back to transparent huge
+//pages. Copies are private to the process, so SHARED, POPULATE,
+//HUGEPAGE and WILLNEED don't apply to them.
+
+typedef struct XORSATFilterLoadOptions {
+  uint32_t nFlags;           //Bitwise OR of XORSATFILTER_LOAD_* flags
+  uint32_t nPretouchThreads; //Threads used by XORSATFILTER_LOAD_PRETOUCH (0 means 1)
+  double fLoadSeconds;       //Set to the wall-clock time spent loading
+} XORSATFilterLoadOptions;
+
+uint8_t XORSATFilterSerialize(FILE *pXORSATFilterFile, const XORSATFilterQuerier *xsfq);
+uint8_t XORSATFilterSerializeOffsets(FILE *pXORSATFilterFile, const XORSATFilterQuerier *xsfq);
 XORSATFilterQuerier *XORSATFilterDeserialize(FILE *pXORSATFilterFile);
+XORSATFilterQuerier *XORSATFilterDeserializeWithOptions(FILE *pXORSATFilterFile, XORSATFilterLoadOptions *pOptions);
 
 #endif
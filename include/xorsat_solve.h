@@ -7,6 +7,8 @@
 #ifndef XORSATSOLVE_H
 #define XORSATSOLVE_H
 
-uint8_t XORSATFilterSolveBlock(XORSATFilterBlock *pBlock);
+uint8_t XORSATFilterSolveBlock(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch);
+uint32_t XORSATFilterSolveBlocks(XORSATFilterBlock *pBlocks, uint32_t nBlocks, uint32_t nPredictedWords, XORSATFilterScheduler *pScheduler);
+uint32_t XORSATFilterBlocksFailed(const XORSATFilterBlock *pBlocks, uint32_t nBlocks);
 
 #endif
@@ -1,5 +1,10 @@
 #include "immir.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define GF2_X86 1
+#include <immintrin.h>
+#endif
+
 // ----------------------------------------------------------------------
 // --- static helper functions should be inlined
 
@@ -17,11 +22,102 @@ static uint64_t bit (uint64_t *V, int i) {
   return (V[i/64] & probe) != 0;
 }
 
-static void addrows (uint64_t * restrict A, uint64_t * restrict B, uint64_t * restrict C, int s, int wds) {
-  for (int w = s; w < wds; w++)
+// ----------------------------------------------------------------------
+// row kernels: A = B ^ C over words w0 .. wds-1 (A may be B), and the
+// 4 Russians reduction of rows i0 .. m-1 of A by table Z. A kernel is
+// chosen for the CPU when the library is loaded, see gf2_simd().
+
+static void addrows_word (uint64_t *A, const uint64_t *B, const uint64_t *C, int w0, int wds) {
+  for (int w = w0; w < wds; w++)
     A[w] = B[w] ^ C[w];
 }
 
+static void reduce_word (uint64_t *A, const uint64_t *Z, int i0, int m, int s, int S, int w0, int wds) {
+  for (int i = i0; i < m; i++) {
+    uint64_t *row = A + (size_t) i * wds;
+    addrows_word (row, row, Z + bits(row, s, S) * wds, w0, wds);
+  }
+}
+
+#ifdef GF2_X86
+__attribute__((target("avx2")))
+static void addrows_avx2 (uint64_t *A, const uint64_t *B, const uint64_t *C, int w0, int wds) {
+  int w = w0;
+  for (; w + 4 <= wds; w += 4) {
+    __m256i b = _mm256_loadu_si256((const __m256i *) (B + w));
+    __m256i c = _mm256_loadu_si256((const __m256i *) (C + w));
+    _mm256_storeu_si256((__m256i *) (A + w), _mm256_xor_si256(b, c));
+  }
+  for (; w < wds; w++)
+    A[w] = B[w] ^ C[w];
+}
+
+__attribute__((target("avx2")))
+static void reduce_avx2 (uint64_t *A, const uint64_t *Z, int i0, int m, int s, int S, int w0, int wds) {
+  for (int i = i0; i < m; i++) {
+    uint64_t *row = A + (size_t) i * wds;
+    addrows_avx2 (row, row, Z + bits(row, s, S) * wds, w0, wds);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void addrows_avx512 (uint64_t *A, const uint64_t *B, const uint64_t *C, int w0, int wds) {
+  int w = w0;
+  for (; w + 8 <= wds; w += 8) {
+    __m512i b = _mm512_loadu_si512((const void *) (B + w));
+    __m512i c = _mm512_loadu_si512((const void *) (C + w));
+    _mm512_storeu_si512((void *) (A + w), _mm512_xor_si512(b, c));
+  }
+  if (w < wds) {
+    // the last (up to 7) words under a mask
+    __mmask8 k = (__mmask8) ((1u << (wds - w)) - 1);
+    __m512i b = _mm512_maskz_loadu_epi64(k, (const void *) (B + w));
+    __m512i c = _mm512_maskz_loadu_epi64(k, (const void *) (C + w));
+    _mm512_mask_storeu_epi64((void *) (A + w), k, _mm512_xor_si512(b, c));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void reduce_avx512 (uint64_t *A, const uint64_t *Z, int i0, int m, int s, int S, int w0, int wds) {
+  for (int i = i0; i < m; i++) {
+    uint64_t *row = A + (size_t) i * wds;
+    addrows_avx512 (row, row, Z + bits(row, s, S) * wds, w0, wds);
+  }
+}
+
+#endif
+
+static void (*addrows) (uint64_t *A, const uint64_t *B, const uint64_t *C, int w0, int wds) = addrows_word;
+static void (*reduce) (uint64_t *A, const uint64_t *Z, int i0, int m, int s, int S, int w0, int wds) = reduce_word;
+
+// selects the fastest row kernels the CPU has, up to level (one of
+// GF2_SIMD_*), and returns the level selected. The library selects
+// GF2_SIMD_AVX512 when loaded; a lower level is mostly for testing and
+// must not be set while any thread is in gf2_semi_ech.
+int gf2_simd(int level) {
+#ifdef GF2_X86
+  __builtin_cpu_init();
+  if (level >= GF2_SIMD_AVX512 && __builtin_cpu_supports("avx512f")) {
+    addrows = addrows_avx512;
+    reduce = reduce_avx512;
+    return GF2_SIMD_AVX512;
+  }
+  if (level >= GF2_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+    addrows = addrows_avx2;
+    reduce = reduce_avx2;
+    return GF2_SIMD_AVX2;
+  }
+#endif
+  addrows = addrows_word;
+  reduce = reduce_word;
+  return GF2_SIMD_WORD;
+}
+
+__attribute__((constructor))
+static void gf2_simd_init(void) {
+  gf2_simd(GF2_SIMD_AVX512);
+}
+
 static uint64_t dotprod (uint64_t *A, uint64_t *B, int w0, int w1) {
   uint64_t x = 0;
   for (int w = w0; w < w1; w++)
@@ -33,145 +129,157 @@ static uint64_t dotprod (uint64_t *A, uint64_t *B, int w0, int w1) {
 // main worker functions
 
 static int semi_ech(const int m, const int n, const int wds, uint64_t (*A)[wds],
-                    int S, int *piv) {
+                    int S, int *piv, void *table, int *tableindex) {
 
   // 4 Russians with S bit tables; Z[] holds the precomputed row sums,
   // z[] the indexing into Z[] required since we don't reduce above the
-  // block diagonal...
+  // block diagonal... the caller may supply them (2^S rows each)
 
   if (S == 0) S = log(m); // reasonable default
 
   const int SS = (1<<S);
   // could skip mallocs here if S < 2
-  uint64_t (*Z)[wds] = malloc(SS * sizeof *Z); // Z[SS][wds]
-  int *z = malloc(SS * sizeof *z);
+  uint64_t (*Z)[wds] = table;
+  int *z = tableindex;
+  if (table == NULL && posix_memalign((void **) &Z, 64, SS * sizeof *Z) != 0)
+    Z = NULL; // Z[SS][wds], aligned like the matrix
+  if (tableindex == NULL) z = malloc(SS * sizeof *z);
   assert(Z);
   assert(z);
 
   int r = 0; // row in reduction
-  int s = 0; // block start for 4 Russians table
+  int s = 0; // block start (column) for 4 Russians table
 
   if (piv) for (int r=0; r<m; r++) piv[r] = -1;
 
   /* 
      This diagram summarises the method. We use "4 Russian" tables
-     of width S bits (S=3 below); current block starts at column s;
-     to find pivot for row r, we start at j=r and reduce to the
-     left using pivots s .. r-1; then check whether row j has a
-     pivot for row r -- if it does, (possibly) xor it onto row r.
-     Once the block is complete, form the table of size 2^S and
-     reduce below...
+     of width S bits (S=3 below); current block starts at column s
+     and its pivots at row r0; to find a pivot for column c in row r,
+     we start at j=r and reduce to the left using the block's pivots
+     found so far (rows r0 .. r-1); then check whether row j has a
+     pivot for column c -- if it does, (possibly) xor it onto row r.
+     Once the block is done, form the table of size 2^S and reduce
+     below...
 
          +-----+--------------------------------+
          |1 * *|* * * * * * * * * * * * * * * * |
          |  1 *|* * * * * * * * * * * * * * * * |
          |    1|* * * * * * * * * * * * * * * * |
          +-----+-----+--------------------------+
-     s-> |     |1 * *|* * * * * * * * * * * * * |
+    r0-> |     |1 * *|* * * * * * * * * * * * * |
          |     |0 0 *|* * * * * * * * * * * * * | <- r
          |     |0 0 *|* * * * * * * * * * * * * |
          |     |* * *|* * * * * * * * * * * * * | <- j
          |     |* * *|* * * * * * * * * * * * * |
          |     |* * *|* * * * * * * * * * * * * |
          +--------------------------------------+
-
-      On failure to find a pivot, break out for a simpler loop
-      that finishes it off.
+                ^ s
+
+      A column without a pivot is zero in every row from r down once
+      they have been reduced, so it is skipped and the block has
+      fewer than S pivots; the table holds the sums of those it has,
+      indexed by their bits in the block's S columns, which are all
+      that can be set below. (Sparse matrices, such as those of 2
+      literals per row, have many such columns.) Any columns left
+      over, fewer than S, are finished off by a simpler loop.
+
+      Rows from r0 down, and so the table rows made from them, are
+      zero left of column s; row xors may start at any word up to
+      s/64. They start at the GF2_ALIGN_WORDS aligned word w0 at or
+      below it so the row kernels work on whole aligned vectors
+      (gf2_init pads wds to match).
 
    */
 
-  for (; S > 1 && s + S <= m && r == s; s += S) {
+  for (; S > 1 && s + S <= n && r < m; s += S) {
 
     // S columns at a time for 4 Russians method
+    const int w0 = (s/64) & ~(GF2_ALIGN_WORDS-1);
+    const int r0 = r;
+    int pc[S]; // pivot column of each of rows r0 .. r-1
 
-    // NB: when we break out of following loop because there
-    // is no pivot for column r, then the condition r==s above
-    // will be violated.
+    for (int c = s; c < s + S && r < m; c++) {
 
-    for (r = s; r < s + S; r++) {
-
-      // find a row with pivot in column r
+      // find a row with pivot in column c
       int j;
       for (j = r; j < m; j++) {
-        for (int k = s; k < r; k++)
+        for (int k = r0; k < r; k++)
           // reduce relative to this block using pivots found so far
-          if (bit(A[j], k))
-            addrows (A[j], A[j], A[k], s/64, wds);
+          if (bit(A[j], pc[k-r0]))
+            addrows (A[j], A[j], A[k], w0, wds);
         // now check for new pivot
-        if (bit(A[j], r)) break;
+        if (bit(A[j], c)) break;
       }
 
       if  (j == m)
-        // no pivot in this column, skip to next section
-        break;
+        // no pivot in this column, try the next one
+        continue;
 
       if (j != r) 
         // xor onto row r to get pivot there (if it's not already)
-        addrows (A[r], A[r], A[j], s/64, wds);
+        addrows (A[r], A[r], A[j], w0, wds);
 
-      if (piv) piv[r] = r;
+      pc[r-r0] = c;
+      if (piv) piv[r] = c;
+      r++;
     }
-  
-    // missing pivot; break out to clean up loop
-    if (r != s + S) break;
 
-    // we have a full block of S new pivots, let's reduce below
-    // this block -- unless there are no rows below us...
-    if (s + S == m) break;
+    // nothing to reduce by, or nothing below to reduce
+    if (r == r0) continue;
+    if (r == m) break;
 
     // instead of reducing above the block to compute the Z table,
     // we'll figure it out using an array of indices...
 
     // first, clear Z[0]
     z[0] = 0;
-    for (int w = s/64; w < wds; w++)
+    for (int w = w0; w < wds; w++)
       Z[0][w] = 0;
     
-    // now, for each pivot 0,...,S-1
-    for (int i = 0; i < S; i++) {
+    // now, for each pivot 0,...,r-r0-1
+    for (int i = 0; i < r - r0; i++) {
       int ii = 1<<i;
-      int vv = bits(A[s+i], s, S);
+      int vv = bits(A[r0+i], s, S);
       // copy block of size 2^i and xor i-th row onto it
       for (int j = 0; j < ii; j++) {
         int a = z[j], b = a ^ vv;
         z[j+ii] = b;
-        addrows (Z[b], Z[a], A[s+i], s/64, wds);
+        addrows (Z[b], Z[a], A[r0+i], w0, wds);
       }
     }
 
-    // now reduce below this full-rank block
-    for (int i = s + S; i < m; i++) {
-      int c = bits(A[i], s, S);
-      addrows (A[i], A[i], Z[c], s/64, wds);
-    }
+    // now reduce below this block
+    reduce (A[0], Z[0], r, m, s, S, w0, wds);
 
   }
 
   // at this point, we have rows down to r in upper-triangular
-  // form and have cleared below them. We are either missing a
-  // pivot, or didn't have enough columns for the 4 Russians method.
+  // form and have cleared below them, in every column left of s.
+  // Either no rows are left, or too few columns for the 4 Russians
+  // method.
 
-  int c = r; // column to probe for pivot
+  int c = s; // column to probe for pivot
   for (; r < m && c < n;) {
     int j;
     for (j = r; j < m; j++)
       if (bit(A[j], c))
         break;
     if (j == m) { c++; continue; }
+    // rows from r down are zero left of column c
+    const int w0 = (c/64) & ~(GF2_ALIGN_WORDS-1);
     if (j > r)
-      for (int w = c/64; w < wds; w++)
-        A[r][w] ^= A[j][w];
+      addrows (A[r], A[r], A[j], w0, wds);
     assert(bit(A[r],c));
     if (piv) piv[r] = c;
     for (j = r+1; j < m; j++)
       if (bit(A[j], c))
-        for (int w = c/64; w < wds; w++)
-          A[j][w] ^= A[r][w];
+        addrows (A[j], A[j], A[r], w0, wds);
     r++, c++;
   }
   
-  free(Z);
-  free(z);
+  if (table == NULL) free(Z);
+  if (tableindex == NULL) free(z);
   return r;
 }
 
@@ -253,18 +361,27 @@ static int solution(const int m,    // height (rows)
   return b;
 }
 
+int gf2_words(int n, int b) {
+  // row width in words for n + b columns, padded to GF2_ALIGN_WORDS
+  int wds = (n + b + 64-1)/64;
+  return (wds + GF2_ALIGN_WORDS-1) & ~(GF2_ALIGN_WORDS-1);
+}
+
 void gf2_init(gf2_t *data) {
   //assert(data->n > 0); //Commented out to successfully build filters /w no elements.
   //assert(data->m > 0);
   // user may set data->wds to save space for a RHS or book-keeping columns
   if (data->wds == 0) 
-    data->wds = (data->n + data->b + 64-1)/64;
+    data->wds = gf2_words(data->n, data->b);
   if (data->tablebits == 0)
     data->tablebits = log(data->m);
   // user may allocate their own array space
   if (data->matrix == NULL) {
-    data->matrix = calloc(data->m * data->wds, sizeof(uint64_t));
+    size_t bytes = (size_t) data->m * data->wds * sizeof(uint64_t);
+    if (posix_memalign(&data->matrix, 64, bytes) != 0)
+      data->matrix = NULL;
     assert(data->matrix);
+    memset(data->matrix, 0, bytes);
     data->free_matrix = 1;
   }
   // user may allocate their own pivot data
@@ -294,7 +411,8 @@ int gf2_semi_ech(gf2_t *data) {
   // while (void *) might be evil, the user is responsible for ensuring A points
   // to an array of the appropriate form
   data->rank   = semi_ech(data->m, data->n, data->wds, data->matrix, 
-                          data->tablebits, data->pivots);
+                          data->tablebits, data->pivots,
+                          data->table, data->tableindex);
   data->corank = data->n - data->rank;
   data->ech = 1;
   return data->rank;
@@ -44,33 +44,38 @@ XORSATFilterParameters XORSATFilterDWFastParameters =
     .nEltsPerBlock = 750,
     .fEfficiency   = 1.00 }; //Achieved efficiency ~95%
 
-create_c_list_type(XORSATFilterBlock_list, XORSATFilterBlock)
+XORSATFilterParameters XORSATFilterRibbonParameters =
+  { .nLitsPerRow   = XORSATFILTER_RIBBON,
+    .nSolutions    = 7,
+    .nEltsPerBlock = 20000,
+    .fEfficiency   = 0.99 }; //Achieved efficiency ~99%
 
-void XORSATFilterBlockAlloc(XORSATFilterBlock *pBlock, uint8_t nSolutions, size_t nMetaDataBytes, uint32_t nVariablesPerBlock, uint8_t nLitsPerRow) {
-  uint32_t i;
+create_c_list_type(XORSATFilterBlock_list, XORSATFilterBlock)
 
+//A block's pHashes and pMetaData are views into the builder's
+//partitioned lists (see XORSATFilterDistributeHashesToBlocks), so the
+//block never allocates or frees them.
+void XORSATFilterBlockAlloc(XORSATFilterBlock *pBlock, uint8_t nSolutions, size_t nMetaDataBytes, uint32_t nVariablesPerBlock, uint8_t nLitsPerRow, uint8_t nFormat) {
   pBlock->nSolutions = nSolutions;
+  pBlock->pSolutionsCompressed = NULL;
 
-  XORSATFilterHash_list_init(&pBlock->pHashes, nVariablesPerBlock);
-  if(nMetaDataBytes > 0) {
-    XORSATFilterMetaData_list_init(&pBlock->pMetaData, nVariablesPerBlock);
-  } else {
-    XORSATFilterMetaData_list_init(&pBlock->pMetaData, 0);
-  }
+  XORSATFilterHash_list_init(&pBlock->pHashes, 0);
+  pBlock->pMetaData = NULL;
   pBlock->nMetaDataBytes = nMetaDataBytes;
   pBlock->nVariables = nVariablesPerBlock;
   pBlock->bBadBlock = 0;
   pBlock->nLitsPerRow = nLitsPerRow;
+  pBlock->nFormat = nFormat;
   pBlock->nThreadNumber = 0;
+  pBlock->nDuplicates = 0;
+  pBlock->nConflictingDuplicates = 0;
+  pBlock->nRetries = 0;
+  pBlock->nRandomState = 0;
 }
 
 void XORSATFilterBlockResize(XORSATFilterBlock *pBlock, uint32_t nVariablesPerBlock) {
-  uint32_t i;
-
   //fprintf(stderr, "resizing block from %u to %u\n", pBlock->nVariables, nVariablesPerBlock);
   pBlock->nVariables = nVariablesPerBlock;
-  
-  XORSATFilterHash_list_resize(&pBlock->pHashes, nVariablesPerBlock);
 }
 
 void XORSATFilterBlockFillToWord(XORSATFilterBlock *pBlock, uint8_t bIncrement) {
@@ -78,57 +83,264 @@ void XORSATFilterBlockFillToWord(XORSATFilterBlock *pBlock, uint8_t bIncrement)
   XORSATFilterBlockResize(pBlock, pBlock->nVariables + i);
 }
 
+//Drops the block's views of the builder's elements. The builder frees them.
+void XORSATFilterBlockReleaseElements(XORSATFilterBlock *pBlock) {
+  XORSATFilterHash_list_init(&pBlock->pHashes, 0);
+  pBlock->pMetaData = NULL;
+}
+
 void XORSATFilterBlockFree(XORSATFilterBlock *pBlock) {
+  XORSATFilterBlockReleaseElements(pBlock);
+  free(pBlock->pSolutionsCompressed);
+  pBlock->pSolutionsCompressed = NULL;
+}
+
+//Gives every block of a build its own stream of XORSATFilterRandom,
+//by mixing the build's seed with the block's number.
+void XORSATFilterBlockSeedRandom(XORSATFilterBlock *pBlock, uint64_t nSeed, uint32_t nBlock) {
+  uint64_t nState = nSeed ^ (((uint64_t) nBlock + 1) * (uint64_t)0x9e3779b97f4a7c15);
+  nState = (nState ^ (nState >> 30)) * (uint64_t)0xbf58476d1ce4e5b9;
+  nState = (nState ^ (nState >> 27)) * (uint64_t)0x94d049bb133111eb;
+  pBlock->nRandomState = nState ^ (nState >> 31);
+}
+
+//Words to start the rest of a build's blocks with, beyond the size
+//fEfficiency gives, once the first nBlocks are solved: the fewest any
+//of them needed, as each retry added one word. 0 unless all
+//XORSATFILTER_CALIBRATION_BLOCKS were solved.
+uint32_t XORSATFilterBlockPredictWords(const XORSATFilterBlock *pBlocks, uint32_t nBlocks) {
   uint32_t i;
+  uint32_t nWords = UINT32_MAX;
 
-  XORSATFilterHash_list_free(&pBlock->pHashes, NULL);
-  XORSATFilterMetaData_list_free(&pBlock->pMetaData, NULL); //Don't free data, pointer is just copied.
+  if(nBlocks < XORSATFILTER_CALIBRATION_BLOCKS) return 0;
+
+  for(i = 0; i < nBlocks; i++) {
+    if(pBlocks[i].nRetries < nWords) nWords = pBlocks[i].nRetries;
+  }
+
+  return nWords;
 }
 
-uint8_t XORSATFilterDistributeHashesToBlocks(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams) {
-  uint32_t i, j, k;
-  uint32_t nBlocks;
-  
-  //Determine number of blocks
-  nBlocks = (xsfb->pHashes.nLength / (uint32_t) sParams.nEltsPerBlock);
+//Writes the right hand side of element i of the block to pRHS: the
+//row's solution bits, then the element's metadata bits, least
+//significant bit of each byte first (as the IMMIR matrices order them).
+void XORSATFilterBlockRowRHS(const XORSATFilterBlock *pBlock, size_t i, uint32_t rhs, uint64_t *pRHS, uint32_t nRHSWords) {
+  size_t k;
+  uint32_t nSolutions = pBlock->nSolutions;
+
+  memset(pRHS, 0, nRHSWords * sizeof(uint64_t));
+  pRHS[0] = (nSolutions < 32) ? (rhs & ((((uint32_t) 1) << nSolutions) - 1)) : rhs;
+
+  const uint8_t *pMetaData = pBlock->pMetaData + (i * pBlock->nMetaDataBytes);
+  for(k = 0; k < pBlock->nMetaDataBytes; k++) {
+    size_t nBit = nSolutions + (k << 3);
+    pRHS[nBit >> 6] |= ((uint64_t) pMetaData[k]) << (nBit & 0x3f);
+    if((nBit & 0x3f) > 56) {
+      pRHS[(nBit >> 6) + 1] |= ((uint64_t) pMetaData[k]) >> (64 - (nBit & 0x3f));
+    }
+  }
+}
 
-#ifdef XORSATFILTER_PRINT_BUILD_PROGRESS
-  fprintf(stderr, "%u blocks, roughly %u variables per block\n", nBlocks, sParams.nEltsPerBlock);
-#endif
+//Fills pBlock->pSolutionsCompressed, nRHSBits per variable, from
+//pSolutions, which holds nRHSWords words of solution for each variable.
+//Each word is shifted into place whole. Returns 0 on success and 1 if
+//memory couldn't be allocated.
+uint8_t XORSATFilterBlockCompressSolutions(XORSATFilterBlock *pBlock, const uint64_t *pSolutions, uint32_t nRHSWords) {
+  size_t i;
+  uint32_t k;
+  uint32_t nRHSBits = pBlock->nSolutions + (pBlock->nMetaDataBytes * 8);
+  size_t nWords = (((size_t) pBlock->nVariables * nRHSBits) + 63) >> 6;
+
+  free(pBlock->pSolutionsCompressed);
+  pBlock->pSolutionsCompressed = (uint64_t *)calloc(nWords + 1, sizeof(uint64_t)); //+1 for the spill of the last word
+  if(pBlock->pSolutionsCompressed == NULL) return 1;
+
+  uint64_t *pOut = pBlock->pSolutionsCompressed;
+  size_t nBit = 0;
+  for(i = 0; i < pBlock->nVariables; i++) {
+    const uint64_t *pSolution = pSolutions + (i * nRHSWords);
+    for(k = 0; k < nRHSWords; k++) {
+      uint32_t nBits = nRHSBits - (k << 6);
+      uint64_t nWord = pSolution[k];
+      if(nBits < 64) nWord &= (((uint64_t) 1) << nBits) - 1;
+      else nBits = 64;
+      pOut[nBit >> 6] |= nWord << (nBit & 0x3f);
+      if((nBit & 0x3f) != 0) { //X86 shifts are mod 64
+        pOut[(nBit >> 6) + 1] |= nWord >> (64 - (nBit & 0x3f));
+      }
+      nBit += nBits;
+    }
+  }
+
+  return 0;
+}
+
+//Elements are partitioned by block in three passes: each chunk of
+//elements counts how many fall in each block (in parallel), prefix
+//sums give every (chunk, block) pair its own range of the output, and
+//each chunk scatters its elements into its ranges (in parallel).
+//Chunks are consecutive runs of elements and are laid out in order
+//within each block, so blocks see their elements in the order they
+//were added, exactly as when they were pushed one at a time.
+typedef struct XORSATFilterPartitionChunk {
+  const XORSATFilterBuilder *xsfb;
+  XORSATFilterHash *pHashesOut;
+  uint8_t *pMetaDataOut;
+  const size_t *pBlockStarts;
+  uint32_t *pBlockCounts;   //Elements of this chunk in each block, then
+                            //where in the block this chunk's elements start
+  size_t nFirst;
+  size_t nLast;
+  uint32_t nBlocks;         //Blocks of the whole filter, which hashes are mapped to
+  uint32_t nFirstBlock;     //The first of the blocks being distributed
+  uint32_t nRangeBlocks;    //How many there are
+  uint8_t nFormat;
+} XORSATFilterPartitionChunk;
+
+static
+void XORSATFilterPartitionCount(XORSATFilterPartitionChunk *pChunk) {
+  size_t i;
+  const XORSATFilterHash *pHashes = pChunk->xsfb->pHashes.pList;
+
+  memset(pChunk->pBlockCounts, 0, pChunk->nRangeBlocks * sizeof(uint32_t));
+  for(i = pChunk->nFirst; i < pChunk->nLast; i++) {
+    uint32_t nBlock = XORSATFilterHashToBlock(pHashes[i], pChunk->nBlocks, pChunk->nFormat) - pChunk->nFirstBlock;
+    assert(nBlock < pChunk->nRangeBlocks);
+    pChunk->pBlockCounts[nBlock]++;
+  }
+}
+
+static
+void XORSATFilterPartitionScatter(XORSATFilterPartitionChunk *pChunk) {
+  size_t i;
+  const XORSATFilterHash *pHashes = pChunk->xsfb->pHashes.pList;
+  const uint8_t *pMetaData = pChunk->xsfb->pMetaData.pList;
+  size_t nMetaDataBytes = pChunk->xsfb->nMetaDataBytes;
+
+  for(i = pChunk->nFirst; i < pChunk->nLast; i++) {
+    uint32_t nBlock = XORSATFilterHashToBlock(pHashes[i], pChunk->nBlocks, pChunk->nFormat) - pChunk->nFirstBlock;
+    size_t nPosition = pChunk->pBlockStarts[nBlock] + (pChunk->pBlockCounts[nBlock]++);
+    pChunk->pHashesOut[nPosition] = pHashes[i];
+    if(pChunk->pMetaDataOut != NULL) {
+      memcpy(pChunk->pMetaDataOut + (nPosition * nMetaDataBytes), pMetaData + (i * nMetaDataBytes), nMetaDataBytes);
+    }
+  }
+}
+
+//Distributes the builder's elements to blocks nFirstBlock to
+//nFirstBlock+nRangeBlocks-1 of a filter of nBlocks blocks, which must
+//be the blocks they all map to. An in-memory build distributes every
+//block at once; an external one (see src/xorsat_external.c) a range of
+//blocks at a time.
+uint8_t XORSATFilterDistributeHashesToBlocks(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams, uint32_t nBlocks, uint32_t nFirstBlock, uint32_t nRangeBlocks, threadpool thpool, uint32_t nThreads) {
+  uint32_t i, j;
+  size_t nElements = xsfb->pHashes.nLength;
   
   //Initialize blocks
-  uint8_t ret = XORSATFilterBlock_list_resize(&xsfb->pBlocks, nBlocks);
+  uint8_t ret = XORSATFilterBlock_list_resize(&xsfb->pBlocks, nRangeBlocks);
   if(ret != C_LIST_NO_ERROR) return ret;
   
-  xsfb->pBlocks.nLength = nBlocks;
-  for(i = 0; i < nBlocks; i++) {
-    XORSATFilterBlockAlloc(&xsfb->pBlocks.pList[i], sParams.nSolutions, xsfb->nMetaDataBytes, sParams.nEltsPerBlock, sParams.nLitsPerRow);
+  xsfb->pBlocks.nLength = nRangeBlocks;
+  for(i = 0; i < nRangeBlocks; i++) {
+    XORSATFilterBlockAlloc(&xsfb->pBlocks.pList[i], sParams.nSolutions, xsfb->nMetaDataBytes, sParams.nEltsPerBlock, sParams.nLitsPerRow, sParams.nFormat);
     if(xsfb->pBlocks.pList[i].bBadBlock) return 1;
   }
-  
-  //Distribute elements over blocks
-  for(i = 0; i < xsfb->pHashes.nLength; i++) {
-    XORSATFilterHash pHash = xsfb->pHashes.pList[i];
-    uint32_t nBlock = XORSATFilterHashToBlock(pHash, nBlocks);
-    XORSATFilterBlock *pBlock = &xsfb->pBlocks.pList[nBlock];
-    ret = XORSATFilterHash_list_push(&pBlock->pHashes, pHash);
-    if(ret != C_LIST_NO_ERROR) return ret;
 
-    if(xsfb->nMetaDataBytes > 0) {
-      XORSATFilterMetaData pMetaData = xsfb->pMetaData.pList[i];
-      ret = XORSATFilterMetaData_list_push(&pBlock->pMetaData, pMetaData);
-      if(ret != C_LIST_NO_ERROR) return ret;
+  //Few enough elements per chunk that a chunk is worth a thread
+  uint32_t nChunks = (nThreads > 0) ? nThreads : 1;
+  if(nElements / nChunks < 65536) nChunks = (nElements / 65536) + 1;
+
+  XORSATFilterPartitionChunk *pChunks = (XORSATFilterPartitionChunk *)malloc(nChunks * sizeof(XORSATFilterPartitionChunk));
+  uint32_t *pBlockCounts = (uint32_t *)malloc((size_t) nChunks * nRangeBlocks * sizeof(uint32_t));
+  size_t *pBlockStarts = (size_t *)malloc(((size_t) nRangeBlocks + 1) * sizeof(size_t));
+  XORSATFilterHash_list pHashes;
+  uint8_t_list pMetaData;
+  ret = XORSATFilterHash_list_init(&pHashes, nElements);
+  if(ret == C_LIST_NO_ERROR) {
+    ret = uint8_t_list_init(&pMetaData, nElements * xsfb->nMetaDataBytes);
+    if(ret != C_LIST_NO_ERROR) XORSATFilterHash_list_free(&pHashes, NULL);
+  }
+  if(pChunks == NULL || pBlockCounts == NULL || pBlockStarts == NULL || ret != C_LIST_NO_ERROR) {
+    fprintf(stderr, "malloc() failed when distributing elements to blocks\n");
+    if(ret == C_LIST_NO_ERROR) {
+      XORSATFilterHash_list_free(&pHashes, NULL);
+      uint8_t_list_free(&pMetaData, NULL);
+    }
+    free(pChunks);
+    free(pBlockCounts);
+    free(pBlockStarts);
+    return 1;
+  }
+
+  for(j = 0; j < nChunks; j++) {
+    pChunks[j].xsfb = xsfb;
+    pChunks[j].pHashesOut = pHashes.pList;
+    pChunks[j].pMetaDataOut = (xsfb->nMetaDataBytes > 0) ? pMetaData.pList : NULL;
+    pChunks[j].pBlockStarts = pBlockStarts;
+    pChunks[j].pBlockCounts = pBlockCounts + ((size_t) j * nRangeBlocks);
+    pChunks[j].nFirst = (nElements * j) / nChunks;
+    pChunks[j].nLast = (nElements * (j+1)) / nChunks;
+    pChunks[j].nBlocks = nBlocks;
+    pChunks[j].nFirstBlock = nFirstBlock;
+    pChunks[j].nRangeBlocks = nRangeBlocks;
+    pChunks[j].nFormat = sParams.nFormat;
+  }
+
+  //Count
+  for(j = 0; j < nChunks; j++) {
+    thpool_add_work(thpool, (void*)XORSATFilterPartitionCount, &pChunks[j]);
+  }
+  thpool_wait(thpool);
+
+  //Prefix sums: block i starts at pBlockStarts[i], and chunk j's
+  //elements in block i start pBlockCounts[j][i] elements into it
+  size_t nStart = 0;
+  for(i = 0; i < nRangeBlocks; i++) {
+    pBlockStarts[i] = nStart;
+    uint32_t nInBlock = 0;
+    for(j = 0; j < nChunks; j++) {
+      uint32_t nCount = pChunks[j].pBlockCounts[i];
+      pChunks[j].pBlockCounts[i] = nInBlock;
+      nInBlock += nCount;
     }
+    nStart += nInBlock;
   }
+  pBlockStarts[nRangeBlocks] = nStart;
 
+  //Scatter
+  for(j = 0; j < nChunks; j++) {
+    thpool_add_work(thpool, (void*)XORSATFilterPartitionScatter, &pChunks[j]);
+  }
+  thpool_wait(thpool);
+
+  //The partitioned lists replace the builder's
+  pHashes.nLength = nElements;
+  pMetaData.nLength = nElements * xsfb->nMetaDataBytes;
   XORSATFilterHash_list_free(&xsfb->pHashes, NULL);
+  xsfb->pHashes = pHashes;
+  uint8_t_list_free(&xsfb->pMetaData, NULL);
+  xsfb->pMetaData = pMetaData;
 
-  //Determine approximate number of variables to use for each block
-  for(i = 0; i < nBlocks; i++) {
+  //Point blocks at their elements and determine approximate number of variables to use for each block
+  for(i = 0; i < nRangeBlocks; i++) {
     XORSATFilterBlock *pBlock = &xsfb->pBlocks.pList[i];
+    size_t nInBlock = pBlockStarts[i+1] - pBlockStarts[i];
+    pBlock->pHashes.pList = xsfb->pHashes.pList + pBlockStarts[i];
+    pBlock->pHashes.nLength = pBlock->pHashes.nLength_max = nInBlock;
+    if(xsfb->nMetaDataBytes > 0) {
+      pBlock->pMetaData = xsfb->pMetaData.pList + (pBlockStarts[i] * xsfb->nMetaDataBytes);
+    }
     XORSATFilterBlockResize(pBlock, (1.0 / sParams.fEfficiency) * (float) pBlock->pHashes.nLength);
     XORSATFilterBlockFillToWord(pBlock, 0);
+    XORSATFilterBlockSeedRandom(pBlock, sParams.nSeed, nFirstBlock + i);
+    if(sParams.nLitsPerRow == XORSATFILTER_RIBBON && pBlock->nVariables < XORSATFILTER_RIBBON_WIDTH) {
+      XORSATFilterBlockResize(pBlock, XORSATFILTER_RIBBON_WIDTH); //A band must fit in the block
+    }
   }
 
+  free(pChunks);
+  free(pBlockCounts);
+  free(pBlockStarts);
+
   return 0;
 }
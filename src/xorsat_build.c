@@ -18,127 +18,504 @@ XORSATFilterBuilder *XORSATFilterBuilderAlloc(uint32_t nExpectedElements, size_t
 
   xsfb->nMetaDataBytes = nMetaDataBytes;
   
-  if(xsfb->nMetaDataBytes > 0) {
-    if(XORSATFilterMetaData_list_init(&xsfb->pMetaData, nExpectedElements) != C_LIST_NO_ERROR) {
-      free(xsfb);
-      return NULL;
-    }
+  if(uint8_t_list_init(&xsfb->pMetaData, (size_t) nExpectedElements * nMetaDataBytes) != C_LIST_NO_ERROR) {
+    free(xsfb);
+    return NULL;
   }
   
   if(XORSATFilterBlock_list_init(&xsfb->pBlocks, 0) != C_LIST_NO_ERROR) {
     free(xsfb);
     return NULL;
   }
+
+  memset(&xsfb->sStats, 0, sizeof(XORSATFilterBuildStats));
+  xsfb->pSpill = NULL;
   
   return xsfb;
 }
 
 void XORSATFilterBuilderFree(XORSATFilterBuilder *xsfb) {
   XORSATFilterHash_list_free(&xsfb->pHashes, NULL);
-  if(xsfb->nMetaDataBytes > 0) {
-    XORSATFilterMetaData_list_free(&xsfb->pMetaData, XORSATFilterMetaDataFree);
-  }
+  uint8_t_list_free(&xsfb->pMetaData, NULL);
   XORSATFilterBlock_list_free(&xsfb->pBlocks, XORSATFilterBlockFree);
+  if(xsfb->pSpill != NULL) XORSATFilterSpillFree(xsfb->pSpill);
   free(xsfb);
 }
 
-uint8_t XORSATFilterBuilderAddElement(XORSATFilterBuilder *xsfb, const void *pElement, size_t nElementBytes, const void *pMetaData) {
-  XORSATFilterHash pHash = XORSATFilterGenerateHashesFromElement(pElement, nElementBytes);
+uint8_t XORSATFilterBuilderAddHash(XORSATFilterBuilder *xsfb, XORSATFilterHash xsfh, const void *pMetaData) {
+  if(xsfh.h1 == 0) {
+    fprintf(stderr, "Hash must be nonzero, see XORSATFilterHashFromUint64()\n");
+    return 1;
+  }
 
   if(xsfb->nMetaDataBytes > 0) {
     if(pMetaData == NULL) {
       fprintf(stderr, "Metadata expected, but none found...\n");
       return 1;
     }
-    XORSATFilterMetaData MetaDataCopy;
-    MetaDataCopy.pMetaData = (uint8_t *)malloc(xsfb->nMetaDataBytes * sizeof(uint8_t));
-    memcpy((void *)MetaDataCopy.pMetaData, (void *)pMetaData, xsfb->nMetaDataBytes * sizeof(uint8_t));
-    if(MetaDataCopy.pMetaData == NULL) {
-      fprintf(stderr, "malloc() failed when copying metadata\n");
-      return 1;
+  }
+
+  xsfh.present = 1;
+
+  uint8_t ret = XORSATFilterHash_list_push(&xsfb->pHashes, xsfh);
+  if(ret != C_LIST_NO_ERROR) return ret;
+
+  if(xsfb->nMetaDataBytes > 0) {
+    ret = XORSATFilterMetaDataAppend(&xsfb->pMetaData, pMetaData, xsfb->nMetaDataBytes);
+    if(ret != C_LIST_NO_ERROR) {
+      fprintf(stderr, "realloc() failed when copying metadata\n");
+      xsfb->pHashes.nLength--;
+      return ret;
+    }
+  }
+
+  if(xsfb->pSpill != NULL) return XORSATFilterSpillIfFull(xsfb);
+
+  return 0;
+}
+
+uint8_t XORSATFilterBuilderAddAbsenceHash(XORSATFilterBuilder *xsfb, XORSATFilterHash xsfh) {
+  if(xsfh.h1 == 0) {
+    fprintf(stderr, "Hash must be nonzero, see XORSATFilterHashFromUint64()\n");
+    return 1;
+  }
+
+  xsfh.present = 0;
+  
+  uint8_t ret = XORSATFilterHash_list_push(&xsfb->pHashes, xsfh);
+  if(ret != C_LIST_NO_ERROR) return ret;
+
+  if(xsfb->nMetaDataBytes > 0) {
+    //Absent elements have no metadata; store zeros to keep the arena aligned with pHashes
+    ret = XORSATFilterMetaDataAppend(&xsfb->pMetaData, NULL, xsfb->nMetaDataBytes);
+    if(ret != C_LIST_NO_ERROR) {
+      fprintf(stderr, "realloc() failed when copying metadata\n");
+      xsfb->pHashes.nLength--;
+      return ret;
     }
-    uint8_t ret = XORSATFilterMetaData_list_push(&xsfb->pMetaData, MetaDataCopy);
-    if(ret != C_LIST_NO_ERROR) return ret;
   }
 
-  return XORSATFilterHash_list_push(&xsfb->pHashes, pHash);
+  if(xsfb->pSpill != NULL) return XORSATFilterSpillIfFull(xsfb);
+
+  return 0;
+}
+
+uint8_t XORSATFilterBuilderAddElement(XORSATFilterBuilder *xsfb, const void *pElement, size_t nElementBytes, const void *pMetaData) {
+  XORSATFilterHash pHash = XORSATFilterGenerateHashesFromElement(pElement, nElementBytes);
+
+  return XORSATFilterBuilderAddHash(xsfb, pHash, pMetaData);
 }
 
 uint8_t XORSATFilterBuilderAddAbsence(XORSATFilterBuilder *xsfb, const void *pElement, size_t nElementBytes) {
   XORSATFilterHash pHash = XORSATFilterGenerateHashesFromElement(pElement, nElementBytes);
 
-  if(xsfb->nMetaDataBytes > 0) {
-    XORSATFilterMetaData MetaDataCopy;
-    MetaDataCopy.pMetaData = (uint8_t *)malloc(xsfb->nMetaDataBytes * sizeof(uint8_t));
-    if(MetaDataCopy.pMetaData == NULL) {
-      fprintf(stderr, "malloc() failed when copying metadata\n");
-      return 1;
+  return XORSATFilterBuilderAddAbsenceHash(xsfb, pHash);
+}
+
+//A run of elements added by XORSATFilterBuilderAddElements. Each
+//writes its own range of the builder's lists, so no locking is needed.
+typedef struct XORSATFilterAddChunk {
+  XORSATFilterBuilder *xsfb;
+  const void * const *ppElements;
+  const uint32_t *pElementBytes;
+  const void * const *ppMetaData;
+  size_t nFirst;
+  size_t nLast;
+  size_t nBase;
+} XORSATFilterAddChunk;
+
+static
+void XORSATFilterBuilderAddChunk(XORSATFilterAddChunk *pChunk) {
+  size_t i;
+  XORSATFilterBuilder *xsfb = pChunk->xsfb;
+
+  for(i = pChunk->nFirst; i < pChunk->nLast; i++) {
+    XORSATFilterHash xsfh = XORSATFilterGenerateHashesFromElement(pChunk->ppElements[i], pChunk->pElementBytes[i]);
+    xsfh.present = 1;
+    xsfb->pHashes.pList[pChunk->nBase + i] = xsfh;
+
+    if(xsfb->nMetaDataBytes > 0) {
+      memcpy(xsfb->pMetaData.pList + ((pChunk->nBase + i) * xsfb->nMetaDataBytes), pChunk->ppMetaData[i], xsfb->nMetaDataBytes);
     }
-    uint8_t ret = XORSATFilterMetaData_list_push(&xsfb->pMetaData, MetaDataCopy);
+  }
+}
+
+static
+uint8_t XORSATFilterBuilderAddElementsInPlace(XORSATFilterBuilder *xsfb, const void * const *ppElements, const uint32_t *pElementBytes, const void * const *ppMetaData, uint32_t nElements, uint32_t nThreads) {
+  uint32_t j;
+  uint8_t ret;
+
+  //Make room once, then fill in place
+  size_t nBase = xsfb->pHashes.nLength;
+  if(xsfb->pHashes.nLength_max < nBase + nElements) {
+    ret = XORSATFilterHash_list_resize(&xsfb->pHashes, nBase + nElements);
     if(ret != C_LIST_NO_ERROR) return ret;
   }
+  ret = XORSATFilterMetaDataReserve(&xsfb->pMetaData, (nBase + nElements) * xsfb->nMetaDataBytes);
+  if(ret != C_LIST_NO_ERROR) return ret;
 
-  pHash.present = 0;
-  
-  return XORSATFilterHash_list_push(&xsfb->pHashes, pHash);
+  if(nThreads == 0) nThreads = 1;
+  if(nElements / nThreads < 4096) nThreads = (nElements / 4096) + 1;
+
+  XORSATFilterAddChunk *pChunks = (XORSATFilterAddChunk *)malloc(nThreads * sizeof(XORSATFilterAddChunk));
+  if(pChunks == NULL) return 1;
+
+  for(j = 0; j < nThreads; j++) {
+    pChunks[j].xsfb = xsfb;
+    pChunks[j].ppElements = ppElements;
+    pChunks[j].pElementBytes = pElementBytes;
+    pChunks[j].ppMetaData = ppMetaData;
+    pChunks[j].nFirst = ((size_t) nElements * j) / nThreads;
+    pChunks[j].nLast = ((size_t) nElements * (j+1)) / nThreads;
+    pChunks[j].nBase = nBase;
+  }
+
+  if(nThreads == 1) {
+    XORSATFilterBuilderAddChunk(&pChunks[0]);
+  } else {
+    threadpool thpool = thpool_init(nThreads);
+    for(j = 0; j < nThreads; j++) {
+      thpool_add_work(thpool, (void*)XORSATFilterBuilderAddChunk, &pChunks[j]);
+    }
+    thpool_wait(thpool);
+    thpool_destroy(thpool);
+  }
+
+  free(pChunks);
+
+  xsfb->pHashes.nLength = nBase + nElements;
+  xsfb->pMetaData.nLength = (nBase + nElements) * xsfb->nMetaDataBytes;
+
+  return 0;
 }
 
-uint8_t XORSATFilterDistributeHashesToBlocks(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams);
-XORSATFilterQuerier *XORSATFilterCreateQuerierFromBuilder(XORSATFilterBuilder *xsfb);
+//Adds nElements elements at once, hashing them and copying their
+//metadata on nThreads threads. Element i is ppElements[i], of
+//pElementBytes[i] bytes, with metadata ppMetaData[i] (ppMetaData may be
+//NULL if the builder stores no metadata). Returns 0 on success; on
+//error no elements are added, unless the builder spills to disk (see
+//XORSATFilterBuilderAllocExternal), which may have spilled some.
+uint8_t XORSATFilterBuilderAddElements(XORSATFilterBuilder *xsfb, const void * const *ppElements, const uint32_t *pElementBytes, const void * const *ppMetaData, uint32_t nElements, uint32_t nThreads) {
+  uint8_t ret;
 
-XORSATFilterQuerier *XORSATFilterBuilderFinalize(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams, uint32_t nThreads) {
+  if(xsfb->nMetaDataBytes > 0 && ppMetaData == NULL) {
+    fprintf(stderr, "Metadata expected, but none found...\n");
+    return 1;
+  }
+
+  if(xsfb->pSpill == NULL) {
+    return XORSATFilterBuilderAddElementsInPlace(xsfb, ppElements, pElementBytes, ppMetaData, nElements, nThreads);
+  }
+
+  //A spilling builder takes as many elements at a time as its buffer has room for
+  while(nElements > 0) {
+    size_t nRoom = xsfb->pSpill->nBufferElements - xsfb->pHashes.nLength;
+    uint32_t nAdd = (nElements < nRoom) ? nElements : (uint32_t) nRoom;
+    ret = XORSATFilterBuilderAddElementsInPlace(xsfb, ppElements, pElementBytes, ppMetaData, nAdd, nThreads);
+    if(ret == 0) ret = XORSATFilterSpillIfFull(xsfb);
+    if(ret != 0) return ret;
+    ppElements += nAdd;
+    pElementBytes += nAdd;
+    if(ppMetaData != NULL) ppMetaData += nAdd;
+    nElements -= nAdd;
+  }
+
+  return 0;
+}
+
+//Moves every element of xsfbShard into xsfb, leaving xsfbShard empty
+//(it must still be freed). Threads can each add to their own shard,
+//allocated with XORSATFilterBuilderAlloc, without locking; the shards
+//are then merged into one builder before XORSATFilterBuilderFinalize.
+//The shard's hashes and metadata are appended with one copy each. A
+//builder that spills to disk writes them straight to its spill file,
+//after the elements it holds; the shard itself must be in memory.
+uint8_t XORSATFilterBuilderMerge(XORSATFilterBuilder *xsfb, XORSATFilterBuilder *xsfbShard) {
   uint8_t ret;
-  uint32_t i;
-  XORSATFilterQuerier *xsfq = NULL;
+  size_t nLength = xsfb->pHashes.nLength;
+  size_t nShardLength = xsfbShard->pHashes.nLength;
+
+  if(xsfb->nMetaDataBytes != xsfbShard->nMetaDataBytes) {
+    fprintf(stderr, "Error: cannot merge builders with different amounts of metadata\n");
+    return 1;
+  }
 
+  if(xsfbShard->pSpill != NULL) {
+    fprintf(stderr, "Error: a builder that spills to disk cannot be merged as a shard\n");
+    return 1;
+  }
+
+  if(xsfb->pSpill != NULL) {
+    ret = XORSATFilterSpillFlush(xsfb);
+    if(ret == 0) ret = XORSATFilterSpillElements(xsfb->pSpill, xsfbShard->pHashes.pList, xsfbShard->pMetaData.pList, nShardLength, xsfb->nMetaDataBytes);
+    if(ret != 0) return ret;
+    XORSATFilterHash_list_free(&xsfbShard->pHashes, NULL);
+    uint8_t_list_free(&xsfbShard->pMetaData, NULL);
+    return 0;
+  }
+
+  if(xsfb->pHashes.nLength_max < nLength + nShardLength) {
+    ret = XORSATFilterHash_list_resize(&xsfb->pHashes, nLength + nShardLength);
+    if(ret != C_LIST_NO_ERROR) return ret;
+  }
+  ret = XORSATFilterMetaDataReserve(&xsfb->pMetaData, (nLength + nShardLength) * xsfb->nMetaDataBytes);
+  if(ret != C_LIST_NO_ERROR) return ret;
+
+  memcpy(xsfb->pHashes.pList + nLength, xsfbShard->pHashes.pList, nShardLength * sizeof(XORSATFilterHash));
+  xsfb->pHashes.nLength = nLength + nShardLength;
+  XORSATFilterHash_list_free(&xsfbShard->pHashes, NULL);
+
+  if(xsfb->nMetaDataBytes > 0) {
+    memcpy(xsfb->pMetaData.pList + xsfb->pMetaData.nLength, xsfbShard->pMetaData.pList, xsfbShard->pMetaData.nLength);
+    xsfb->pMetaData.nLength += xsfbShard->pMetaData.nLength;
+  }
+  uint8_t_list_free(&xsfbShard->pMetaData, NULL);
+
+  return 0;
+}
+
+uint8_t XORSATFilterDistributeHashesToBlocks(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams, uint32_t nBlocks, uint32_t nFirstBlock, uint32_t nRangeBlocks, threadpool thpool, uint32_t nThreads);
+XORSATFilterQuerier *XORSATFilterCreateQuerierFromBuilder(XORSATFilterBuilder *xsfb, uint8_t bHugePages, threadpool thpool, uint32_t nThreads);
+
+//Checks the parameters of a build of nElements elements with
+//nMetaDataBytes of metadata each, adjusting those that can be. Returns
+//0 if the build can go ahead.
+uint8_t XORSATFilterBuilderCheckParameters(XORSATFilterParameters *pParams, uint64_t nElements, size_t nMetaDataBytes) {
   //Sanity check parameters
-  if(sParams.nSolutions > 32) {
+  if(pParams->nSolutions > 32) {
     fprintf(stderr, "Error: XORSATFilterParameters.nSolutions must be <= 32\n"); //For now
-    return NULL;
+    return 1;
+  }
+
+  if(pParams->nFormat & ~XORSATFILTER_FORMAT_ALL) {
+    fprintf(stderr, "Error: XORSATFilterParameters.nFormat contains unknown flags\n");
+    return 1;
+  }
+
+  if(pParams->nLitsPerRow == XORSATFILTER_RIBBON && (pParams->nFormat & XORSATFILTER_FORMAT_DW_INTERLEAVED)) {
+    fprintf(stderr, "Error: XORSATFILTER_FORMAT_DW_INTERLEAVED does not apply to ribbon rows, which always store the planes of a band together\n");
+    return 1;
   }
 
-  if(sParams.nLitsPerRow > 20) {
+  if(pParams->nSolutions == 0 && nMetaDataBytes == 0) {
+    fprintf(stderr, "Error: XORSATFilterParameters.nSolutions must be > 0 when there is no metadata\n");
+    return 1;
+  }
+
+  if(pParams->nLitsPerRow == 0) {
+    fprintf(stderr, "Error: XORSATFilterParameters.nLitsPerRow must be > 0\n");
+    return 1;
+  }
+
+  if(pParams->nLitsPerRow > 20 && pParams->nLitsPerRow != XORSATFILTER_RIBBON) {
     //20 is a bit arbitrary.
-    fprintf(stderr, "Error: XORSATFilterParameters.nLitsPerRow must be <= 20\n");
-    return NULL;
+    fprintf(stderr, "Error: XORSATFilterParameters.nLitsPerRow must be <= 20 or XORSATFILTER_RIBBON\n");
+    return 1;
   }
 
   /*
-  if(sParams.nSolutions + (xsfb->nMetaDataBytes*8) > 64) {
+  if(pParams->nSolutions + (nMetaDataBytes*8) > 64) {
     fprintf(stderr, "Error: XORSATFilterParameters.nSolutions + (nMetaDataBytes*8) cannot be greater than 64\n");
-    return NULL;
+    return 1;
   }
   */
   
-  if(xsfb->nMetaDataBytes > 0 && (xsfb->pHashes.nLength != xsfb->pMetaData.nLength)) {
-    fprintf(stderr, "Meta Data storage corrupted\n");
+  if(pParams->nEltsPerBlock > nElements) {
+    pParams->nEltsPerBlock = nElements;
+  }
+
+  if(pParams->fEfficiency > 1.0) {
+    fprintf(stderr, "Warning: XORSATFilterParameters.fEfficiency must be <= 1. Setting to 1\n");
+    pParams->fEfficiency = 1.0;
+  }
+
+  return 0;
+}
+
+//Adds the counts of nBlocks solved blocks to the builder's statistics
+void XORSATFilterBuilderCountBlocks(XORSATFilterBuilder *xsfb, const XORSATFilterBlock *pBlocks, uint32_t nBlocks) {
+  uint32_t i;
+
+  xsfb->sStats.nBlocks += nBlocks;
+  for(i = 0; i < nBlocks; i++) {
+    xsfb->sStats.nDuplicates += pBlocks[i].nDuplicates;
+    xsfb->sStats.nConflictingDuplicates += pBlocks[i].nConflictingDuplicates;
+    xsfb->sStats.nRetries += pBlocks[i].nRetries;
+    if(pBlocks[i].nRetries > 0) xsfb->sStats.nBlocksRetried++;
+  }
+}
+
+XORSATFilterQuerier *XORSATFilterBuilderFinalize(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams, uint32_t nThreads) {
+  uint8_t ret;
+  XORSATFilterQuerier *xsfq = NULL;
+
+  if(xsfb->pSpill != NULL) {
+    fprintf(stderr, "Error: a builder that spills to disk must be finalized with XORSATFilterBuilderFinalizeToFile\n");
     return NULL;
   }
-  
-  if(sParams.nEltsPerBlock > xsfb->pHashes.nLength) {
-    sParams.nEltsPerBlock = xsfb->pHashes.nLength;
+
+  if(XORSATFilterBuilderCheckParameters(&sParams, xsfb->pHashes.nLength, xsfb->nMetaDataBytes) != 0) {
+    return NULL;
   }
 
-  if(sParams.fEfficiency > 1.0) {
-    fprintf(stderr, "Warning: XORSATFilterParameters.fEfficiency must be <= 1. Setting to 1\n");
-    sParams.fEfficiency = 1.0;
+  if(xsfb->pHashes.nLength * xsfb->nMetaDataBytes != xsfb->pMetaData.nLength) {
+    fprintf(stderr, "Meta Data storage corrupted\n");
+    return NULL;
   }
 
-  ret = XORSATFilterDistributeHashesToBlocks(xsfb, sParams);
-  if(ret != 0) return NULL;
+  memset(&xsfb->sStats, 0, sizeof(XORSATFilterBuildStats));
+  xsfb->sStats.nElements = xsfb->pHashes.nLength;
 
+  //Determine number of blocks
+  uint32_t nBlocks = (xsfb->pHashes.nLength / (uint32_t) sParams.nEltsPerBlock);
+
+#ifdef XORSATFILTER_PRINT_BUILD_PROGRESS
+  fprintf(stderr, "%u blocks, roughly %u variables per block\n", nBlocks, sParams.nEltsPerBlock);
+#endif
+
+  if(nThreads == 0) nThreads = XORSATFilterDefaultThreads();
+
+  XORSATFilterScheduler *pScheduler = XORSATFilterSchedulerAlloc(nThreads, sParams.bPinThreads);
+  if(pScheduler == NULL) {
+    fprintf(stderr, "Error: could not allocate build threads\n");
+    return NULL;
+  }
 
-  //Build Blocks
   threadpool thpool = thpool_init(nThreads);
-  for(i = 0; i < xsfb->pBlocks.nLength; i++) {
-    XORSATFilterBlock *pBlock = &xsfb->pBlocks.pList[i];
-    thpool_add_work(thpool, (void*)XORSATFilterSolveBlock, pBlock);
+
+  ret = XORSATFilterDistributeHashesToBlocks(xsfb, sParams, nBlocks, 0, nBlocks, thpool, nThreads);
+  if(ret != 0) {
+    thpool_destroy(thpool);
+    XORSATFilterSchedulerFree(pScheduler);
+    return NULL;
   }
 
-  thpool_wait(thpool);
-  thpool_destroy(thpool);
+  //Build Blocks
+  xsfb->sStats.nPredictedWords = XORSATFilterSolveBlocks(xsfb->pBlocks.pList, nBlocks, UINT32_MAX, pScheduler);
+  XORSATFilterSchedulerFree(pScheduler);
+  XORSATFilterBuilderCountBlocks(xsfb, xsfb->pBlocks.pList, nBlocks);
+  if(XORSATFilterBlocksFailed(xsfb->pBlocks.pList, nBlocks) != 0) {
+    thpool_destroy(thpool);
+    return NULL;
+  }
+
+  if(xsfb->sStats.nConflictingDuplicates > 0) {
+    fprintf(stderr, "Warning: %"PRIu64" duplicate elements or hash collisions had conflicting metadata or presence. Possible loss of data. See XORSATFilterBuilderStats()\n", xsfb->sStats.nConflictingDuplicates);
+  }
+
+  //Blocks no longer need their elements
+  XORSATFilterHash_list_free(&xsfb->pHashes, NULL);
+  uint8_t_list_free(&xsfb->pMetaData, NULL);
   
-  xsfq = XORSATFilterCreateQuerierFromBuilder(xsfb);
+  xsfq = XORSATFilterCreateQuerierFromBuilder(xsfb, sParams.bHugePages, thpool, nThreads);
+  thpool_destroy(thpool);
 
   return xsfq;
 }
+
+//Counts from the last call to XORSATFilterBuilderFinalize
+XORSATFilterBuildStats XORSATFilterBuilderStats(const XORSATFilterBuilder *xsfb) {
+  return xsfb->sStats;
+}
+
+/*************************************************************************************
+
+  Utility function for measuring ingestion throughput.
+
+**************************************************************************************/
+
+typedef struct XORSATFilterIngestThread {
+  XORSATFilterBuilder *xsfbShard;
+  uint64_t nFirst;
+  uint64_t nLast;
+  uint8_t pMetaData[64];
+} XORSATFilterIngestThread;
+
+static
+void *XORSATFilterIngestShard(void *pArg) {
+  XORSATFilterIngestThread *pThread = (XORSATFilterIngestThread *) pArg;
+  uint64_t i;
+
+  for(i = pThread->nFirst; i < pThread->nLast; i++) {
+    memcpy(pThread->pMetaData, &i, sizeof(uint64_t));
+    XORSATFilterBuilderAddElement(pThread->xsfbShard, &i, sizeof(uint64_t), pThread->pMetaData);
+  }
+
+  return NULL;
+}
+
+//Elements added per second, in wall-clock time, on nThreads threads,
+//with nMetaDataBytes (at most 64) bytes of metadata each. If bShards is
+//set, each thread adds elements one at a time to its own shard and the
+//shards are merged; otherwise a single XORSATFilterBuilderAddElements
+//call adds them all. Returns 0 on error.
+uint64_t XORSATFilterIngestionRate(uint32_t nThreads, size_t nMetaDataBytes, uint8_t bShards) {
+  uint32_t j;
+  uint64_t i;
+  uint64_t nElements = 4000000;
+  uint64_t nRate = 0;
+
+  if(nThreads == 0 || nMetaDataBytes > 64) return 0;
+
+  XORSATFilterBuilder *xsfb = XORSATFilterBuilderAlloc(0, nMetaDataBytes);
+  if(xsfb == NULL) return 0;
+
+  if(bShards) {
+    XORSATFilterIngestThread *pThreads = (XORSATFilterIngestThread *)calloc(nThreads, sizeof(XORSATFilterIngestThread));
+    pthread_t *pThreadIDs = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
+    uint32_t nCreated = 0;
+    if(pThreads != NULL && pThreadIDs != NULL) {
+      for(j = 0; j < nThreads; j++) {
+        pThreads[j].xsfbShard = XORSATFilterBuilderAlloc(0, nMetaDataBytes);
+        pThreads[j].nFirst = (nElements * j) / nThreads;
+        pThreads[j].nLast = (nElements * (j+1)) / nThreads;
+        if(pThreads[j].xsfbShard == NULL) break;
+      }
+      if(j == nThreads) {
+        double fStart = XORSATFilterWallTime();
+        for(; nCreated < nThreads; nCreated++) {
+          if(pthread_create(&pThreadIDs[nCreated], NULL, XORSATFilterIngestShard, &pThreads[nCreated]) != 0) break;
+        }
+        uint8_t ret = (nCreated != nThreads);
+        for(j = 0; j < nCreated; j++) {
+          pthread_join(pThreadIDs[j], NULL);
+          ret |= XORSATFilterBuilderMerge(xsfb, pThreads[j].xsfbShard);
+        }
+        double fEnd = XORSATFilterWallTime();
+        if(ret == 0 && xsfb->pHashes.nLength == nElements) {
+          nRate = (uint64_t) (((double) nElements) / (fEnd - fStart));
+        }
+      }
+      for(j = 0; j < nThreads; j++) {
+        if(pThreads[j].xsfbShard != NULL) XORSATFilterBuilderFree(pThreads[j].xsfbShard);
+      }
+    }
+    free(pThreads);
+    free(pThreadIDs);
+  } else {
+    //Metadata is read from the keys themselves, so pad the end by 64 bytes
+    uint64_t *pKeys = (uint64_t *)calloc(nElements + 8, sizeof(uint64_t));
+    const void **ppElements = (const void **)malloc(nElements * sizeof(void *));
+    uint32_t *pElementBytes = (uint32_t *)malloc(nElements * sizeof(uint32_t));
+    if(pKeys != NULL && ppElements != NULL && pElementBytes != NULL) {
+      for(i = 0; i < nElements; i++) {
+        pKeys[i] = i;
+        ppElements[i] = &pKeys[i];
+        pElementBytes[i] = sizeof(uint64_t);
+      }
+      double fStart = XORSATFilterWallTime();
+      uint8_t ret = XORSATFilterBuilderAddElements(xsfb, ppElements, pElementBytes, (nMetaDataBytes > 0) ? ppElements : NULL, nElements, nThreads);
+      double fEnd = XORSATFilterWallTime();
+      if(ret == 0) {
+        nRate = (uint64_t) (((double) nElements) / (fEnd - fStart));
+      }
+    }
+    free(pKeys);
+    free(ppElements);
+    free(pElementBytes);
+  }
+
+  XORSATFilterBuilderFree(xsfb);
+
+  return nRate;
+}
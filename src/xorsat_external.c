@@ -0,0 +1,504 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#include "xorsat_filter.h"
+
+//A builder normally keeps every element in memory until it is
+//finalized, so the largest filter it can build is bounded by RAM. A
+//builder allocated with XORSATFilterBuilderAllocExternal instead keeps
+//a bounded buffer of elements and spills it to a file whenever it fills
+//up. XORSATFilterBuilderFinalizeToFile then
+//  1. spreads the spilled elements over one file per range of
+//     consecutive blocks, now that the number of blocks is known, and
+//  2. reads the ranges back one at a time, solves their blocks with the
+//     build's threads and appends them to the serialized filter.
+//Only one range is in memory at a time. Elements keep the order they
+//were added in through both passes, so the filter written is
+//byte-identical to the one XORSATFilterBuilderFinalize and
+//XORSATFilterSerialize would make from the same elements and
+//parameters.
+
+uint8_t XORSATFilterBuilderCheckParameters(XORSATFilterParameters *pParams, uint64_t nElements, size_t nMetaDataBytes);
+void XORSATFilterBuilderCountBlocks(XORSATFilterBuilder *xsfb, const XORSATFilterBlock *pBlocks, uint32_t nBlocks);
+uint8_t XORSATFilterDistributeHashesToBlocks(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams, uint32_t nBlocks, uint32_t nFirstBlock, uint32_t nRangeBlocks, threadpool thpool, uint32_t nThreads);
+void XORSATFilterStoreBlocks(XORSATFilterBlock *pBlocks, uint32_t nBlocks, uint64_t *pFilter, threadpool thpool, uint32_t nThreads);
+uint8_t XORSATFilterStoreBlockIndex(XORSATFilterQuerier *xsfq, uint32_t nBlock, uint64_t nBlockIndex);
+
+//Elements the builder's lists hold before they are spilled, at most.
+//A larger buffer only makes for fewer, larger writes.
+#define XORSATFILTER_SPILL_BUFFER_ELEMENTS (1 << 24)
+
+//Spilled elements are copied to and from files through a buffer of
+//about this many bytes
+#define XORSATFILTER_SPILL_STAGING_BYTES (1 << 16)
+
+//Smallest number of elements buffered for each range of blocks while
+//the spill file is spread over them
+#define XORSATFILTER_SPILL_RANGE_ELEMENTS 256
+
+//Creates an empty spill file in pDirectory. It is unlinked at once, so
+//it disappears when closed, even if the build doesn't finish.
+static
+FILE *XORSATFilterSpillOpen(const char *pDirectory) {
+  size_t nPathBytes = strlen(pDirectory) + sizeof("/xorsatfilter.XXXXXX");
+  char pPath[nPathBytes];
+  snprintf(pPath, nPathBytes, "%s/xorsatfilter.XXXXXX", pDirectory);
+
+  int fd = mkstemp(pPath);
+  if(fd == -1) {
+    fprintf(stderr, "Error: could not create a spill file in %s\n", pDirectory);
+    return NULL;
+  }
+  unlink(pPath);
+
+  FILE *pFile = fdopen(fd, "w+b");
+  if(pFile == NULL) {
+    fprintf(stderr, "Error: could not open a spill file in %s\n", pDirectory);
+    close(fd);
+  }
+
+  return pFile;
+}
+
+//Appends nElements elements to pFile, each its hash followed by its
+//metadata. Returns 0 on success.
+static
+uint8_t XORSATFilterSpillWrite(FILE *pFile, const XORSATFilterHash *pHashes, const uint8_t *pMetaData, size_t nElements, size_t nMetaDataBytes) {
+  size_t i, j;
+  size_t nRecordBytes = sizeof(XORSATFilterHash) + nMetaDataBytes;
+
+  if(nMetaDataBytes == 0) {
+    if(fwrite(pHashes, sizeof(XORSATFilterHash), nElements, pFile) != nElements) {
+      fprintf(stderr, "Error: could not write to spill file\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  size_t nStaged = (XORSATFILTER_SPILL_STAGING_BYTES / nRecordBytes) + 1;
+  uint8_t *pStaging = (uint8_t *)malloc(nStaged * nRecordBytes);
+  if(pStaging == NULL) return 1;
+
+  for(i = 0; i < nElements; i += nStaged) {
+    size_t nRecords = (nElements - i < nStaged) ? nElements - i : nStaged;
+    for(j = 0; j < nRecords; j++) {
+      memcpy(pStaging + (j * nRecordBytes), &pHashes[i + j], sizeof(XORSATFilterHash));
+      memcpy(pStaging + (j * nRecordBytes) + sizeof(XORSATFilterHash), pMetaData + ((i + j) * nMetaDataBytes), nMetaDataBytes);
+    }
+    if(fwrite(pStaging, nRecordBytes, nRecords, pFile) != nRecords) {
+      fprintf(stderr, "Error: could not write to spill file\n");
+      free(pStaging);
+      return 1;
+    }
+  }
+
+  free(pStaging);
+
+  return 0;
+}
+
+//Reads up to nElements elements written by XORSATFilterSpillWrite from
+//pFile into pHashes and pMetaData. Returns the number read, which is
+//fewer only at the end of the file, or SIZE_MAX on error.
+static
+size_t XORSATFilterSpillRead(FILE *pFile, XORSATFilterHash *pHashes, uint8_t *pMetaData, size_t nElements, size_t nMetaDataBytes) {
+  size_t i, j;
+  size_t nRecordBytes = sizeof(XORSATFilterHash) + nMetaDataBytes;
+  size_t nRead = 0;
+
+  if(nMetaDataBytes == 0) {
+    nRead = fread(pHashes, sizeof(XORSATFilterHash), nElements, pFile);
+  } else {
+    size_t nStaged = (XORSATFILTER_SPILL_STAGING_BYTES / nRecordBytes) + 1;
+    uint8_t *pStaging = (uint8_t *)malloc(nStaged * nRecordBytes);
+    if(pStaging == NULL) return SIZE_MAX;
+
+    for(i = 0; i < nElements; i += nStaged) {
+      size_t nWant = (nElements - i < nStaged) ? nElements - i : nStaged;
+      size_t nRecords = fread(pStaging, nRecordBytes, nWant, pFile);
+      for(j = 0; j < nRecords; j++) {
+        memcpy(&pHashes[i + j], pStaging + (j * nRecordBytes), sizeof(XORSATFilterHash));
+        memcpy(pMetaData + ((i + j) * nMetaDataBytes), pStaging + (j * nRecordBytes) + sizeof(XORSATFilterHash), nMetaDataBytes);
+      }
+      nRead += nRecords;
+      if(nRecords != nWant) break;
+    }
+
+    free(pStaging);
+  }
+
+  if(ferror(pFile)) {
+    fprintf(stderr, "Error: could not read from spill file\n");
+    return SIZE_MAX;
+  }
+
+  return nRead;
+}
+
+//Spills nElements elements, after those already spilled
+uint8_t XORSATFilterSpillElements(XORSATFilterSpill *pSpill, const XORSATFilterHash *pHashes, const uint8_t *pMetaData, size_t nElements, size_t nMetaDataBytes) {
+  if(pSpill->pFile == NULL) {
+    fprintf(stderr, "Error: builder has already been finalized\n");
+    return 1;
+  }
+
+  uint8_t ret = XORSATFilterSpillWrite(pSpill->pFile, pHashes, pMetaData, nElements, nMetaDataBytes);
+  if(ret == 0) pSpill->nSpilled += nElements;
+  return ret;
+}
+
+//Spills every element the builder holds and empties its lists
+uint8_t XORSATFilterSpillFlush(XORSATFilterBuilder *xsfb) {
+  uint8_t ret = XORSATFilterSpillElements(xsfb->pSpill, xsfb->pHashes.pList, xsfb->pMetaData.pList, xsfb->pHashes.nLength, xsfb->nMetaDataBytes);
+  if(ret != 0) return ret;
+
+  xsfb->pHashes.nLength = 0;
+  xsfb->pMetaData.nLength = 0;
+
+  return 0;
+}
+
+uint8_t XORSATFilterSpillIfFull(XORSATFilterBuilder *xsfb) {
+  if(xsfb->pHashes.nLength < xsfb->pSpill->nBufferElements) return 0;
+  return XORSATFilterSpillFlush(xsfb);
+}
+
+void XORSATFilterSpillFree(XORSATFilterSpill *pSpill) {
+  if(pSpill->pFile != NULL) fclose(pSpill->pFile);
+  free(pSpill->pDirectory);
+  free(pSpill);
+}
+
+//Allocates a builder that spills its elements to files in pDirectory
+//(NULL for $TMPDIR, or /tmp) instead of keeping them in memory, for
+//sets of elements larger than RAM. Elements are added, and shards
+//merged into it, as with any other builder, but it is finalized with
+//XORSATFilterBuilderFinalizeToFile. Adding elements and finalizing use
+//about nMemoryBytes of memory, whatever the number of elements, plus 6
+//bytes per block and the working memory of the threads solving blocks.
+//Spill files take about twice the size of the elements on disk, with
+//sizeof(XORSATFilterHash) + nMetaDataBytes bytes per element.
+//nMemoryBytes must hold at least 2*XORSATFILTER_SPILL_RANGE_ELEMENTS
+//elements, otherwise NULL is returned.
+XORSATFilterBuilder *XORSATFilterBuilderAllocExternal(size_t nMetaDataBytes, size_t nMemoryBytes, const char *pDirectory) {
+  size_t nRecordBytes = sizeof(XORSATFilterHash) + nMetaDataBytes;
+  size_t nBufferElements = nMemoryBytes / nRecordBytes;
+  if(nBufferElements > XORSATFILTER_SPILL_BUFFER_ELEMENTS) nBufferElements = XORSATFILTER_SPILL_BUFFER_ELEMENTS;
+  //XORSATFilterSpillPartition buffers at least one range in half the budget
+  if((nMemoryBytes / 2) / nRecordBytes < XORSATFILTER_SPILL_RANGE_ELEMENTS) {
+    fprintf(stderr, "Error: memory budget must hold at least %u elements\n", 2 * XORSATFILTER_SPILL_RANGE_ELEMENTS);
+    return NULL;
+  }
+
+  if(pDirectory == NULL) pDirectory = getenv("TMPDIR");
+  if(pDirectory == NULL) pDirectory = "/tmp";
+
+  XORSATFilterSpill *pSpill = (XORSATFilterSpill *)malloc(1 * sizeof(XORSATFilterSpill));
+  if(pSpill == NULL) return NULL;
+  pSpill->pDirectory = strdup(pDirectory);
+  pSpill->nMemoryBytes = nMemoryBytes;
+  pSpill->nBufferElements = nBufferElements;
+  pSpill->nSpilled = 0;
+  pSpill->pFile = (pSpill->pDirectory != NULL) ? XORSATFilterSpillOpen(pDirectory) : NULL;
+  if(pSpill->pFile == NULL) {
+    XORSATFilterSpillFree(pSpill);
+    return NULL;
+  }
+
+  XORSATFilterBuilder *xsfb = XORSATFilterBuilderAlloc(nBufferElements, nMetaDataBytes);
+  if(xsfb == NULL) {
+    XORSATFilterSpillFree(pSpill);
+    return NULL;
+  }
+  xsfb->pSpill = pSpill;
+
+  return xsfb;
+}
+
+//Spreads the spilled elements over ppRanges, range i getting those of
+//blocks i*nRangeBlocks to (i+1)*nRangeBlocks-1 of a filter of nBlocks
+//blocks. Half the memory budget reads the spill file, the other half
+//buffers the ranges' elements. When it can't buffer
+//XORSATFILTER_SPILL_RANGE_ELEMENTS for every range, the spill file is
+//read once for each group of ranges it can. Returns 0 on success.
+static
+uint8_t XORSATFilterSpillPartition(XORSATFilterBuilder *xsfb, FILE **ppRanges, uint32_t nRanges, uint32_t nBlocks, uint32_t nRangeBlocks, uint8_t nFormat) {
+  size_t i, nRead;
+  uint32_t r, nFirst, nLast;
+  uint8_t ret = 0;
+  size_t nMetaDataBytes = xsfb->nMetaDataBytes;
+  size_t nRecordBytes = sizeof(XORSATFilterHash) + nMetaDataBytes;
+  size_t nHalfElements = (xsfb->pSpill->nMemoryBytes / 2) / nRecordBytes;
+
+  size_t nReadElements = nHalfElements;
+  if(nReadElements > XORSATFILTER_SPILL_BUFFER_ELEMENTS) nReadElements = XORSATFILTER_SPILL_BUFFER_ELEMENTS;
+  if(nReadElements == 0) nReadElements = 1;
+  size_t nPassRanges = nHalfElements / XORSATFILTER_SPILL_RANGE_ELEMENTS;
+  if(nPassRanges > nRanges) nPassRanges = nRanges;
+  if(nPassRanges == 0) nPassRanges = 1;
+  size_t nRangeElements = nHalfElements / nPassRanges;
+  if(nRangeElements == 0) nRangeElements = 1;
+
+  XORSATFilterHash *pReadHashes = (XORSATFilterHash *)malloc(nReadElements * sizeof(XORSATFilterHash));
+  uint8_t *pReadMetaData = (uint8_t *)malloc((nReadElements * nMetaDataBytes) + 1);
+  XORSATFilterHash *pRangeHashes = (XORSATFilterHash *)malloc(nPassRanges * nRangeElements * sizeof(XORSATFilterHash));
+  uint8_t *pRangeMetaData = (uint8_t *)malloc((nPassRanges * nRangeElements * nMetaDataBytes) + 1);
+  size_t *pRangeCounts = (size_t *)malloc(nPassRanges * sizeof(size_t));
+  if(pReadHashes == NULL || pReadMetaData == NULL || pRangeHashes == NULL || pRangeMetaData == NULL || pRangeCounts == NULL) {
+    fprintf(stderr, "malloc() failed when spreading spilled elements over ranges\n");
+    ret = 1;
+  }
+
+  for(nFirst = 0; nFirst < nRanges && ret == 0; nFirst = nLast) {
+    nLast = (nRanges - nFirst < nPassRanges) ? nRanges : nFirst + (uint32_t) nPassRanges;
+    memset(pRangeCounts, 0, nPassRanges * sizeof(size_t));
+
+    rewind(xsfb->pSpill->pFile);
+    while(ret == 0 && (nRead = XORSATFilterSpillRead(xsfb->pSpill->pFile, pReadHashes, pReadMetaData, nReadElements, nMetaDataBytes)) != 0) {
+      if(nRead == SIZE_MAX) {
+        ret = 1;
+        break;
+      }
+      for(i = 0; i < nRead && ret == 0; i++) {
+        r = XORSATFilterHashToBlock(pReadHashes[i], nBlocks, nFormat) / nRangeBlocks;
+        if(r < nFirst || r >= nLast) continue;
+        r -= nFirst;
+        size_t nSlot = ((size_t) r * nRangeElements) + pRangeCounts[r]++;
+        pRangeHashes[nSlot] = pReadHashes[i];
+        memcpy(pRangeMetaData + (nSlot * nMetaDataBytes), pReadMetaData + (i * nMetaDataBytes), nMetaDataBytes);
+        if(pRangeCounts[r] == nRangeElements) {
+          ret = XORSATFilterSpillWrite(ppRanges[nFirst + r], pRangeHashes + ((size_t) r * nRangeElements), pRangeMetaData + ((size_t) r * nRangeElements * nMetaDataBytes), nRangeElements, nMetaDataBytes);
+          pRangeCounts[r] = 0;
+        }
+      }
+    }
+
+    for(r = 0; r < nLast - nFirst && ret == 0; r++) {
+      ret = XORSATFilterSpillWrite(ppRanges[nFirst + r], pRangeHashes + ((size_t) r * nRangeElements), pRangeMetaData + ((size_t) r * nRangeElements * nMetaDataBytes), pRangeCounts[r], nMetaDataBytes);
+    }
+  }
+
+  free(pReadHashes);
+  free(pReadMetaData);
+  free(pRangeHashes);
+  free(pRangeMetaData);
+  free(pRangeCounts);
+
+  return ret;
+}
+
+//Reads the elements of blocks nFirstBlock to nFirstBlock+nRangeBlocks-1
+//from pRange into the builder, solves the blocks and appends them to
+//the filter file. *pPredictedWords is as XORSATFilterSolveBlocks takes
+//and returns it. The number of variables of each block is written to
+//pVariables. Returns 0 on success.
+static
+uint8_t XORSATFilterBuildRange(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams, FILE *pRange, uint32_t nBlocks, uint32_t nFirstBlock, uint32_t nRangeBlocks, uint32_t *pPredictedWords, uint32_t *pVariables, FILE *pXORSATFilterFile, XORSATFilterScheduler *pScheduler, threadpool thpool, uint32_t nThreads) {
+  uint32_t i;
+  uint8_t ret;
+  size_t nMetaDataBytes = xsfb->nMetaDataBytes;
+
+  //Load the range's elements
+  if(fseeko(pRange, 0, SEEK_END) != 0) return 1;
+  size_t nElements = (size_t) ftello(pRange) / (sizeof(XORSATFilterHash) + nMetaDataBytes);
+  rewind(pRange);
+
+  ret = XORSATFilterHash_list_init(&xsfb->pHashes, nElements);
+  if(ret == C_LIST_NO_ERROR) {
+    ret = uint8_t_list_init(&xsfb->pMetaData, nElements * nMetaDataBytes);
+    if(ret != C_LIST_NO_ERROR) XORSATFilterHash_list_free(&xsfb->pHashes, NULL);
+  }
+  if(ret != C_LIST_NO_ERROR) {
+    fprintf(stderr, "malloc() failed when reading a range of blocks\n");
+    return 1;
+  }
+  if(XORSATFilterSpillRead(pRange, xsfb->pHashes.pList, xsfb->pMetaData.pList, nElements, nMetaDataBytes) != nElements) {
+    fprintf(stderr, "Error: could not read a range of blocks from its spill file\n");
+    ret = 1;
+  }
+  xsfb->pHashes.nLength = nElements;
+  xsfb->pMetaData.nLength = nElements * nMetaDataBytes;
+
+  //Build Blocks
+  if(ret == 0) ret = XORSATFilterDistributeHashesToBlocks(xsfb, sParams, nBlocks, nFirstBlock, nRangeBlocks, thpool, nThreads);
+  if(ret == 0) {
+    *pPredictedWords = XORSATFilterSolveBlocks(xsfb->pBlocks.pList, nRangeBlocks, *pPredictedWords, pScheduler);
+    XORSATFilterBuilderCountBlocks(xsfb, xsfb->pBlocks.pList, nRangeBlocks);
+    if(XORSATFilterBlocksFailed(xsfb->pBlocks.pList, nRangeBlocks) != 0) ret = 1;
+  }
+
+  //Blocks no longer need their elements
+  XORSATFilterHash_list_free(&xsfb->pHashes, NULL);
+  uint8_t_list_free(&xsfb->pMetaData, NULL);
+  if(ret != 0) return ret;
+
+  //Append the blocks to the filter
+  uint64_t nWords = 0;
+  for(i = 0; i < nRangeBlocks; i++) {
+    pVariables[i] = xsfb->pBlocks.pList[i].nVariables;
+    nWords += XORSATFilterBlockFilterWords(&xsfb->pBlocks.pList[i]);
+  }
+
+  uint64_t *pFilter = (uint64_t *)malloc((nWords + 1) * sizeof(uint64_t));
+  if(pFilter == NULL) {
+    fprintf(stderr, "malloc() failed when storing a range of blocks\n");
+    return 1;
+  }
+  XORSATFilterStoreBlocks(xsfb->pBlocks.pList, nRangeBlocks, pFilter, thpool, nThreads);
+  if(fwrite(pFilter, sizeof(uint64_t), nWords, pXORSATFilterFile) != nWords) {
+    fprintf(stderr, "Error: could not write the filter file\n");
+    ret = 1;
+  }
+  free(pFilter);
+
+  return ret;
+}
+
+//Builds the filter of the builder's elements and serializes it to
+//pXORSATFilterFile, which XORSATFilterDeserialize then loads as usual.
+//A builder that spills to disk (see XORSATFilterBuilderAllocExternal)
+//builds a range of blocks at a time, as many as fit in its memory
+//budget, and never holds the whole filter in memory. At least
+//XORSATFILTER_CALIBRATION_BLOCKS blocks are built at a time, so the
+//filter is the same as from an in-memory build. Any other builder is
+//finalized and serialized. Returns 0 on success.
+uint8_t XORSATFilterBuilderFinalizeToFile(XORSATFilterBuilder *xsfb, XORSATFilterParameters sParams, uint32_t nThreads, FILE *pXORSATFilterFile) {
+  uint32_t r;
+  uint8_t ret;
+
+  if(pXORSATFilterFile == NULL) return 1;
+
+  if(xsfb->pSpill == NULL) {
+    XORSATFilterQuerier *xsfq = XORSATFilterBuilderFinalize(xsfb, sParams, nThreads);
+    if(xsfq == NULL) return 1;
+    ret = XORSATFilterSerialize(pXORSATFilterFile, xsfq);
+    XORSATFilterQuerierFree(xsfq);
+    return ret;
+  }
+
+  XORSATFilterSpill *pSpill = xsfb->pSpill;
+  size_t nMetaDataBytes = xsfb->nMetaDataBytes;
+  if(nThreads == 0) nThreads = XORSATFilterDefaultThreads();
+  uint64_t nElements = pSpill->nSpilled + xsfb->pHashes.nLength;
+  if(nElements == 0) {
+    fprintf(stderr, "Error: no elements to build a filter from\n");
+    return 1;
+  }
+
+  if(XORSATFilterBuilderCheckParameters(&sParams, nElements, nMetaDataBytes) != 0) {
+    return 1;
+  }
+
+  //Everything is read back from the spill file
+  if(XORSATFilterSpillFlush(xsfb) != 0) return 1;
+  XORSATFilterHash_list_free(&xsfb->pHashes, NULL);
+  uint8_t_list_free(&xsfb->pMetaData, NULL);
+
+  memset(&xsfb->sStats, 0, sizeof(XORSATFilterBuildStats));
+  xsfb->sStats.nElements = nElements;
+
+  //Determine number of blocks
+  uint32_t nBlocks = (nElements / (uint32_t) sParams.nEltsPerBlock);
+
+  //While a range is built, each element is held twice as it is
+  //distributed to its block, and its share of the filter twice, in its
+  //block and as the range is written out
+  uint32_t nRHSBits = sParams.nSolutions + (nMetaDataBytes * 8);
+  double fElementBytes = (2.0 * (sizeof(XORSATFilterHash) + nMetaDataBytes)) + ((2.0 * nRHSBits) / (8.0 * sParams.fEfficiency));
+  double fRangeBlocks = ((double) pSpill->nMemoryBytes) / (fElementBytes * sParams.nEltsPerBlock);
+  uint32_t nRangeBlocks = (fRangeBlocks < (double) nBlocks) ? (uint32_t) fRangeBlocks : nBlocks;
+  if(nRangeBlocks < XORSATFILTER_CALIBRATION_BLOCKS && nRangeBlocks < nBlocks) {
+    nRangeBlocks = (nBlocks < XORSATFILTER_CALIBRATION_BLOCKS) ? nBlocks : XORSATFILTER_CALIBRATION_BLOCKS;
+    fprintf(stderr, "Warning: memory budget is too small, building %u blocks at a time anyway\n", nRangeBlocks);
+  }
+  uint32_t nRanges = (nBlocks + nRangeBlocks - 1) / nRangeBlocks;
+
+#ifdef XORSATFILTER_PRINT_BUILD_PROGRESS
+  fprintf(stderr, "%u blocks, roughly %u variables per block, built %u blocks at a time\n", nBlocks, sParams.nEltsPerBlock, nRangeBlocks);
+#endif
+
+  FILE **ppRanges = (FILE **)calloc(nRanges, sizeof(FILE *));
+  uint32_t *pVariables = (uint32_t *)malloc(nBlocks * sizeof(uint32_t));
+  XORSATFilterScheduler *pScheduler = XORSATFilterSchedulerAlloc(nThreads, sParams.bPinThreads);
+  if(ppRanges == NULL || pVariables == NULL || pScheduler == NULL) {
+    free(ppRanges);
+    free(pVariables);
+    XORSATFilterSchedulerFree(pScheduler);
+    return 1;
+  }
+
+  //One range is the spill file itself, otherwise spread the spill file over the ranges
+  ret = 0;
+  if(nRanges == 1) {
+    ppRanges[0] = pSpill->pFile;
+  } else {
+    for(r = 0; r < nRanges && ret == 0; r++) {
+      ppRanges[r] = XORSATFilterSpillOpen(pSpill->pDirectory);
+      if(ppRanges[r] == NULL) ret = 1;
+    }
+    if(ret == 0) ret = XORSATFilterSpillPartition(xsfb, ppRanges, nRanges, nBlocks, nRangeBlocks, sParams.nFormat);
+    fclose(pSpill->pFile);
+  }
+  pSpill->pFile = NULL;
+  pSpill->nSpilled = 0;
+
+  threadpool thpool = thpool_init(nThreads);
+
+  uint32_t nPredictedWords = UINT32_MAX;
+  for(r = 0; r < nRanges; r++) {
+    uint32_t nFirstBlock = r * nRangeBlocks;
+    uint32_t nBlocksInRange = ((nBlocks - nFirstBlock) < nRangeBlocks) ? (nBlocks - nFirstBlock) : nRangeBlocks;
+    if(ret == 0) {
+      ret = XORSATFilterBuildRange(xsfb, sParams, ppRanges[r], nBlocks, nFirstBlock, nBlocksInRange, &nPredictedWords, pVariables + nFirstBlock, pXORSATFilterFile, pScheduler, thpool, nThreads);
+    }
+    if(ppRanges[r] != NULL) fclose(ppRanges[r]);
+#ifdef XORSATFILTER_PRINT_BUILD_PROGRESS
+    if(ret == 0 && nRanges > 1) fprintf(stderr, "Built blocks %u to %u\n", nFirstBlock, nFirstBlock + nBlocksInRange - 1);
+#endif
+  }
+
+  thpool_destroy(thpool);
+  XORSATFilterSchedulerFree(pScheduler);
+  free(ppRanges);
+
+  xsfb->sStats.nPredictedWords = nPredictedWords;
+
+  if(xsfb->sStats.nConflictingDuplicates > 0) {
+    fprintf(stderr, "Warning: %"PRIu64" duplicate elements or hash collisions had conflicting metadata or presence. Possible loss of data. See XORSATFilterBuilderStats()\n", xsfb->sStats.nConflictingDuplicates);
+  }
+
+  //Block offsets and header, as XORSATFilterSerialize writes them
+  XORSATFilterQuerier xsfq;
+  memset(&xsfq, 0, sizeof(XORSATFilterQuerier));
+  xsfq.pOffsets = (ret == 0) ? (int16_t *)malloc(((size_t) nBlocks + 1) * sizeof(int16_t)) : NULL;
+  if(xsfq.pOffsets != NULL) {
+    uint64_t nAvgVarsPerBlock = 0;
+    for(r = 0; r < nBlocks; r++) {
+      nAvgVarsPerBlock += pVariables[r];
+    }
+    xsfq.nBlocks = nBlocks;
+    xsfq.nAvgVarsPerBlock = nAvgVarsPerBlock / (uint64_t) nBlocks;
+    xsfq.nSolutions = sParams.nSolutions;
+    xsfq.nMetaDataBytes = nMetaDataBytes;
+    xsfq.nLitsPerRow = sParams.nLitsPerRow;
+    xsfq.nFormat = sParams.nFormat;
+
+    uint64_t nBlockIndex = 0;
+    for(r = 0; r < nBlocks && ret == 0; r++) {
+      if(XORSATFilterStoreBlockIndex(&xsfq, r, nBlockIndex) != 1) ret = 1;
+      nBlockIndex += pVariables[r];
+    }
+    if(ret == 0 && XORSATFilterStoreBlockIndex(&xsfq, r, nBlockIndex) != 1) ret = 1;
+    if(ret == 0) ret = XORSATFilterSerializeOffsets(pXORSATFilterFile, &xsfq);
+  } else {
+    ret = 1;
+  }
+
+  free(xsfq.pOffsets);
+  free(pVariables);
+
+  return ret;
+}
@@ -40,63 +40,45 @@ XORSATFilterHash XORSATFilterGenerateHashesFromElement(const void *pElement, siz
   return xsfh;
 }
 
-inline
-uint32_t XORSATFilterHashToBlock(XORSATFilterHash xsfh, uint32_t nBlocks) {
-  return ((uint32_t *)&xsfh)[0] % nBlocks;
-}
+XORSATFilterHash XORSATFilterHashFromUint64(uint64_t nHash) {
+  XORSATFilterHash xsfh;
 
-inline
-void XORSATFilterGenerateRowFromHash_WRS(XORSATFilterHash xsfh, uint32_t nVariables, uint32_t *pRow, uint8_t nLitsPerRow) {
-  uint32_t i = 0;
+  xsfh.h1 = nHash ^ (nHash >> 63); //Fold in the bit that doesn't fit
+  if(xsfh.h1 == 0) xsfh.h1 = (uint64_t)0x1ae202980e70d8f1;
+  xsfh.present = 1;
 
-  XORSATFilterHash128 xsfh_128;
-  xsfh_128.h1 = xsfh.h1;
-  xsfh_128.h2 = xsfh_128.h1 ^ 0xc93bd65d1f9ade1a;
-  
-  uint16_t *xsfh_16 = xsfh_128.h16;
+  return xsfh;
+}
 
-  //Can get 5 values with little effort
-  for(; i < nLitsPerRow && i < 5; i++) {
-    pRow[i] = xsfh_16[i] % nVariables;
+inline
+uint32_t XORSATFilterHashToBlock(XORSATFilterHash xsfh, uint32_t nBlocks, uint8_t nFormat) {
+  if(nFormat & XORSATFILTER_FORMAT_FASTRANGE) {
+    //Multiply first so the block doesn't depend only on the high bits
+    //of h32[0], which are reused when generating rows
+    return XORSATFILTER_FASTRANGE((((uint64_t) xsfh.h1) * (uint64_t)0x9e3779b97f4a7c15) >> 32, nBlocks, 32);
   }
+  return ((uint32_t *)&xsfh)[0] % nBlocks;
+}
 
-  //Spin up an LFSR for larger number of literals
-  for(; i < nLitsPerRow; i++) {
-    //Primitive polynomial 1 + x^2 + x^3 + x^4 + x^8
-    xsfh_128.h1 = xsfh_128.h1 >> 16;
-    xsfh_16[3]  = xsfh_16[4];
-    xsfh_128.h2 = xsfh_128.h2 >> 16;
-    xsfh_16[7] ^= xsfh_16[0] ^ xsfh_16[2] ^ xsfh_16[3] ^ xsfh_16[4];
+//Number of variables each literal of a windowed WRS row is drawn from
+//(XORSATFILTER_FORMAT_WRS_WINDOW). Literal i comes from the i-th slice
+//of the window so no two literals coincide. In a window this small,
+//literals cancelling in pairs would leave empty rows, which are never
+//satisfiable no matter how many variables are added to the block.
+uint32_t XORSATFilterWRSWindowSlice(uint32_t nRHSBits, uint8_t nLitsPerRow) {
+  uint32_t nWindow = XORSATFILTER_WRS_WINDOW_BITS / nRHSBits;
+  if(nWindow < XORSATFILTER_WRS_WINDOW_MIN) nWindow = XORSATFILTER_WRS_WINDOW_MIN;
+  return nWindow / nLitsPerRow;
+}
 
-    pRow[i] = xsfh_16[5] % nVariables;
-  }
+void XORSATFilterGenerateRowFromHash_WRS(XORSATFilterHash xsfh, uint32_t nVariables, uint32_t *pRow, uint8_t nLitsPerRow, uint8_t nFormat, uint32_t nSlice) {
+  XORSATFilterRowFromHash_WRS(xsfh, nVariables, pRow, nLitsPerRow, nFormat, nSlice);
+}
 
-  pRow[i] = xsfh.present ? ((uint32_t *)&xsfh_128)[3] : ~((uint32_t *)&xsfh_128)[3]; //Allow up to 32 solutions
+XORSATFilterRow XORSATFilterGenerateRowFromHash_DW(XORSATFilterHash xsfh, uint32_t nVariables, uint8_t nFormat) {
+  return XORSATFilterRowFromHash_DW(xsfh, nVariables, nFormat);
 }
 
-inline
-XORSATFilterRow XORSATFilterGenerateRowFromHash_DW(XORSATFilterHash xsfh, uint32_t nVariables) {
-  XORSATFilterHash128 xsfh_128;
-      
-  xsfh_128.h1 = xsfh.h1;
-  //xsfh_128.h2 = XXH64((uint8_t *)&xsfh_128.h1, 4, (unsigned long long)0x1ae202980e70d8f1);
-  //xsfh_128.h2 = XXH64(NULL, 0, xsfh_128.h1);
-  xsfh_128.h2 = xsfh.h1 ^ 0xc93bd65d1f9ade1a;
-
-  uint16_t *xsfh_16 = xsfh_128.h16;
-  uint32_t *xsfh_32 = xsfh_128.h32;
-
-  uint32_t nBlocks = nVariables >> 4;
-  
-  XORSATFilterRow xsfrow;
-  xsfrow.b1 = xsfh_16[2] % nBlocks;
-  xsfrow.b2 = ((xsfh_16[3] % (nBlocks - 1)) + 1 + xsfrow.b1) % nBlocks;
-
-  xsfrow.p1 = xsfh_16[4];
-  if(xsfrow.p1 == 0) xsfrow.p1 = 1;
-  xsfrow.p2 = xsfh_16[5];
-  if(xsfrow.p2 == 0) xsfrow.p2 = 1;
-  
-  xsfrow.rhs = xsfh.present ? xsfh_32[3] : ~xsfh_32[3]; //Allow up to 32 solutions
-  return xsfrow;
+XORSATFilterRibbonRow XORSATFilterGenerateRowFromHash_Ribbon(XORSATFilterHash xsfh, uint32_t nVariables, uint8_t nFormat) {
+  return XORSATFilterRowFromHash_Ribbon(xsfh, nVariables, nFormat);
 }
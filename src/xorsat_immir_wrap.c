@@ -6,80 +6,87 @@
 
 #include "xorsat_filter.h"
 
-uint8_t immir_low_bit[256] = {0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 7, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0};
+//Sets up pScratch->sMatrix for m rows of n variables and b right hand
+//side columns, all zero, with its matrix, pivots and 4 Russians tables
+//held in pScratch so that no solve allocates them. Returns NULL if they
+//couldn't be allocated.
+static
+gf2_t *XORSATFilterScratchMatrix(XORSATFilterScratch *pScratch, uint32_t m, uint32_t n, uint32_t b) {
+  gf2_t *pMatrix = &pScratch->sMatrix;
+  memset(pMatrix, 0, sizeof(gf2_t));
+
+  pMatrix->m = m;
+  pMatrix->n = n;
+  pMatrix->b = b;
+  pMatrix->wds = gf2_words(n, b);
+  //gf2_init's default. Tables of fewer than 2 bits are never used.
+  pMatrix->tablebits = (m > 7) ? (int) log(m) : 1;
+
+  size_t nTableRows = ((size_t) 1) << pMatrix->tablebits;
+  pMatrix->matrix = XORSATFilterScratchZeroed(pScratch, XORSATFILTER_SCRATCH_MATRIX, (size_t) m * pMatrix->wds * sizeof(uint64_t));
+  pMatrix->pivots = (int *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_PIVOTS, (size_t) m * sizeof(int));
+  pMatrix->table = XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_TABLE, nTableRows * pMatrix->wds * sizeof(uint64_t));
+  pMatrix->tableindex = (int *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_TABLE_INDEX, nTableRows * sizeof(int));
+  if(pMatrix->matrix == NULL || pMatrix->pivots == NULL || pMatrix->table == NULL || pMatrix->tableindex == NULL) {
+    return NULL;
+  }
+
+  gf2_init(pMatrix);
+
+  return pMatrix;
+}
 
-gf2_t *XORSATFilterBuildIMMIRMatrix_WRS(XORSATFilterBlock *pBlock) {
+//Builds the matrix of the 2-core left by peeling a WRS block (see
+//xorsat_peel.c). pCoreRows lists the nCoreRows elements of the core;
+//element i has pNumLits[i] literals at pLits + i*nLitsPerRow, already
+//renumbered to the nColumns columns of the core, and solution bits
+//pRowBits[i]. The matrix belongs to pScratch.
+gf2_t *XORSATFilterBuildIMMIRMatrix_Core(const XORSATFilterBlock *pBlock, const uint32_t *pCoreRows, uint32_t nCoreRows, uint32_t nColumns, const uint32_t *pLits, const uint8_t *pNumLits, const uint32_t *pRowBits, XORSATFilterScratch *pScratch) {
   uint32_t i;
   size_t j;
-  uint32_t pRow[pBlock->nLitsPerRow + 1];
+  uint32_t nRHSWords = (pBlock->nSolutions + (pBlock->nMetaDataBytes * 8) + 63) >> 6;
+  uint64_t pRHS[nRHSWords];
 
-  //Allocate matrix
-  gf2_t *pMatrix = calloc(1, sizeof(gf2_t));
+  gf2_t *pMatrix = XORSATFilterScratchMatrix(pScratch, nCoreRows, nColumns, pBlock->nSolutions + (pBlock->nMetaDataBytes * 8));
   if(pMatrix == NULL) return NULL;
-  
-  pMatrix->m = pBlock->pHashes.nLength;
-  pMatrix->n = pBlock->nVariables;
-  pMatrix->b = pBlock->nSolutions + (pBlock->nMetaDataBytes * 8);
-  gf2_init(pMatrix);
-  
+
   //Add rows
-  for(i = 0; i < pBlock->pHashes.nLength; i++) {
-    XORSATFilterGenerateRowFromHash_WRS(pBlock->pHashes.pList[i], pBlock->nVariables, pRow, pBlock->nLitsPerRow);
-    
+  for(i = 0; i < nCoreRows; i++) {
+    uint32_t nRow = pCoreRows[i];
+    uint64_t *pMatrixRow = ((uint64_t *)pMatrix->matrix) + ((size_t) i * pMatrix->wds);
+
     //Add variables
-    for(j = 0; j < pBlock->nLitsPerRow; j++) {
-      uint32_t word = pRow[j]/64;
-      uint64_t bit = pRow[j]%64;
-      ((uint64_t *)pMatrix->matrix)[i*pMatrix->wds + word] ^= (((uint64_t)1) << bit);
-    }
-    
-    //Add solution bits
-    for(j = 0; j < pBlock->nSolutions; j++) {
-      if((pRow[pBlock->nLitsPerRow]>>j) & 1) {
-        uint32_t word = (pBlock->nVariables+j)/64;
-        uint64_t bit = (pBlock->nVariables+j)%64;
-        ((uint64_t *)pMatrix->matrix)[i*pMatrix->wds + word] |= (((uint64_t)1) << bit);
-      }
+    for(j = 0; j < pNumLits[nRow]; j++) {
+      uint32_t nColumn = pLits[(size_t) nRow * pBlock->nLitsPerRow + j];
+      pMatrixRow[nColumn/64] ^= (((uint64_t)1) << (nColumn%64));
     }
 
-    if(pBlock->nMetaDataBytes > 0) {
-      //Add meta data bits
-      uint8_t *pMetaData = (pBlock->pMetaData.pList[i]).pMetaData;
-      size_t nMetaDataByte = 0;
-      uint8_t nMetaDataBit = 0;
-      for(; j < pMatrix->b; j++) {
-        if((pMetaData[nMetaDataByte] >> nMetaDataBit) & 1) {
-          uint32_t word = (pBlock->nVariables+j)/64;
-          uint64_t bit = (pBlock->nVariables+j)%64;
-          ((uint64_t *)pMatrix->matrix)[i*pMatrix->wds + word] |= (((uint64_t)1) << bit);
-        }
-        if(++nMetaDataBit == 8) {
-          nMetaDataBit = 0;
-          nMetaDataByte++;
-        }
+    //Add solution and meta data bits
+    XORSATFilterBlockRowRHS(pBlock, nRow, pRowBits[nRow], pRHS, nRHSWords);
+    uint32_t word = nColumns/64;
+    uint32_t bit = nColumns%64;
+    for(j = 0; j < nRHSWords; j++) {
+      pMatrixRow[word + j] |= pRHS[j] << bit;
+      if(bit != 0 && word + j + 1 < (size_t) pMatrix->wds) {
+        pMatrixRow[word + j + 1] |= pRHS[j] >> (64 - bit);
       }
     }
   }
-  
+
   return pMatrix;
 }
 
-gf2_t *XORSATFilterBuildIMMIRMatrix_DW(XORSATFilterBlock *pBlock) {
+//Builds the matrix of a DW block's rows. The matrix belongs to pScratch.
+gf2_t *XORSATFilterBuildIMMIRMatrix_DW(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch) {
   uint32_t i;
   size_t j;
 
-  //Allocate matrix
-  gf2_t *pMatrix = calloc(1, sizeof(gf2_t));
+  gf2_t *pMatrix = XORSATFilterScratchMatrix(pScratch, pBlock->pHashes.nLength, pBlock->nVariables, pBlock->nSolutions + (pBlock->nMetaDataBytes * 8));
   if(pMatrix == NULL) return NULL;
 
-  pMatrix->m = pBlock->pHashes.nLength;
-  pMatrix->n = pBlock->nVariables;
-  pMatrix->b = pBlock->nSolutions + (pBlock->nMetaDataBytes * 8);
-  gf2_init(pMatrix);
-
   //Add rows
   for(i = 0; i < pBlock->pHashes.nLength; i++) {
-    XORSATFilterRow xsfrow = XORSATFilterGenerateRowFromHash_DW(pBlock->pHashes.pList[i], pBlock->nVariables);
+    XORSATFilterRow xsfrow = XORSATFilterGenerateRowFromHash_DW(pBlock->pHashes.pList[i], pBlock->nVariables, pBlock->nFormat);
 
     //Add variables
     ((uint16_t *)pMatrix->matrix)[i*4*pMatrix->wds + xsfrow.b1] ^= xsfrow.p1;
@@ -96,7 +103,7 @@ gf2_t *XORSATFilterBuildIMMIRMatrix_DW(XORSATFilterBlock *pBlock) {
 
     if(pBlock->nMetaDataBytes > 0) {
       //Add meta data bits
-      uint8_t *pMetaData = (pBlock->pMetaData.pList[i]).pMetaData;
+      const uint8_t *pMetaData = pBlock->pMetaData + ((size_t) i * pBlock->nMetaDataBytes);
       size_t nMetaDataByte = 0;
       uint8_t nMetaDataBit = 0;
       for(; j < pMatrix->b; j++) {
@@ -116,76 +123,76 @@ gf2_t *XORSATFilterBuildIMMIRMatrix_DW(XORSATFilterBlock *pBlock) {
   return pMatrix;
 }
 
-void IMMIRGetSparseRow(uint64_t *tmpRow, gf2_t *pMatrix, uint32_t nRowNum) {
-  uint32_t i;
-  tmpRow[0] = 0;
-  for(i = 0; i < pMatrix->wds; i++) {
-    uint64_t the_word = ((uint64_t *)pMatrix->matrix)[nRowNum*pMatrix->wds + i];
-    uint64_t iw = 0;
-    while(the_word) {
-      uint8_t next_char = the_word&0xff;
-      while(next_char) {
-	uint64_t lb = (uint64_t)immir_low_bit[next_char];
-	next_char ^= (1<<lb);
-	tmpRow[++tmpRow[0]] = iw+lb + (i << 6);
-	assert(tmpRow[0] < pMatrix->n + pMatrix->b);
-	assert(tmpRow[tmpRow[0]] < (pMatrix->n + pMatrix->b));
-      }
-      iw += 8;
-      the_word >>= 8;
-    }
+//Back substitution on pMatrix after gf2_semi_ech. pSolutions holds
+//nRHSWords words for each of the matrix's n variables; bit j of a
+//variable's words is its value in right hand side column j. Rows are
+//read a word at a time: the lowest set variable bit of a row is its
+//pivot, the other variable bits are found with ctz, and their solutions
+//are XORed into the row's right hand side word by word. Free variables
+//are random. Returns 1 on success and 0 if the rows are unsatisfiable.
+uint8_t XORSATFilterFindIMMIRSolutions(gf2_t *pMatrix, uint64_t *pSolutions, uint32_t nRHSWords, uint64_t *pRandomState) {
+  int32_t i;
+  uint32_t j, k;
+  uint32_t n = pMatrix->n;
+  uint32_t nVariableWords = (n + 63) >> 6;
+  uint64_t nLastVariableMask = (n & 0x3f) ? ((((uint64_t) 1) << (n & 0x3f)) - 1) : ~(uint64_t) 0;
+  uint64_t nLastRHSMask = (pMatrix->b & 0x3f) ? ((((uint64_t) 1) << (pMatrix->b & 0x3f)) - 1) : ~(uint64_t) 0;
+  uint64_t pParity[nRHSWords];
+
+  gf2_semi_ech(pMatrix);
+
+  for(j = 0; j < n * nRHSWords; j++) {
+    pSolutions[j] = XORSATFilterRandom(pRandomState);
   }
-}
 
-uint8_t XORSATFilterFindIMMIRSolutions(gf2_t *pMatrix, bitvector_t *pSolutions) {
-  int32_t i, j;
-  uint64_t pRow[pMatrix->n + pMatrix->b];
-
-  int ret = gf2_semi_ech(pMatrix);
-
-  for(i = 0; i < pMatrix->n; i++) {
-    for(j = 0; j < pSolutions[i].bits.nLength; j++) {
-      pSolutions[i].bits.pList[j] ^= ((uint64_t) rand()) <<  0;
-      pSolutions[i].bits.pList[j] ^= ((uint64_t) rand()) << 32;
-    }
-  }
-  
-  bitvector_t *pParity = bitvector_t_alloc(pMatrix->b);
-  
   for(i = pMatrix->m-1; i >= 0; i--) {
-    IMMIRGetSparseRow(pRow, pMatrix, i);
-
-    if(pRow[0] == 0) continue;
+    const uint64_t *pRow = ((const uint64_t *)pMatrix->matrix) + ((size_t) i * pMatrix->wds);
+
+    //Right hand side, columns n to n+b-1
+    uint64_t nRHSAny = 0;
+    for(k = 0; k < nRHSWords; k++) {
+      uint32_t nBit = n + (k << 6);
+      uint64_t nWord = pRow[nBit >> 6] >> (nBit & 0x3f);
+      if((nBit & 0x3f) != 0 && (nBit >> 6) + 1 < (uint32_t) pMatrix->wds) { //X86 shifts are mod 64
+        nWord |= pRow[(nBit >> 6) + 1] << (64 - (nBit & 0x3f));
+      }
+      if(k == nRHSWords - 1) nWord &= nLastRHSMask;
+      pParity[k] = nWord;
+      nRHSAny |= nWord;
+    }
 
-    bitvector_t_zeroize(pParity);
-    while(pRow[0] && (pRow[pRow[0]] >= pMatrix->n)) {
-      bitvector_t_setBit(pParity, pRow[pRow[0]] - pMatrix->n, 1);
-      pRow[0]--;
+    uint32_t nPivot = n;
+    for(j = 0; j < nVariableWords; j++) {
+      uint64_t nWord = pRow[j];
+      if(j == nVariableWords - 1) nWord &= nLastVariableMask;
+      while(nWord) {
+        uint32_t nVariable = (j << 6) + __builtin_ctzll(nWord);
+        nWord &= nWord - 1;
+        if(nPivot == n) {
+          nPivot = nVariable;
+          continue;
+        }
+        const uint64_t *pOther = pSolutions + ((size_t) nVariable * nRHSWords);
+        for(k = 0; k < nRHSWords; k++) {
+          pParity[k] ^= pOther[k];
+        }
+      }
     }
 
-    if(pRow[0] == 0) {
+    if(nPivot == n) {
+      if(nRHSAny == 0) continue; //An empty row
       return 0; //UNSAT
       //Could be duplicate original row that was zeroed out. Wouldn't
       //know unless checking whether the non-metatdata bits of the RHS
-      //are all zero. However, this is unlikely as duplicate rows were
-      //removed near the top of
-      //xorsat_blocks.c:XORSATFilterDistributeHashesToBlocks. This
-      //case could still happen if two hashes produce the same row,
-      //but then the block will be resized until this doesn't
-      //happen. So, the result is that efficiency may suffer, but only
-      //slightly. Or, one could put the appropriate check here which
-      //would involve passing in the number of solutions.
+      //are all zero. However, this is unlikely as duplicate hashes are
+      //removed before solving (see xorsat_solve.c). This case could
+      //still happen if two hashes produce the same row, but then the
+      //block will be resized until this doesn't happen. So, the result
+      //is that efficiency may suffer, but only slightly.
     }
 
-    for(j = 2; j <= pRow[0]; j++) {
-      bitvector_t_xorUpdate(pParity, &pSolutions[pRow[j]]);
-    }
-    
-    assert(pRow[1] < pMatrix->n);
-    bitvector_t_copyUpdate(&pSolutions[pRow[1]], pParity);
+    memcpy(pSolutions + ((size_t) nPivot * nRHSWords), pParity, nRHSWords * sizeof(uint64_t));
   }
 
-  bitvector_t_free(pParity);
-  
-  return 1;  
+  return 1;
 }
@@ -6,12 +6,29 @@
 
 #include "xorsat_filter.h"
 
-create_c_list_type(XORSATFilterMetaData_list, XORSATFilterMetaData)
+//Makes room for at least nBytes bytes in the arena, growing it
+//geometrically so that appending one element at a time stays cheap.
+uint8_t XORSATFilterMetaDataReserve(uint8_t_list *pArena, size_t nBytes) {
+  if(pArena->nLength_max >= nBytes) return C_LIST_NO_ERROR;
+
+  size_t nLength_max = (pArena->nLength_max > 0) ? pArena->nLength_max : 64;
+  while(nLength_max < nBytes) nLength_max *= 2;
+
+  return uint8_t_list_resize(pArena, nLength_max);
+}
+
+//Copies one element's metadata to the end of the arena. If pMetaData
+//is NULL, the element's metadata is zeroed.
+uint8_t XORSATFilterMetaDataAppend(uint8_t_list *pArena, const void *pMetaData, size_t nMetaDataBytes) {
+  uint8_t ret = XORSATFilterMetaDataReserve(pArena, pArena->nLength + nMetaDataBytes);
+  if(ret != C_LIST_NO_ERROR) return ret;
 
-void XORSATFilterMetaDataFree(XORSATFilterMetaData *pMetaData) {
   if(pMetaData != NULL) {
-    if(pMetaData->pMetaData != NULL) {
-      free(pMetaData->pMetaData);
-    }
+    memcpy(pArena->pList + pArena->nLength, pMetaData, nMetaDataBytes);
+  } else {
+    memset(pArena->pList + pArena->nLength, 0, nMetaDataBytes);
   }
+  pArena->nLength += nMetaDataBytes;
+
+  return C_LIST_NO_ERROR;
 }
@@ -0,0 +1,328 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#define _GNU_SOURCE //sched_getcpu, pthread_setaffinity_np
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "xorsat_filter.h"
+
+//From linux/mempolicy.h; mbind is called directly so libnuma isn't needed
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+#define XORSATFILTER_NUMA_MAX_RANGES 256
+
+//Reads a sysfs list such as "0-3,8-11" into pairs of first and last
+//numbers. Returns the number of ranges read, 0 if the file is missing.
+static
+uint32_t XORSATFilterNUMAReadList(const char *pPath, uint32_t *pRanges) {
+  FILE *pFile = fopen(pPath, "r");
+  if(pFile == NULL) return 0;
+
+  uint32_t nRanges = 0;
+  unsigned int nFirst, nLast;
+  int c;
+  while(nRanges < XORSATFILTER_NUMA_MAX_RANGES && fscanf(pFile, "%u", &nFirst) == 1) {
+    nLast = nFirst;
+    c = fgetc(pFile);
+    if(c == '-') {
+      if(fscanf(pFile, "%u", &nLast) != 1) break;
+      c = fgetc(pFile);
+    }
+    pRanges[2*nRanges] = nFirst;
+    pRanges[2*nRanges + 1] = nLast;
+    nRanges++;
+    if(c != ',') break;
+  }
+
+  fclose(pFile);
+  return nRanges;
+}
+
+//Fills pCPUs with the CPUs of nNode. Returns the number of CPUs.
+static
+uint32_t XORSATFilterNUMANodeCPUs(const XORSATFilterNUMAQuerier *xsfnq, uint32_t nNode, cpu_set_t *pCPUs) {
+  uint32_t i, nCount = 0;
+  CPU_ZERO(pCPUs);
+  for(i = 0; i < xsfnq->nCPUs && i < CPU_SETSIZE; i++) {
+    if(xsfnq->pCPUNodes[i] == (int32_t) nNode) {
+      CPU_SET(i, pCPUs);
+      nCount++;
+    }
+  }
+  return nCount;
+}
+
+typedef struct XORSATFilterNUMAReplicaJob {
+  const XORSATFilterQuerier *xsfq;
+  uint32_t nNode;
+  uint32_t nNodes;
+  cpu_set_t cpus;
+  XORSATFilterQuerier *pReplica;
+  uint8_t bBound;
+} XORSATFilterNUMAReplicaJob;
+
+//Runs on the CPUs of the replica's node. The mapping is bound to the node
+//before it is touched; if mbind isn't permitted, the pages still land on
+//the node through first-touch placement since this thread does the copy.
+static
+void *XORSATFilterNUMABuildReplica(void *pArg) {
+  XORSATFilterNUMAReplicaJob *pJob = (XORSATFilterNUMAReplicaJob *) pArg;
+  const XORSATFilterQuerier *xsfq = pJob->xsfq;
+
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &pJob->cpus);
+
+  XORSATFilterQuerier *pReplica = (XORSATFilterQuerier *)malloc(sizeof(XORSATFilterQuerier));
+  if(pReplica == NULL) return NULL;
+  *pReplica = *xsfq;
+
+  //Filter, a padding word for vectorized queries, then offsets
+  uint64_t nFilterWords = XORSATFilterGetBlockIndex(xsfq, xsfq->nBlocks);
+  size_t nOffsetBytes = ((size_t) xsfq->nBlocks + 1) * sizeof(int16_t);
+  pReplica->pFilter = XORSATFilterMapAnonymous(((nFilterWords + 1) * sizeof(uint64_t)) + nOffsetBytes, 0, &pReplica->nMappedBytes);
+  if(pReplica->pFilter == NULL) {
+    free(pReplica);
+    return NULL;
+  }
+  madvise(pReplica->pFilter, pReplica->nMappedBytes, MADV_HUGEPAGE);
+
+  unsigned long pNodeMask[(pJob->nNodes + 63) / 64];
+  memset(pNodeMask, 0, sizeof(pNodeMask));
+  pNodeMask[pJob->nNode / 64] |= 1UL << (pJob->nNode % 64);
+  pJob->bBound = syscall(SYS_mbind, pReplica->pFilter, pReplica->nMappedBytes, MPOL_BIND, pNodeMask, (unsigned long) (64 * ((pJob->nNodes + 63) / 64)) + 1, 0) == 0;
+
+  memcpy(pReplica->pFilter, xsfq->pFilter, nFilterWords * sizeof(uint64_t));
+  pReplica->pOffsets = (int16_t *) (pReplica->pFilter + nFilterWords + 1);
+  memcpy(pReplica->pOffsets, xsfq->pOffsets, nOffsetBytes);
+  pReplica->bMMAP = 1;
+
+  pJob->pReplica = pReplica;
+  return NULL;
+}
+
+//Builds a replica of xsfq on every node with CPUs. Returns NULL on error.
+static
+XORSATFilterQuerier **XORSATFilterNUMABuildReplicas(const XORSATFilterNUMAQuerier *xsfnq, const XORSATFilterQuerier *xsfq) {
+  uint32_t i;
+  uint8_t bFailed = 0, bUnbound = 0;
+
+  XORSATFilterQuerier **ppReplicas = (XORSATFilterQuerier **)calloc(xsfnq->nNodes, sizeof(XORSATFilterQuerier *));
+  if(ppReplicas == NULL) return NULL;
+
+  for(i = 0; i < xsfnq->nNodes; i++) {
+    XORSATFilterNUMAReplicaJob job = {.xsfq = xsfq, .nNode = i, .nNodes = xsfnq->nNodes, .pReplica = NULL, .bBound = 0};
+    if(XORSATFilterNUMANodeCPUs(xsfnq, i, &job.cpus) == 0) continue;
+
+    //One node at a time, so each copy has the memory bandwidth to itself
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, XORSATFilterNUMABuildReplica, &job) != 0) {
+      bFailed = 1;
+      break;
+    }
+    pthread_join(thread, NULL);
+
+    if(job.pReplica == NULL) {
+      bFailed = 1;
+      break;
+    }
+    if(!job.bBound) bUnbound = 1;
+    ppReplicas[i] = job.pReplica;
+  }
+
+  if(bFailed) {
+    fprintf(stderr, "Error: could not create NUMA replica\n");
+    for(i = 0; i < xsfnq->nNodes; i++) {
+      if(ppReplicas[i] != NULL) XORSATFilterQuerierFree(ppReplicas[i]);
+    }
+    free(ppReplicas);
+    return NULL;
+  }
+
+  if(bUnbound) {
+    fprintf(stderr, "Warning: mbind failed, NUMA replicas rely on first-touch placement\n");
+  }
+
+  return ppReplicas;
+}
+
+//xsfq is only read; the caller still owns (and frees) it.
+XORSATFilterNUMAQuerier *XORSATFilterNUMAQuerierAlloc(const XORSATFilterQuerier *xsfq) {
+  uint32_t pRanges[2 * XORSATFILTER_NUMA_MAX_RANGES];
+  uint32_t i, j, k, nRanges;
+  char pPath[64];
+
+  XORSATFilterNUMAQuerier *xsfnq = (XORSATFilterNUMAQuerier *)malloc(sizeof(XORSATFilterNUMAQuerier));
+  if(xsfnq == NULL) return NULL;
+
+  //Without sysfs, treat the machine as a single node
+  long nConfigured = sysconf(_SC_NPROCESSORS_CONF);
+  xsfnq->nCPUs = (nConfigured > 0) ? (uint32_t) nConfigured : 1;
+  xsfnq->nNodes = 1;
+  nRanges = XORSATFilterNUMAReadList("/sys/devices/system/node/online", pRanges);
+  for(i = 0; i < nRanges; i++) {
+    if(pRanges[2*i + 1] + 1 > xsfnq->nNodes) xsfnq->nNodes = pRanges[2*i + 1] + 1;
+  }
+
+  //CPU numbers may be sparse, so size the map by the largest one seen
+  for(j = 0; j < xsfnq->nNodes; j++) {
+    snprintf(pPath, sizeof(pPath), "/sys/devices/system/node/node%u/cpulist", j);
+    nRanges = XORSATFilterNUMAReadList(pPath, pRanges);
+    for(i = 0; i < nRanges; i++) {
+      if(pRanges[2*i + 1] + 1 > xsfnq->nCPUs) xsfnq->nCPUs = pRanges[2*i + 1] + 1;
+    }
+  }
+
+  xsfnq->pCPUNodes = (int32_t *)malloc(xsfnq->nCPUs * sizeof(int32_t));
+  if(xsfnq->pCPUNodes == NULL) {
+    free(xsfnq);
+    return NULL;
+  }
+
+  uint8_t bFound = 0;
+  for(i = 0; i < xsfnq->nCPUs; i++) xsfnq->pCPUNodes[i] = -1;
+  for(j = 0; j < xsfnq->nNodes; j++) {
+    snprintf(pPath, sizeof(pPath), "/sys/devices/system/node/node%u/cpulist", j);
+    nRanges = XORSATFilterNUMAReadList(pPath, pRanges);
+    for(i = 0; i < nRanges; i++) {
+      for(k = pRanges[2*i]; k <= pRanges[2*i + 1]; k++) {
+	xsfnq->pCPUNodes[k] = (int32_t) j;
+	bFound = 1;
+      }
+    }
+  }
+  if(!bFound) {
+    for(i = 0; i < xsfnq->nCPUs; i++) xsfnq->pCPUNodes[i] = 0;
+  }
+
+  xsfnq->ppReplicas = XORSATFilterNUMABuildReplicas(xsfnq, xsfq);
+  if(xsfnq->ppReplicas == NULL) {
+    free(xsfnq->pCPUNodes);
+    free(xsfnq);
+    return NULL;
+  }
+
+  return xsfnq;
+}
+
+//Replaces every replica with a copy of xsfq, for example one just
+//deserialized from an updated file. The new replicas are built before
+//the old ones are freed, so on failure (returns 1) xsfnq is unchanged.
+uint8_t XORSATFilterNUMAQuerierReload(XORSATFilterNUMAQuerier *xsfnq, const XORSATFilterQuerier *xsfq) {
+  uint32_t i;
+
+  XORSATFilterQuerier **ppReplicas = XORSATFilterNUMABuildReplicas(xsfnq, xsfq);
+  if(ppReplicas == NULL) return 1;
+
+  for(i = 0; i < xsfnq->nNodes; i++) {
+    if(xsfnq->ppReplicas[i] != NULL) XORSATFilterQuerierFree(xsfnq->ppReplicas[i]);
+  }
+  free(xsfnq->ppReplicas);
+  xsfnq->ppReplicas = ppReplicas;
+
+  return 0;
+}
+
+void XORSATFilterNUMAQuerierFree(XORSATFilterNUMAQuerier *xsfnq) {
+  uint32_t i;
+
+  for(i = 0; i < xsfnq->nNodes; i++) {
+    if(xsfnq->ppReplicas[i] != NULL) XORSATFilterQuerierFree(xsfnq->ppReplicas[i]);
+  }
+  free(xsfnq->ppReplicas);
+  free(xsfnq->pCPUNodes);
+  free(xsfnq);
+}
+
+//Replica of nNode, or NULL if the node has no CPUs (and so no replica)
+const XORSATFilterQuerier *XORSATFilterNUMANodeQuerier(const XORSATFilterNUMAQuerier *xsfnq, uint32_t nNode) {
+  if(nNode >= xsfnq->nNodes) return NULL;
+  return xsfnq->ppReplicas[nNode];
+}
+
+//Replica local to the CPU the calling thread is running on. Threads can
+//migrate, so look it up per query (or per batch) rather than caching it.
+const XORSATFilterQuerier *XORSATFilterNUMALocalQuerier(const XORSATFilterNUMAQuerier *xsfnq) {
+  uint32_t i;
+  int nCPU = sched_getcpu();
+
+  if(nCPU >= 0 && (uint32_t) nCPU < xsfnq->nCPUs) {
+    int32_t nNode = xsfnq->pCPUNodes[nCPU];
+    if(nNode >= 0 && xsfnq->ppReplicas[nNode] != NULL) return xsfnq->ppReplicas[nNode];
+  }
+
+  for(i = 0; i < xsfnq->nNodes; i++) {
+    if(xsfnq->ppReplicas[i] != NULL) return xsfnq->ppReplicas[i];
+  }
+
+  return NULL;
+}
+
+uint8_t XORSATFilterNUMAQuery(const XORSATFilterNUMAQuerier *xsfnq, const void *pElement, uint32_t nElementBytes) {
+  return XORSATFilterQuery(XORSATFilterNUMALocalQuerier(xsfnq), pElement, nElementBytes);
+}
+
+/*************************************************************************************
+
+  Benchmark for NUMA replicated queriers.
+
+**************************************************************************************/
+
+//Times queries from threads with their own queriers and CPUs, see src/xorsat_query.c
+uint64_t XORSATFilterQueryRateThreads(const XORSATFilterQuerier **ppQueriers, const cpu_set_t **ppCPUs, uint32_t nThreads, uint32_t *pThreadRates);
+
+//Runs nThreadsPerNode threads pinned to the CPUs of each node with a
+//replica. With bRemote clear, each thread queries its own node's
+//replica; with bRemote set, it queries the next node's replica instead,
+//which shows the cost of remote memory (on one node both are the same).
+//Returns the aggregate queries per second in wall-clock time, or 0 on
+//error. If pThreadRates is not NULL it receives each thread's rate,
+//ordered by node; it needs room for nThreadsPerNode * nNodes entries.
+uint64_t XORSATFilterNUMAQueryRate(const XORSATFilterNUMAQuerier *xsfnq, uint32_t nThreadsPerNode, uint8_t bRemote, uint32_t *pThreadRates) {
+  uint32_t i, j, t, nThreads = 0;
+
+  if(nThreadsPerNode == 0) return 0;
+
+  size_t nMaxThreads = (size_t) xsfnq->nNodes * nThreadsPerNode;
+  cpu_set_t *pNodeCPUs = (cpu_set_t *)malloc(xsfnq->nNodes * sizeof(cpu_set_t));
+  const XORSATFilterQuerier **ppQueriers = (const XORSATFilterQuerier **)malloc(nMaxThreads * sizeof(XORSATFilterQuerier *));
+  const cpu_set_t **ppCPUs = (const cpu_set_t **)malloc(nMaxThreads * sizeof(cpu_set_t *));
+  if(pNodeCPUs == NULL || ppQueriers == NULL || ppCPUs == NULL) {
+    free(pNodeCPUs);
+    free(ppQueriers);
+    free(ppCPUs);
+    return 0;
+  }
+
+  for(i = 0; i < xsfnq->nNodes; i++) {
+    if(xsfnq->ppReplicas[i] == NULL) continue;
+    XORSATFilterNUMANodeCPUs(xsfnq, i, &pNodeCPUs[i]);
+
+    //Next node that has a replica
+    uint32_t nTarget = i;
+    if(bRemote) {
+      for(j = 1; j <= xsfnq->nNodes; j++) {
+	nTarget = (i + j) % xsfnq->nNodes;
+	if(xsfnq->ppReplicas[nTarget] != NULL) break;
+      }
+    }
+
+    for(t = 0; t < nThreadsPerNode; t++) {
+      ppQueriers[nThreads] = xsfnq->ppReplicas[nTarget];
+      ppCPUs[nThreads] = &pNodeCPUs[i];
+      nThreads++;
+    }
+  }
+
+  uint64_t nRate = XORSATFilterQueryRateThreads(ppQueriers, ppCPUs, nThreads, pThreadRates);
+
+  free(ppCPUs);
+  free(ppQueriers);
+  free(pNodeCPUs);
+
+  return nRate;
+}
@@ -0,0 +1,206 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#include "xorsat_filter.h"
+
+//Working state of XORSATFilterFindPeeledSolutions, nRows elements and
+//nVariables variables. The arrays are buffers of the solve's scratch.
+typedef struct XORSATFilterPeeling {
+  uint32_t *pLits;        //nLitsPerRow per element, repeated literals cancelled
+  uint8_t *pNumLits;      //Literals left in each element's row
+  uint32_t *pRowBits;     //Solution bits of each element's row
+  uint8_t *pPeeled;       //1 once an element's row is peeled (or found empty)
+  uint32_t *pDegrees;     //Unpeeled rows each variable appears in
+  uint32_t *pRowXors;     //XOR of the indices of those rows
+  uint32_t *pStack;       //Variables left with a single row
+  uint32_t *pOrderRows;   //Peeled rows, in the order they were peeled
+  uint32_t *pOrderVars;   //And the variable each was peeled from
+  uint32_t *pColumns;     //Column of each variable of the core
+  uint32_t *pCoreRows;    //Rows of the core
+  uint64_t *pSolutions;   //nRHSWords per variable
+} XORSATFilterPeeling;
+
+//Returns 0 on success and 1 if the arrays couldn't be allocated
+static
+uint8_t XORSATFilterPeelingAlloc(XORSATFilterPeeling *pPeeling, XORSATFilterScratch *pScratch, uint32_t nRows, uint32_t nVariables, uint8_t nLitsPerRow, uint32_t nRHSWords) {
+  pPeeling->pLits = (uint32_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_LITS, ((size_t) nRows * nLitsPerRow + 1) * sizeof(uint32_t));
+  pPeeling->pNumLits = (uint8_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_NUM_LITS, nRows + 1);
+  pPeeling->pRowBits = (uint32_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_ROW_BITS, (nRows + 1) * sizeof(uint32_t));
+  pPeeling->pPeeled = (uint8_t *)XORSATFilterScratchZeroed(pScratch, XORSATFILTER_SCRATCH_PEELED, nRows + 1);
+  pPeeling->pDegrees = (uint32_t *)XORSATFilterScratchZeroed(pScratch, XORSATFILTER_SCRATCH_DEGREES, nVariables * sizeof(uint32_t));
+  pPeeling->pRowXors = (uint32_t *)XORSATFilterScratchZeroed(pScratch, XORSATFILTER_SCRATCH_ROW_XORS, nVariables * sizeof(uint32_t));
+  pPeeling->pStack = (uint32_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_STACK, nVariables * sizeof(uint32_t));
+  pPeeling->pOrderRows = (uint32_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_ORDER_ROWS, (nRows + 1) * sizeof(uint32_t));
+  pPeeling->pOrderVars = (uint32_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_ORDER_VARS, (nRows + 1) * sizeof(uint32_t));
+  pPeeling->pColumns = (uint32_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_COLUMNS, nVariables * sizeof(uint32_t));
+  pPeeling->pCoreRows = (uint32_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_CORE_ROWS, (nRows + 1) * sizeof(uint32_t));
+  pPeeling->pSolutions = (uint64_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_SOLUTIONS, (size_t) nVariables * nRHSWords * sizeof(uint64_t));
+  if(pPeeling->pLits == NULL || pPeeling->pNumLits == NULL || pPeeling->pRowBits == NULL ||
+     pPeeling->pPeeled == NULL || pPeeling->pDegrees == NULL || pPeeling->pRowXors == NULL ||
+     pPeeling->pStack == NULL || pPeeling->pOrderRows == NULL || pPeeling->pOrderVars == NULL ||
+     pPeeling->pColumns == NULL || pPeeling->pCoreRows == NULL || pPeeling->pSolutions == NULL) {
+    return 1;
+  }
+  return 0;
+}
+
+//Solves the 2-core of a peeled block with IMMIR and writes its
+//variables' solutions to pPeeling->pSolutions. Returns as
+//XORSATFilterFindPeeledSolutions does.
+static
+uint8_t XORSATFilterSolvePeelingCore(XORSATFilterBlock *pBlock, XORSATFilterPeeling *pPeeling, uint32_t nCoreRows, uint32_t nRHSWords, XORSATFilterScratch *pScratch) {
+  uint32_t i, j;
+  uint32_t nColumns = 0;
+
+  //Variables still in unpeeled rows are the core's columns
+  for(i = 0; i < pBlock->nVariables; i++) {
+    if(pPeeling->pDegrees[i] != 0) pPeeling->pColumns[nColumns++] = i;
+  }
+  for(i = 0; i < nColumns; i++) {
+    pPeeling->pDegrees[pPeeling->pColumns[i]] = i; //Degrees are no longer needed
+  }
+  for(i = 0; i < nCoreRows; i++) {
+    uint32_t *pRow = pPeeling->pLits + ((size_t) pPeeling->pCoreRows[i] * pBlock->nLitsPerRow);
+    for(j = 0; j < pPeeling->pNumLits[pPeeling->pCoreRows[i]]; j++) {
+      pRow[j] = pPeeling->pDegrees[pRow[j]];
+    }
+  }
+
+  gf2_t *pMatrix = XORSATFilterBuildIMMIRMatrix_Core(pBlock, pPeeling->pCoreRows, nCoreRows, nColumns, pPeeling->pLits, pPeeling->pNumLits, pPeeling->pRowBits, pScratch);
+  uint64_t *pCoreSolutions = (uint64_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_CORE_SOLUTIONS, ((size_t) nColumns * nRHSWords) * sizeof(uint64_t));
+  if(pMatrix == NULL || pCoreSolutions == NULL) return 2;
+
+  uint8_t ret = XORSATFilterFindIMMIRSolutions(pMatrix, pCoreSolutions, nRHSWords, &pBlock->nRandomState);
+
+  for(i = 0; i < nColumns; i++) {
+    memcpy(pPeeling->pSolutions + ((size_t) pPeeling->pColumns[i] * nRHSWords), pCoreSolutions + ((size_t) i * nRHSWords), nRHSWords * sizeof(uint64_t));
+  }
+
+  return ret;
+}
+
+//Solves a block of WRS rows (nLitsPerRow >= 3) by peeling before
+//elimination. A variable that appears in only one row can always be
+//chosen to satisfy that row once the row's other variables are known,
+//so the row is set aside and the variable's other appearances are
+//forgotten, which may leave further variables in only one row. What
+//cannot be peeled this way is the 2-core of the block's hypergraph; it
+//alone is built into an IMMIR matrix and solved with gf2_semi_ech.
+//Peeled rows are then solved in the reverse of the order they were
+//peeled, each fixing its one variable. Peeling takes time linear in
+//the size of the block, so the cost of elimination falls with the size
+//of the core. Below the peeling threshold (about 0.77 rows per variable
+//for 4 literals, 0.70 for 5, 0.64 for 6) the core is nearly always
+//empty. Near the satisfiability threshold, where the built-in
+//parameters put blocks, most rows are in the core.
+//
+//Fills pBlock->pSolutionsCompressed, nRHSBits per variable. Returns 1
+//on success, 0 if the rows are unsatisfiable (the block needs more
+//variables) and 2 if memory couldn't be allocated. Works in pScratch.
+uint8_t XORSATFilterFindPeeledSolutions(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch) {
+  size_t i;
+  uint32_t j, k;
+  uint32_t nVariables = pBlock->nVariables;
+  uint32_t nRows = (uint32_t) pBlock->pHashes.nLength;
+  uint8_t nLitsPerRow = pBlock->nLitsPerRow;
+  uint32_t nRHSBits = pBlock->nSolutions + (pBlock->nMetaDataBytes * 8);
+  uint32_t nRHSWords = (nRHSBits + 63) >> 6;
+  uint32_t nSlice = (pBlock->nFormat & XORSATFILTER_FORMAT_WRS_WINDOW) ? XORSATFilterWRSWindowSlice(nRHSBits, nLitsPerRow) : 0;
+  uint32_t pRow[nLitsPerRow + 1];
+  uint64_t pRowRHS[nRHSWords];
+  uint32_t nStack = 0, nPeeled = 0, nCoreRows = 0;
+  uint8_t ret = 1;
+
+  XORSATFilterPeeling sPeeling;
+  if(XORSATFilterPeelingAlloc(&sPeeling, pScratch, nRows, nVariables, nLitsPerRow, nRHSWords) != 0) {
+    return 2;
+  }
+
+  //Generate rows, cancelling literals that appear an even number of times
+  for(i = 0; i < nRows; i++) {
+    uint32_t *pLits = sPeeling.pLits + (i * nLitsPerRow);
+    uint8_t nLits = 0;
+    XORSATFilterGenerateRowFromHash_WRS(pBlock->pHashes.pList[i], nVariables, pRow, nLitsPerRow, pBlock->nFormat, nSlice);
+    for(j = 0; j < nLitsPerRow; j++) {
+      for(k = 0; k < nLits && pLits[k] != pRow[j]; k++) ;
+      if(k < nLits) pLits[k] = pLits[--nLits];
+      else pLits[nLits++] = pRow[j];
+    }
+    sPeeling.pNumLits[i] = nLits;
+    sPeeling.pRowBits[i] = pRow[nLitsPerRow];
+
+    if(nLits == 0) {
+      //An empty row is satisfied only if its right hand side is zero
+      XORSATFilterBlockRowRHS(pBlock, i, pRow[nLitsPerRow], pRowRHS, nRHSWords);
+      for(k = 0; k < nRHSWords; k++) {
+        if(pRowRHS[k] != 0) return 0; //UNSAT
+      }
+      sPeeling.pPeeled[i] = 1;
+      continue;
+    }
+
+    for(j = 0; j < nLits; j++) {
+      sPeeling.pDegrees[pLits[j]]++;
+      sPeeling.pRowXors[pLits[j]] ^= (uint32_t) i;
+    }
+  }
+
+  //Peel
+  for(j = 0; j < nVariables; j++) {
+    if(sPeeling.pDegrees[j] == 1) sPeeling.pStack[nStack++] = j;
+  }
+  while(nStack != 0) {
+    uint32_t nVariable = sPeeling.pStack[--nStack];
+    if(sPeeling.pDegrees[nVariable] != 1) continue; //Its row was peeled from another variable
+    uint32_t nRow = sPeeling.pRowXors[nVariable];
+    const uint32_t *pLits = sPeeling.pLits + ((size_t) nRow * nLitsPerRow);
+
+    sPeeling.pPeeled[nRow] = 1;
+    sPeeling.pOrderRows[nPeeled] = nRow;
+    sPeeling.pOrderVars[nPeeled] = nVariable;
+    nPeeled++;
+
+    for(j = 0; j < sPeeling.pNumLits[nRow]; j++) {
+      uint32_t nOther = pLits[j];
+      sPeeling.pRowXors[nOther] ^= nRow;
+      if(--sPeeling.pDegrees[nOther] == 1) sPeeling.pStack[nStack++] = nOther;
+    }
+  }
+
+  //Variables in neither the core nor a peeled row's pivot are free
+  for(i = 0; i < (size_t) nVariables * nRHSWords; i++) {
+    sPeeling.pSolutions[i] = XORSATFilterRandom(&pBlock->nRandomState);
+  }
+
+  for(i = 0; i < nRows; i++) {
+    if(!sPeeling.pPeeled[i]) sPeeling.pCoreRows[nCoreRows++] = (uint32_t) i;
+  }
+  if(nCoreRows != 0) {
+    ret = XORSATFilterSolvePeelingCore(pBlock, &sPeeling, nCoreRows, nRHSWords, pScratch);
+    if(ret != 1) return ret;
+  }
+
+  //Back substitution, last peeled row first
+  while(nPeeled-- > 0) {
+    uint32_t nRow = sPeeling.pOrderRows[nPeeled];
+    uint32_t nVariable = sPeeling.pOrderVars[nPeeled];
+    const uint32_t *pLits = sPeeling.pLits + ((size_t) nRow * nLitsPerRow);
+    uint64_t *pSolution = sPeeling.pSolutions + ((size_t) nVariable * nRHSWords);
+
+    XORSATFilterBlockRowRHS(pBlock, nRow, sPeeling.pRowBits[nRow], pSolution, nRHSWords);
+    for(j = 0; j < sPeeling.pNumLits[nRow]; j++) {
+      if(pLits[j] == nVariable) continue;
+      const uint64_t *pOther = sPeeling.pSolutions + ((size_t) pLits[j] * nRHSWords);
+      for(k = 0; k < nRHSWords; k++) {
+        pSolution[k] ^= pOther[k];
+      }
+    }
+  }
+
+  if(XORSATFilterBlockCompressSolutions(pBlock, sPeeling.pSolutions, nRHSWords) != 0) ret = 2;
+
+  return ret;
+}
@@ -4,31 +4,111 @@
 
 **************************************************************************************/
 
+#define _GNU_SOURCE //pthread_setaffinity_np
+#include <sched.h>
+
 #include "xorsat_filter.h"
 
-XORSATFilterQuerier *XORSATFilterQuerierAlloc(uint32_t nFilterWords, uint32_t nBlocks, uint16_t nAvgVarsPerBlock, uint8_t nSolutions, size_t nMetaDataBytes, uint8_t nLitsPerRow) {
+static void XORSATFilterQuerierSelectKernels(XORSATFilterQuerier *xsfq);
+
+//Precomputes values the query functions would otherwise derive on every call.
+void XORSATFilterQuerierInitConstants(XORSATFilterQuerier *xsfq) {
+  xsfq->nRHSBits = ((uint32_t) xsfq->nSolutions) + (xsfq->nMetaDataBytes*8);
+  //Lemire's fastdiv: n / d == (M * n) >> 64 for 32-bit n, where M = floor((2^64-1)/d) + 1.
+  //M overflows when d is 1 (see XORSATFilterDivideByRHSBits).
+  xsfq->nRHSBitsReciprocal = (xsfq->nRHSBits > 1) ? ((~(uint64_t)0) / xsfq->nRHSBits) + 1 : 0;
+  //Only windowed WRS rows use the slice; other rows may have no RHS
+  //bits or literals to divide by
+  xsfq->nWRSWindowSlice = 0;
+  if((xsfq->nFormat & XORSATFILTER_FORMAT_WRS_WINDOW) && xsfq->nLitsPerRow >= 3 && xsfq->nLitsPerRow != XORSATFILTER_RIBBON && xsfq->nRHSBits > 0) {
+    xsfq->nWRSWindowSlice = XORSATFilterWRSWindowSlice(xsfq->nRHSBits, xsfq->nLitsPerRow);
+  }
+  XORSATFilterQuerierSelectKernels(xsfq);
+}
+
+static inline
+uint32_t XORSATFilterDivideByRHSBits(const XORSATFilterQuerier *xsfq, uint32_t n) {
+  if(xsfq->nRHSBits == 1) return n;
+  return (uint32_t) (((__uint128_t) xsfq->nRHSBitsReciprocal * n) >> 64);
+}
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+//Maps nBytes of zeroed, writable anonymous memory for a filter.
+//nHugePages is 0, XORSATFILTER_LOAD_COPY_2MB or XORSATFILTER_LOAD_COPY_1GB.
+//If no huge pages of that size are reserved, transparent huge pages are
+//requested instead. *pMappedBytes is set to the length to munmap.
+uint64_t *XORSATFilterMapAnonymous(size_t nBytes, uint32_t nHugePages, size_t *pMappedBytes) {
+  void *pMap = MAP_FAILED;
+
+  if(nHugePages != 0) {
+    size_t nPageBytes = (nHugePages & XORSATFILTER_LOAD_COPY_1GB) ? ((size_t) 1 << 30) : ((size_t) 1 << 21);
+    size_t nMappedBytes = (nBytes + nPageBytes - 1) & ~(nPageBytes - 1);
+    int nHugeFlags = (nHugePages & XORSATFILTER_LOAD_COPY_1GB) ? MAP_HUGE_1GB : MAP_HUGE_2MB;
+    pMap = mmap(0, nMappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | nHugeFlags, -1, 0);
+    if(pMap != MAP_FAILED) {
+      *pMappedBytes = nMappedBytes;
+      return (uint64_t *) pMap;
+    }
+    fprintf(stderr, "Warning: no %s huge pages available, using transparent huge pages\n", (nHugePages & XORSATFILTER_LOAD_COPY_1GB) ? "1 GB" : "2 MB");
+  }
+
+  pMap = mmap(0, nBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(pMap == MAP_FAILED) return NULL;
+  if(nHugePages != 0) madvise(pMap, nBytes, MADV_HUGEPAGE);
+
+  *pMappedBytes = nBytes;
+  return (uint64_t *) pMap;
+}
+
+XORSATFilterQuerier *XORSATFilterQuerierAlloc(uint64_t nFilterWords, uint32_t nBlocks, uint16_t nAvgVarsPerBlock, uint8_t nSolutions, size_t nMetaDataBytes, uint8_t nLitsPerRow, uint8_t nFormat, uint8_t bHugePages) {
   XORSATFilterQuerier *xsfq = (XORSATFilterQuerier *)malloc(1 * sizeof(XORSATFilterQuerier));
   if(xsfq == NULL) return NULL;
   
-  xsfq->pFilter = (uint64_t *)malloc(nFilterWords * sizeof(uint64_t));
-  if(xsfq->pFilter == NULL) {
-    free(xsfq);
-    return NULL;
-  }
+  //One extra word so vectorized queries may read slightly past the last block
+  if(bHugePages) {
+    //Filter and offsets share the mapping, as they do for deserialized filters
+    xsfq->pFilter = XORSATFilterMapAnonymous(((nFilterWords + 1) * sizeof(uint64_t)) + (((uint64_t) nBlocks+1) * sizeof(int16_t)), XORSATFILTER_LOAD_COPY_2MB, &xsfq->nMappedBytes);
+    if(xsfq->pFilter == NULL) {
+      free(xsfq);
+      return NULL;
+    }
+    xsfq->pOffsets = (int16_t *) (xsfq->pFilter + nFilterWords + 1);
+    xsfq->bMMAP = 1;
+  } else {
+    xsfq->pFilter = (uint64_t *)malloc((nFilterWords + 1) * sizeof(uint64_t));
+    if(xsfq->pFilter == NULL) {
+      free(xsfq);
+      return NULL;
+    }
 
-  xsfq->pOffsets = (int16_t *)malloc((nBlocks+1) * sizeof(int16_t));
-  if(xsfq->pOffsets == NULL) {
-    free(xsfq->pFilter);
-    free(xsfq);
-    return NULL;
+    xsfq->pOffsets = (int16_t *)malloc((nBlocks+1) * sizeof(int16_t));
+    if(xsfq->pOffsets == NULL) {
+      free(xsfq->pFilter);
+      free(xsfq);
+      return NULL;
+    }
+    xsfq->nMappedBytes = 0;
+    xsfq->bMMAP = 0;
   }
 
+  xsfq->pFilter[nFilterWords] = 0;
+
   xsfq->nBlocks = nBlocks;
   xsfq->nAvgVarsPerBlock = nAvgVarsPerBlock;
   xsfq->nSolutions = nSolutions;
   xsfq->nMetaDataBytes = nMetaDataBytes;
   xsfq->nLitsPerRow = nLitsPerRow;
-  xsfq->bMMAP = 0;
+  xsfq->nFormat = nFormat;
+  XORSATFilterQuerierInitConstants(xsfq);
 
   return xsfq;
 }
@@ -36,8 +116,7 @@ XORSATFilterQuerier *XORSATFilterQuerierAlloc(uint32_t nFilterWords, uint32_t nB
 void XORSATFilterQuerierFree(XORSATFilterQuerier *xsfq) {
   if(xsfq->bMMAP) {
     if(xsfq->pFilter != NULL) {
-      uint64_t nFilterWords = XORSATFilterGetBlockIndex(xsfq, xsfq->nBlocks);
-      munmap(xsfq->pFilter, (nFilterWords * sizeof(uint64_t)) + (((uint64_t) xsfq->nBlocks+1) * sizeof(int16_t)));
+      munmap(xsfq->pFilter, xsfq->nMappedBytes);
     }
     xsfq->bMMAP = 0;
   } else {
@@ -63,73 +142,172 @@ uint8_t XORSATFilterStoreBlockIndex(XORSATFilterQuerier *xsfq, uint32_t nBlock,
 }
 
 inline
-uint64_t XORSATFilterGetBlockIndex(XORSATFilterQuerier *xsfq, uint32_t nBlock) {
+uint64_t XORSATFilterGetBlockIndex(const XORSATFilterQuerier *xsfq, uint32_t nBlock) {
   int64_t nDiff = (int64_t) xsfq->pOffsets[nBlock];
   int64_t nExpectedIndex = ((int64_t) xsfq->nAvgVarsPerBlock) * (int64_t) nBlock;
   //Round up to next multiple of 64
   nExpectedIndex = ((nExpectedIndex-1) | (int64_t) 0x3f) + (int64_t) 1;
-  return ((nExpectedIndex - (nDiff * 64)) >> 6) * (uint64_t) (xsfq->nSolutions + (xsfq->nMetaDataBytes*8));
+  return ((nExpectedIndex - (nDiff * 64)) >> 6) * (uint64_t) xsfq->nRHSBits;
 }
 
-void XORSATFilterStoreBlockSolution_WRS(XORSATFilterQuerier *xsfq, XORSATFilterBlock *pBlock, uint32_t nBlockIndex) {
-  uint32_t i, j;
-  uint32_t nRHSBits = ((uint32_t) xsfq->nSolutions) + (xsfq->nMetaDataBytes*8);
-  uint64_t nWord = 0;
-  uint64_t nBit = 0;
-  uint64_t nBlockStart = XORSATFilterGetBlockIndex(xsfq, nBlockIndex);
-  uint32_t nBlockSize  = XORSATFilterGetBlockIndex(xsfq, nBlockIndex+1) - nBlockStart;
-  uint32_t nVariables = (nBlockSize / nRHSBits) << 6;
+//Transposes a 64x64 bit matrix in place: bit c of word r moves to bit
+//r of word c. Six rounds swap ever smaller off-diagonal quarters.
+static
+void XORSATFilterTranspose64(uint64_t *pMatrix) {
+  uint32_t j, k;
+  uint64_t m = 0x00000000ffffffff;
+  for(j = 32; j != 0; j >>= 1, m ^= m << j) {
+    for(k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+      uint64_t t = ((pMatrix[k] >> j) ^ pMatrix[k | j]) & m;
+      pMatrix[k] ^= t << j;
+      pMatrix[k | j] ^= t;
+    }
+  }
+}
+
+//Gathers the solution planes of variables 64g to 64g+63 of a block:
+//word j of pPlanes holds right hand side bit j of those 64 variables.
+//Each 64 variables' next 64 bits are read as whole words and turned
+//into planes by one 64x64 transpose.
+static
+void XORSATFilterBlockSolutionPlanes(const XORSATFilterBlock *pBlock, uint32_t nRHSBits, uint32_t g, uint64_t *pPlanes) {
+  uint32_t i, w;
+  uint64_t pWords[64];
+
+  for(w = 0; w < nRHSBits; w += 64) {
+    uint32_t nBits = ((nRHSBits - w) < 64) ? (nRHSBits - w) : 64;
+    uint64_t nMask = (nBits < 64) ? ((((uint64_t) 1) << nBits) - 1) : ~(uint64_t) 0;
+    for(i = 0; i < 64; i++) {
+      size_t nBit = ((((size_t) g << 6) + i) * nRHSBits) + w;
+      uint64_t nWord = pBlock->pSolutionsCompressed[nBit >> 6] >> (nBit & 0x3f);
+      if((nBit & 0x3f) != 0) { //X86 shifts are mod 64
+        nWord |= pBlock->pSolutionsCompressed[(nBit >> 6) + 1] << (64 - (nBit & 0x3f));
+      }
+      pWords[i] = nWord & nMask;
+    }
+    XORSATFilterTranspose64(pWords);
+    memcpy(pPlanes + w, pWords, nBits * sizeof(uint64_t));
+  }
+}
+
+//A WRS block is stored exactly as it is packed in pSolutionsCompressed.
+static
+void XORSATFilterStoreBlockSolution_WRS(XORSATFilterBlock *pBlock, uint64_t *pOut) {
+  memcpy(pOut, pBlock->pSolutionsCompressed, XORSATFilterBlockFilterWords(pBlock) * sizeof(uint64_t));
+}
+
+//Plane j (right hand side bit j of every variable) is stored whole, one
+//after another. With XORSATFILTER_FORMAT_DW_INTERLEAVED, each run of 16
+//variables instead stores 16 bits of plane 0, then of plane 1, and so on.
+static
+void XORSATFilterStoreBlockSolution_DW(XORSATFilterBlock *pBlock, uint64_t *pOut) {
+  uint32_t g, j, q;
+  uint32_t nRHSBits = ((uint32_t) pBlock->nSolutions) + (pBlock->nMetaDataBytes*8);
+  uint32_t nWordsPerPlane = pBlock->nVariables >> 6;
+  uint64_t pPlanes[nRHSBits];
   
-  if(pBlock->bBadBlock) {
-    for(i = 0; i < nBlockSize; i++) {
-      xsfq->pFilter[nBlockStart++] = 0;
+  if(pBlock->nFormat & XORSATFILTER_FORMAT_DW_INTERLEAVED) {
+    //Every 64 variables fill nRHSBits words, four runs of 16
+    for(g = 0; g < nWordsPerPlane; g++) {
+      uint64_t *pGroup = pOut + ((uint64_t) g * nRHSBits);
+      XORSATFilterBlockSolutionPlanes(pBlock, nRHSBits, g, pPlanes);
+      memset(pGroup, 0, nRHSBits * sizeof(uint64_t));
+      for(q = 0; q < 4; q++) {
+        for(j = 0; j < nRHSBits; j++) {
+          uint32_t nBit = ((q * nRHSBits) + j) << 4;
+          pGroup[nBit >> 6] |= ((pPlanes[j] >> (q << 4)) & 0xffff) << (nBit & 0x3f);
+        }
+      }
     }
   } else {
-    for(i = 0; i < nVariables; i++) {
+    for(g = 0; g < nWordsPerPlane; g++) {
+      XORSATFilterBlockSolutionPlanes(pBlock, nRHSBits, g, pPlanes);
       for(j = 0; j < nRHSBits; j++) {
-	nWord >>= 1;
-	nWord |= bitvector_t_getBit(&pBlock->pSolutionsCompressed, (i*nRHSBits) + j) ? 0x8000000000000000 : 0x0;
-	nBit++;
-	if((nBit & 0x3f) == 0) {
-	  xsfq->pFilter[nBlockStart++] = nWord;
-	  nWord = 0;
-	}
+        pOut[((uint64_t) j * nWordsPerPlane) + g] = pPlanes[j];
       }
     }
   }
-  uint64_t_list_free(&pBlock->pSolutionsCompressed.bits, NULL);
 }
 
-void XORSATFilterStoreBlockSolution_DW(XORSATFilterQuerier *xsfq, XORSATFilterBlock *pBlock, uint32_t nBlockIndex) {
-  uint32_t i, j;
-  uint32_t nRHSBits = ((uint32_t) xsfq->nSolutions) + (xsfq->nMetaDataBytes*8);
-  uint64_t nWord = 0;
-  uint64_t nBit = 0;
-  uint64_t nBlockStart = XORSATFilterGetBlockIndex(xsfq, nBlockIndex);
-  uint32_t nBlockSize  = XORSATFilterGetBlockIndex(xsfq, nBlockIndex+1) - nBlockStart;
-  uint32_t nVariables = (nBlockSize / nRHSBits) << 6;
-  
+//Word k of the solution's plane j (variables 64k to 64k+63 of right hand
+//side bit j) is stored at word k*nRHSBits + j of the block, so the
+//planes of a ribbon row's band lie together.
+static
+void XORSATFilterStoreBlockSolution_Ribbon(XORSATFilterBlock *pBlock, uint64_t *pOut) {
+  uint32_t k;
+  uint32_t nRHSBits = ((uint32_t) pBlock->nSolutions) + (pBlock->nMetaDataBytes*8);
+
+  for(k = 0; k < (pBlock->nVariables >> 6); k++) {
+    XORSATFilterBlockSolutionPlanes(pBlock, nRHSBits, k, pOut + ((uint64_t) k * nRHSBits));
+  }
+}
+
+//Writes a solved block to pOut, XORSATFilterBlockFilterWords(pBlock)
+//words, as it is laid out in the filter, and frees its solution. The
+//words of a block that failed to build are zeroed.
+void XORSATFilterStoreBlockSolution(XORSATFilterBlock *pBlock, uint64_t *pOut) {
   if(pBlock->bBadBlock) {
-    for(i = 0; i < nBlockSize; i++) {
-      xsfq->pFilter[nBlockStart++] = 0;
-    }
+    memset(pOut, 0, XORSATFilterBlockFilterWords(pBlock) * sizeof(uint64_t));
+  } else if(pBlock->nLitsPerRow == XORSATFILTER_RIBBON) {
+    XORSATFilterStoreBlockSolution_Ribbon(pBlock, pOut);
+  } else if(pBlock->nLitsPerRow < 3) {
+    XORSATFilterStoreBlockSolution_DW(pBlock, pOut);
   } else {
-    for(j = 0; j < nRHSBits; j++) {
-      for(i = 0; i < nVariables; i++) {
-	nWord >>= 1;
-	nWord |= bitvector_t_getBit(&pBlock->pSolutionsCompressed, (i*nRHSBits) + j) ? 0x8000000000000000 : 0x0;
-	nBit++;
-	if((nBit & 0x3f) == 0) {
-	  xsfq->pFilter[nBlockStart++] = nWord;
-	  nWord = 0;
-	}
-      }
+    XORSATFilterStoreBlockSolution_WRS(pBlock, pOut);
+  }
+  free(pBlock->pSolutionsCompressed);
+  pBlock->pSolutionsCompressed = NULL;
+}
+
+//Stores the solutions of blocks nFirst to nLast-1, one after another
+//from pOut. Every block's place is already known, so chunks store in
+//parallel.
+typedef struct XORSATFilterStoreChunk {
+  XORSATFilterBlock *pBlocks;
+  uint64_t *pOut;
+  uint32_t nFirst;
+  uint32_t nLast;
+} XORSATFilterStoreChunk;
+
+static
+void XORSATFilterStoreBlockSolutions(XORSATFilterStoreChunk *pChunk) {
+  uint32_t i;
+  uint64_t *pOut = pChunk->pOut;
+  for(i = pChunk->nFirst; i < pChunk->nLast; i++) {
+    XORSATFilterStoreBlockSolution(&pChunk->pBlocks[i], pOut);
+    pOut += XORSATFilterBlockFilterWords(&pChunk->pBlocks[i]);
+  }
+}
+
+//Stores nBlocks solved blocks one after another from pFilter, a few
+//chunks of blocks per thread of thpool.
+void XORSATFilterStoreBlocks(XORSATFilterBlock *pBlocks, uint32_t nBlocks, uint64_t *pFilter, threadpool thpool, uint32_t nThreads) {
+  uint32_t i, j;
+  uint32_t nChunks = ((nThreads > 0) ? nThreads : 1) * 4;
+  if(nChunks > nBlocks) nChunks = nBlocks;
+  XORSATFilterStoreChunk *pChunks = (XORSATFilterStoreChunk *)malloc(nChunks * sizeof(XORSATFilterStoreChunk));
+  if(pChunks == NULL) {
+    XORSATFilterStoreChunk sChunk = { pBlocks, pFilter, 0, nBlocks };
+    XORSATFilterStoreBlockSolutions(&sChunk);
+    return;
+  }
+
+  uint64_t *pOut = pFilter;
+  for(i = 0; i < nChunks; i++) {
+    pChunks[i].pBlocks = pBlocks;
+    pChunks[i].pOut = pOut;
+    pChunks[i].nFirst = (uint32_t) (((uint64_t) nBlocks * i) / nChunks);
+    pChunks[i].nLast = (uint32_t) (((uint64_t) nBlocks * (i+1)) / nChunks);
+    for(j = pChunks[i].nFirst; j < pChunks[i].nLast; j++) {
+      pOut += XORSATFilterBlockFilterWords(&pBlocks[j]);
     }
+    thpool_add_work(thpool, (void*)XORSATFilterStoreBlockSolutions, &pChunks[i]);
   }
-  uint64_t_list_free(&pBlock->pSolutionsCompressed.bits, NULL);
+  thpool_wait(thpool);
+  free(pChunks);
 }
 
-XORSATFilterQuerier *XORSATFilterCreateQuerierFromBuilder(XORSATFilterBuilder *xsfb) {
+XORSATFilterQuerier *XORSATFilterCreateQuerierFromBuilder(XORSATFilterBuilder *xsfb, uint8_t bHugePages, threadpool thpool, uint32_t nThreads) {
   uint32_t i;
   uint32_t nBlocks = xsfb->pBlocks.nLength;
   uint64_t nRHSBits = ((uint32_t) xsfb->pBlocks.pList[0].nSolutions) + (xsfb->nMetaDataBytes*8);
@@ -143,9 +321,9 @@ XORSATFilterQuerier *XORSATFilterCreateQuerierFromBuilder(XORSATFilterBuilder *x
   }
   nAvgVarsPerBlock /= (uint64_t) xsfb->pBlocks.nLength;
  
-  uint32_t nFilterWords = (uint32_t) (nFilterBits >> 6);
+  uint64_t nFilterWords = nFilterBits >> 6;
   
-  XORSATFilterQuerier *xsfq = XORSATFilterQuerierAlloc(nFilterWords, nBlocks, nAvgVarsPerBlock, xsfb->pBlocks.pList[0].nSolutions, xsfb->nMetaDataBytes, xsfb->pBlocks.pList[0].nLitsPerRow);
+  XORSATFilterQuerier *xsfq = XORSATFilterQuerierAlloc(nFilterWords, nBlocks, nAvgVarsPerBlock, xsfb->pBlocks.pList[0].nSolutions, xsfb->nMetaDataBytes, xsfb->pBlocks.pList[0].nLitsPerRow, xsfb->pBlocks.pList[0].nFormat, bHugePages);
   if(xsfq == NULL) return NULL;
   
   uint64_t nBlockIndex = 0;
@@ -157,37 +335,39 @@ XORSATFilterQuerier *XORSATFilterCreateQuerierFromBuilder(XORSATFilterBuilder *x
   XORSATFilterStoreBlockIndex(xsfq, i, nBlockIndex);
   
   //Store transposed solution
-  for(i = 0; i < nBlocks; i++) {
-    if(xsfq->nLitsPerRow < 3) {
-      XORSATFilterStoreBlockSolution_DW(xsfq, &xsfb->pBlocks.pList[i], i);
-    } else {
-      XORSATFilterStoreBlockSolution_WRS(xsfq, &xsfb->pBlocks.pList[i], i);
-    }
-  }
+  XORSATFilterStoreBlocks(xsfb->pBlocks.pList, nBlocks, xsfq->pFilter, thpool, nThreads);
 
   return xsfq;
 }
 
-uint8_t XORSATFilterQueryBlock_WRS(XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, uint64_t *pFilterBlock) {
-  uint32_t i, j;
-  uint32_t pRow[xsfq->nLitsPerRow + 1];
+/*************************************************************************************
 
-  //Generate row
-  XORSATFilterGenerateRowFromHash_WRS(pHash, nVariables, pRow, xsfq->nLitsPerRow);
+  Block query kernels. Each is written once as an always-inlined body
+  taking nLitsPerRow, nSolutions and nMetaDataBytes as arguments. The
+  generic kernels pass the querier's values; the specialized kernels
+  below pass constants, so the compiler unrolls the loops, sizes the
+  row and metadata arrays statically and folds the shifts and masks.
+  XORSATFilterQuerierInitConstants chooses between them once.
+
+**************************************************************************************/
+
+//Checks a WRS row against the solution bits of its variables
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterCheckRow_WRS(const uint32_t *pRow, const uint64_t *pFilterBlock, uint8_t nLitsPerRow, uint32_t nSolutions, size_t nMetaDataBytes) {
+  uint32_t i, j;
 
   //compare row to pfilterblock
-  uint32_t nSolutions = xsfq->nSolutions;
   if(nSolutions == 0) return 1;
 
-  size_t nMetaDataBits = xsfq->nMetaDataBytes * 8;
+  size_t nMetaDataBits = nMetaDataBytes * 8;
   uint32_t nRHSBits = nSolutions + nMetaDataBits;
   uint32_t length = (nSolutions+63) >> 6;
   uint64_t passed[length];
   for(i = 0; i < length; i++) {
-    passed[i] = pRow[xsfq->nLitsPerRow]; //For nSolutions <= 32.
+    passed[i] = pRow[nLitsPerRow]; //For nSolutions <= 32.
   }
   
-  for(j = 0; j < xsfq->nLitsPerRow; j++) {
+  for(j = 0; j < nLitsPerRow; j++) {
     uint32_t var = pRow[j];
     uint32_t bit = var * nRHSBits;
     
@@ -217,173 +397,833 @@ uint8_t XORSATFilterQueryBlock_WRS(XORSATFilterQuerier *xsfq, uint32_t nVariable
   return 1;
 }
 
-uint8_t *XORSATFilterRetrieveMetadataBlock_WRS(XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, uint64_t *pFilterBlock) {
+//XORs the metadata bits of a WRS row's variables into pMetaData
+static inline __attribute__((always_inline))
+void XORSATFilterExtractMetadata_WRS(const uint32_t *pRow, uint32_t nVariables, const uint64_t *pFilterBlock, uint8_t *pMetaData, uint8_t nLitsPerRow, uint32_t nSolutions, size_t nMetaDataBytes) {
   uint32_t i;
-  uint32_t pRow[xsfq->nLitsPerRow + 1];
-
-  //Generate row
-  XORSATFilterGenerateRowFromHash_WRS(pHash, nVariables, pRow, xsfq->nLitsPerRow);
 
-  //compare row to pfilterblock
-  uint32_t nSolutions = xsfq->nSolutions;
-  size_t nMetaDataBits = xsfq->nMetaDataBytes * 8;
+  size_t nMetaDataBits = nMetaDataBytes * 8;
   uint32_t nRHSBits = nSolutions + nMetaDataBits;
   size_t nLength = ((nVariables * nRHSBits)+63) >> 6;
+  size_t lengthW = (nMetaDataBits+63) >> 6;
 
-  uint64_t *pMetaData = (uint64_t *)calloc((xsfq->nMetaDataBytes >> 2) + 1, sizeof(uint64_t));
+  uint64_t pMetaDataWords[lengthW];
+  memset(pMetaDataWords, 0, lengthW * sizeof(uint64_t));
 
-  for(i = 0; i < xsfq->nLitsPerRow; i++) {
+  for(i = 0; i < nLitsPerRow; i++) {
     uint32_t var = pRow[i];
 
     size_t start = (var * nRHSBits) + nSolutions;
     size_t startW  = start >> 6;
-    size_t lengthW = (nMetaDataBits+63) >> 6;
     size_t j;
     for(j = 0; j < lengthW; j++) {
-      pMetaData[j] ^= pFilterBlock[startW + j] >> (start&0x3f);
+      pMetaDataWords[j] ^= pFilterBlock[startW + j] >> (start&0x3f);
       if((startW + j + 1 < nLength) && ((start&0x3f) != 0)) {
-        pMetaData[j] ^= pFilterBlock[startW + j + 1] << (64 - (start&0x3f));
+        pMetaDataWords[j] ^= pFilterBlock[startW + j + 1] << (64 - (start&0x3f));
       }
     }
   }
 
-  return (uint8_t *)pMetaData;
+  memcpy(pMetaData, pMetaDataWords, nMetaDataBytes);
 }
 
-uint8_t XORSATFilterQueryBlock_DW(XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, uint64_t *pFilterBlock) {
-  uint32_t i;
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterQueryBlockKernel_WRS(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t nLitsPerRow, uint32_t nSolutions, size_t nMetaDataBytes) {
+  uint32_t pRow[nLitsPerRow + 1];
 
-  //compare row to pfilterblock
-  uint32_t nSolutions = xsfq->nSolutions;
-  if(nSolutions == 0) return 1;
+  //Generate row
+  XORSATFilterRowFromHash_WRS(pHash, nVariables, pRow, nLitsPerRow, xsfq->nFormat, xsfq->nWRSWindowSlice);
+
+  return XORSATFilterCheckRow_WRS(pRow, pFilterBlock, nLitsPerRow, nSolutions, nMetaDataBytes);
+}
+
+static inline __attribute__((always_inline))
+void XORSATFilterRetrieveMetadataBlockKernel_WRS(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData, uint8_t nLitsPerRow, uint32_t nSolutions, size_t nMetaDataBytes) {
+  uint32_t pRow[nLitsPerRow + 1];
 
-  size_t nMetaDataBits = xsfq->nMetaDataBytes * 8;
-  uint32_t nRHSBits = nSolutions + nMetaDataBits;
-  
   //Generate row
-  XORSATFilterRow xsfrow = XORSATFilterGenerateRowFromHash_DW(pHash, nVariables);
+  XORSATFilterRowFromHash_WRS(pHash, nVariables, pRow, nLitsPerRow, xsfq->nFormat, xsfq->nWRSWindowSlice);
 
-  uint32_t nPassed = 0;
-  for(i = 0; i < nSolutions; i++) {
-    size_t start1 = (i * nVariables) + (xsfrow.b1 * 16);
-    size_t start1W  = start1 >> 6;
-    uint16_t chunk_1 = (pFilterBlock[start1W] >> (start1 & 0x3f)) & xsfrow.p1;
+  XORSATFilterExtractMetadata_WRS(pRow, nVariables, pFilterBlock, pMetaData, nLitsPerRow, nSolutions, nMetaDataBytes);
+}
+
+//The metadata of a variable directly follows its solution bits, so it
+//is read from the cache lines the check has just loaded.
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterQueryAndRetrieveMetadataBlockKernel_WRS(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData, uint8_t nLitsPerRow, uint32_t nSolutions, size_t nMetaDataBytes) {
+  uint32_t pRow[nLitsPerRow + 1];
+
+  //Generate row
+  XORSATFilterRowFromHash_WRS(pHash, nVariables, pRow, nLitsPerRow, xsfq->nFormat, xsfq->nWRSWindowSlice);
+
+  if(!XORSATFilterCheckRow_WRS(pRow, pFilterBlock, nLitsPerRow, nSolutions, nMetaDataBytes)) return 0;
+
+  XORSATFilterExtractMetadata_WRS(pRow, nVariables, pFilterBlock, pMetaData, nLitsPerRow, nSolutions, nMetaDataBytes);
+  return 1;
+}
+
+//A DW row reads the 16-bit chunk of window b for each solution bit i,
+//found at bit XORSATFilterDWChunkStart() + (i * XORSATFilterDWChunkStride())
+//of the block. Planes are nVariables bits apart; interleaved chunks are adjacent.
+static inline
+size_t XORSATFilterDWChunkStart(const XORSATFilterQuerier *xsfq, uint32_t nRHSBits, uint16_t b) {
+  return (xsfq->nFormat & XORSATFILTER_FORMAT_DW_INTERLEAVED) ? ((size_t) b * nRHSBits) << 4 : ((size_t) b) << 4;
+}
+
+static inline
+uint32_t XORSATFilterDWChunkStride(const XORSATFilterQuerier *xsfq, uint32_t nVariables) {
+  return (xsfq->nFormat & XORSATFILTER_FORMAT_DW_INTERLEAVED) ? 16 : nVariables;
+}
+
+//A DW row and where its two chunks start
+typedef struct XORSATFilterDWRowStart {
+  XORSATFilterRow xsfrow;
+  size_t nStart1;
+  size_t nStart2;
+  uint32_t nStride;
+} XORSATFilterDWRowStart;
+
+static inline __attribute__((always_inline))
+XORSATFilterDWRowStart XORSATFilterDWRowFromHash(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, uint32_t nRHSBits) {
+  XORSATFilterDWRowStart row;
+  row.xsfrow = XORSATFilterRowFromHash_DW(pHash, nVariables, xsfq->nFormat);
+  row.nStart1 = XORSATFilterDWChunkStart(xsfq, nRHSBits, row.xsfrow.b1);
+  row.nStart2 = XORSATFilterDWChunkStart(xsfq, nRHSBits, row.xsfrow.b2);
+  row.nStride = XORSATFilterDWChunkStride(xsfq, nVariables);
+  return row;
+}
+
+//Parity of the row with right hand side bit i
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterDWParity(const XORSATFilterDWRowStart *pRow, const uint64_t *pFilterBlock, uint32_t i) {
+  size_t start1 = (i * pRow->nStride) + pRow->nStart1;
+  size_t start1W  = start1 >> 6;
+  uint16_t chunk_1 = (pFilterBlock[start1W] >> (start1 & 0x3f)) & pRow->xsfrow.p1;
+
+  size_t start2 = (i * pRow->nStride) + pRow->nStart2;
+  size_t start2W  = start2 >> 6;
+  uint16_t chunk_2 = (pFilterBlock[start2W] >> (start2 & 0x3f)) & pRow->xsfrow.p2;
+
+  uint32_t chunk_f = ((uint32_t) chunk_2) ^ (((uint32_t) chunk_1) << 16);
 
-    size_t start2 = (i * nVariables) + (xsfrow.b2 * 16);
-    size_t start2W  = start2 >> 6;
-    uint16_t chunk_2 = (pFilterBlock[start2W] >> (start2 & 0x3f)) & xsfrow.p2;
+  return __builtin_parity(chunk_f);
+}
 
-    uint32_t chunk_f = ((uint32_t) chunk_2) ^ (((uint32_t) chunk_1) << 16);
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterCheckRow_DW(const XORSATFilterDWRowStart *pRow, const uint64_t *pFilterBlock, uint32_t nSolutions) {
+  uint32_t i;
+  uint32_t rhs = pRow->xsfrow.rhs;
 
-    if((xsfrow.rhs & 0x1) != __builtin_parity(chunk_f)) {
+  for(i = 0; i < nSolutions; i++) {
+    if((rhs & 0x1) != XORSATFilterDWParity(pRow, pFilterBlock, i)) {
       //fprintf(stdout, "No\n");
       return 0;
     }
 
-    xsfrow.rhs >>= 1;
+    rhs >>= 1;
   }
 
   //fprintf(stdout, "Maybe\n");
   return 1;
 }
 
-uint8_t *XORSATFilterRetrieveMetadataBlock_DW(XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, uint64_t *pFilterBlock) {
+//Every byte of pMetaData is shifted 8 times below, so it needn't be zeroed first.
+static inline __attribute__((always_inline))
+void XORSATFilterExtractMetadata_DW(const XORSATFilterDWRowStart *pRow, const uint64_t *pFilterBlock, uint8_t *pMetaData, uint32_t nSolutions, size_t nMetaDataBytes) {
   uint32_t i;
 
-  uint32_t nSolutions = xsfq->nSolutions;
-  size_t nMetaDataBits = xsfq->nMetaDataBytes * 8;
+  size_t nMetaDataBits = nMetaDataBytes * 8;
   uint32_t nRHSBits = nSolutions + nMetaDataBits;
-  
-  //Generate row
-  XORSATFilterRow xsfrow = XORSATFilterGenerateRowFromHash_DW(pHash, nVariables);
-  
-  uint8_t *pMetaData = (uint8_t *)calloc(xsfq->nMetaDataBytes, sizeof(uint8_t));
 
   size_t nByte = 0;
   size_t nBit = 0;
   for(i = nSolutions; i < nRHSBits; i++) {
-    size_t start1 = (i * nVariables) + (xsfrow.b1 * 16);
-    size_t start1W  = start1 >> 6;
-    uint16_t chunk_1 = (pFilterBlock[start1W] >> (start1 & 0x3f)) & xsfrow.p1;
+    pMetaData[nByte] >>= 1;
+    pMetaData[nByte] ^= XORSATFilterDWParity(pRow, pFilterBlock, i) ? 0x80 : 0x00;
+    nBit++;
+    if((nBit & 0x7) == 0) {
+      nByte++;
+    }
+  }
+}
+
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterQueryBlockKernel_DW(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint32_t nSolutions, size_t nMetaDataBytes) {
+  if(nSolutions == 0) return 1;
+
+  //Generate row
+  XORSATFilterDWRowStart row = XORSATFilterDWRowFromHash(xsfq, nVariables, pHash, nSolutions + (nMetaDataBytes * 8));
+
+  return XORSATFilterCheckRow_DW(&row, pFilterBlock, nSolutions);
+}
+
+static inline __attribute__((always_inline))
+void XORSATFilterRetrieveMetadataBlockKernel_DW(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData, uint32_t nSolutions, size_t nMetaDataBytes) {
+  //Generate row
+  XORSATFilterDWRowStart row = XORSATFilterDWRowFromHash(xsfq, nVariables, pHash, nSolutions + (nMetaDataBytes * 8));
+
+  XORSATFilterExtractMetadata_DW(&row, pFilterBlock, pMetaData, nSolutions, nMetaDataBytes);
+}
+
+//With XORSATFILTER_FORMAT_DW_INTERLEAVED the metadata chunks share cache
+//lines with the solution chunks the check has just loaded.
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterQueryAndRetrieveMetadataBlockKernel_DW(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData, uint32_t nSolutions, size_t nMetaDataBytes) {
+  //Generate row
+  XORSATFilterDWRowStart row = XORSATFilterDWRowFromHash(xsfq, nVariables, pHash, nSolutions + (nMetaDataBytes * 8));
+
+  if(!XORSATFilterCheckRow_DW(&row, pFilterBlock, nSolutions)) return 0;
+
+  XORSATFilterExtractMetadata_DW(&row, pFilterBlock, pMetaData, nSolutions, nMetaDataBytes);
+  return 1;
+}
+
+//Parity of a ribbon row's band with plane i of the solution. The band
+//starts nShift bits into word nWord of the plane and covers parts of
+//up to three words, nRHSBits apart (see
+//XORSATFilterStoreBlockSolution_Ribbon). When nShift is 0 the third
+//word isn't needed, and the second is read again so as not to read
+//past the block.
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterRibbonParity(const XORSATFilterRibbonRow *pRow, const uint64_t *pFilterBlock, uint32_t nRHSBits, uint32_t i) {
+  uint32_t nShift = pRow->nStart & 0x3f;
+  const uint64_t *pWords = pFilterBlock + ((size_t) (pRow->nStart >> 6) * nRHSBits) + i;
+  uint64_t w0 = pWords[0];
+  uint64_t w1 = pWords[nRHSBits];
+  uint64_t w2 = pWords[nRHSBits * (1 + (nShift != 0))];
+
+  uint64_t lo = (w0 >> nShift) | ((w1 << 1) << (63 - nShift));
+  uint64_t hi = (w1 >> nShift) | ((w2 << 1) << (63 - nShift));
+
+  return __builtin_parityll((lo & pRow->c[0]) ^ (hi & pRow->c[1]));
+}
+
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterCheckRow_Ribbon(const XORSATFilterRibbonRow *pRow, const uint64_t *pFilterBlock, uint32_t nSolutions, size_t nMetaDataBytes) {
+  uint32_t i;
+  uint32_t rhs = pRow->rhs;
+  uint32_t nRHSBits = nSolutions + (nMetaDataBytes * 8);
+
+  for(i = 0; i < nSolutions; i++) {
+    if((rhs & 0x1) != XORSATFilterRibbonParity(pRow, pFilterBlock, nRHSBits, i)) {
+      return 0;
+    }
+
+    rhs >>= 1;
+  }
 
-    size_t start2 = (i * nVariables) + (xsfrow.b2 * 16);
-    size_t start2W  = start2 >> 6;
-    uint16_t chunk_2 = (pFilterBlock[start2W] >> (start2 & 0x3f)) & xsfrow.p2;
+  return 1;
+}
 
-    uint32_t chunk_f = ((uint32_t) chunk_2) ^ (((uint32_t) chunk_1) << 16);
+//Every byte of pMetaData is shifted 8 times below, so it needn't be zeroed first.
+static inline __attribute__((always_inline))
+void XORSATFilterExtractMetadata_Ribbon(const XORSATFilterRibbonRow *pRow, const uint64_t *pFilterBlock, uint8_t *pMetaData, uint32_t nSolutions, size_t nMetaDataBytes) {
+  uint32_t i;
+  uint32_t nRHSBits = nSolutions + (nMetaDataBytes * 8);
 
+  size_t nByte = 0;
+  size_t nBit = 0;
+  for(i = nSolutions; i < nRHSBits; i++) {
     pMetaData[nByte] >>= 1;
-    pMetaData[nByte] ^= __builtin_parity(chunk_f) ? 0x80 : 0x00;
+    pMetaData[nByte] ^= XORSATFilterRibbonParity(pRow, pFilterBlock, nRHSBits, i) ? 0x80 : 0x00;
     nBit++;
     if((nBit & 0x7) == 0) {
       nByte++;
     }
   }
+}
+
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterQueryBlockKernel_Ribbon(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint32_t nSolutions, size_t nMetaDataBytes) {
+  if(nSolutions == 0) return 1;
+
+  XORSATFilterRibbonRow row = XORSATFilterRowFromHash_Ribbon(pHash, nVariables, xsfq->nFormat);
+
+  return XORSATFilterCheckRow_Ribbon(&row, pFilterBlock, nSolutions, nMetaDataBytes);
+}
+
+static inline __attribute__((always_inline))
+void XORSATFilterRetrieveMetadataBlockKernel_Ribbon(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData, uint32_t nSolutions, size_t nMetaDataBytes) {
+  XORSATFilterRibbonRow row = XORSATFilterRowFromHash_Ribbon(pHash, nVariables, xsfq->nFormat);
+
+  XORSATFilterExtractMetadata_Ribbon(&row, pFilterBlock, pMetaData, nSolutions, nMetaDataBytes);
+}
+
+//The metadata planes of a band share cache lines with its solution planes.
+static inline __attribute__((always_inline))
+uint8_t XORSATFilterQueryAndRetrieveMetadataBlockKernel_Ribbon(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData, uint32_t nSolutions, size_t nMetaDataBytes) {
+  XORSATFilterRibbonRow row = XORSATFilterRowFromHash_Ribbon(pHash, nVariables, xsfq->nFormat);
+
+  if(!XORSATFilterCheckRow_Ribbon(&row, pFilterBlock, nSolutions, nMetaDataBytes)) return 0;
+
+  XORSATFilterExtractMetadata_Ribbon(&row, pFilterBlock, pMetaData, nSolutions, nMetaDataBytes);
+  return 1;
+}
+
+//Generic kernels, for any parameters
+static
+uint8_t XORSATFilterQueryBlock_Generic(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock) {
+  if(xsfq->nLitsPerRow == XORSATFILTER_RIBBON) {
+    return XORSATFilterQueryBlockKernel_Ribbon(xsfq, nVariables, pHash, pFilterBlock, xsfq->nSolutions, xsfq->nMetaDataBytes);
+  }
+  if(xsfq->nLitsPerRow < 3) {
+    return XORSATFilterQueryBlockKernel_DW(xsfq, nVariables, pHash, pFilterBlock, xsfq->nSolutions, xsfq->nMetaDataBytes);
+  }
+  return XORSATFilterQueryBlockKernel_WRS(xsfq, nVariables, pHash, pFilterBlock, xsfq->nLitsPerRow, xsfq->nSolutions, xsfq->nMetaDataBytes);
+}
 
-  return (uint8_t *)pMetaData;
+static
+void XORSATFilterRetrieveMetadataBlock_Generic(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData) {
+  if(xsfq->nLitsPerRow == XORSATFILTER_RIBBON) {
+    XORSATFilterRetrieveMetadataBlockKernel_Ribbon(xsfq, nVariables, pHash, pFilterBlock, pMetaData, xsfq->nSolutions, xsfq->nMetaDataBytes);
+  } else if(xsfq->nLitsPerRow < 3) {
+    XORSATFilterRetrieveMetadataBlockKernel_DW(xsfq, nVariables, pHash, pFilterBlock, pMetaData, xsfq->nSolutions, xsfq->nMetaDataBytes);
+  } else {
+    XORSATFilterRetrieveMetadataBlockKernel_WRS(xsfq, nVariables, pHash, pFilterBlock, pMetaData, xsfq->nLitsPerRow, xsfq->nSolutions, xsfq->nMetaDataBytes);
+  }
+}
+
+static
+uint8_t XORSATFilterQueryAndRetrieveMetadataBlock_Generic(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData) {
+  if(xsfq->nLitsPerRow == XORSATFILTER_RIBBON) {
+    return XORSATFilterQueryAndRetrieveMetadataBlockKernel_Ribbon(xsfq, nVariables, pHash, pFilterBlock, pMetaData, xsfq->nSolutions, xsfq->nMetaDataBytes);
+  }
+  if(xsfq->nLitsPerRow < 3) {
+    return XORSATFilterQueryAndRetrieveMetadataBlockKernel_DW(xsfq, nVariables, pHash, pFilterBlock, pMetaData, xsfq->nSolutions, xsfq->nMetaDataBytes);
+  }
+  return XORSATFilterQueryAndRetrieveMetadataBlockKernel_WRS(xsfq, nVariables, pHash, pFilterBlock, pMetaData, xsfq->nLitsPerRow, xsfq->nSolutions, xsfq->nMetaDataBytes);
+}
+
+#ifndef XORSATFILTER_GENERIC_KERNELS_ONLY
+
+//(nLitsPerRow, nSolutions, nMetaDataBytes) tuples that get a
+//specialized kernel: every shipped preset (see src/xorsat_blocks.c)
+//with 7 or 8 solution bits and common metadata sizes. Anything else
+//uses the generic kernels.
+#define XORSATFILTER_KERNELS_METADATA(X, L, S) X(L, S, 0) X(L, S, 1) X(L, S, 2) X(L, S, 4) X(L, S, 8) X(L, S, 16)
+#define XORSATFILTER_KERNELS_SOLUTIONS(X, L) XORSATFILTER_KERNELS_METADATA(X, L, 7) XORSATFILTER_KERNELS_METADATA(X, L, 8)
+#define XORSATFILTER_KERNELS(X)                                         \
+  XORSATFILTER_KERNELS_SOLUTIONS(X, 1) XORSATFILTER_KERNELS_SOLUTIONS(X, 2) \
+  XORSATFILTER_KERNELS_SOLUTIONS(X, 4) XORSATFILTER_KERNELS_SOLUTIONS(X, 5) \
+  XORSATFILTER_KERNELS_SOLUTIONS(X, 6)
+
+#define XORSATFILTER_DEFINE_KERNEL(L, S, M)                             \
+static                                                                  \
+uint8_t XORSATFilterQueryBlock_##L##_##S##_##M(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock) { \
+  if((L) == XORSATFILTER_RIBBON) return XORSATFilterQueryBlockKernel_Ribbon(xsfq, nVariables, pHash, pFilterBlock, (S), (M)); \
+  if((L) < 3) return XORSATFilterQueryBlockKernel_DW(xsfq, nVariables, pHash, pFilterBlock, (S), (M)); \
+  return XORSATFilterQueryBlockKernel_WRS(xsfq, nVariables, pHash, pFilterBlock, (L), (S), (M)); \
+}                                                                       \
+static                                                                  \
+void XORSATFilterRetrieveMetadataBlock_##L##_##S##_##M(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData) { \
+  if((L) == XORSATFILTER_RIBBON) XORSATFilterRetrieveMetadataBlockKernel_Ribbon(xsfq, nVariables, pHash, pFilterBlock, pMetaData, (S), (M)); \
+  else if((L) < 3) XORSATFilterRetrieveMetadataBlockKernel_DW(xsfq, nVariables, pHash, pFilterBlock, pMetaData, (S), (M)); \
+  else XORSATFilterRetrieveMetadataBlockKernel_WRS(xsfq, nVariables, pHash, pFilterBlock, pMetaData, (L), (S), (M)); \
+}                                                                       \
+static                                                                  \
+uint8_t XORSATFilterQueryAndRetrieveMetadataBlock_##L##_##S##_##M(const XORSATFilterQuerier *xsfq, uint32_t nVariables, XORSATFilterHash pHash, const uint64_t *pFilterBlock, uint8_t *pMetaData) { \
+  if((L) == XORSATFILTER_RIBBON) return XORSATFilterQueryAndRetrieveMetadataBlockKernel_Ribbon(xsfq, nVariables, pHash, pFilterBlock, pMetaData, (S), (M)); \
+  if((L) < 3) return XORSATFilterQueryAndRetrieveMetadataBlockKernel_DW(xsfq, nVariables, pHash, pFilterBlock, pMetaData, (S), (M)); \
+  return XORSATFilterQueryAndRetrieveMetadataBlockKernel_WRS(xsfq, nVariables, pHash, pFilterBlock, pMetaData, (L), (S), (M)); \
+}
+
+XORSATFILTER_KERNELS(XORSATFILTER_DEFINE_KERNEL)
+
+typedef struct XORSATFilterKernel {
+  uint8_t nLitsPerRow;
+  uint8_t nSolutions;
+  size_t nMetaDataBytes;
+  XORSATFilterQueryBlockFunc pQueryBlock;
+  XORSATFilterRetrieveMetadataBlockFunc pRetrieveMetadataBlock;
+  XORSATFilterQueryAndRetrieveMetadataBlockFunc pQueryAndRetrieveMetadataBlock;
+} XORSATFilterKernel;
+
+#define XORSATFILTER_KERNEL_ENTRY(L, S, M) \
+  { (L), (S), (M), XORSATFilterQueryBlock_##L##_##S##_##M, XORSATFilterRetrieveMetadataBlock_##L##_##S##_##M, \
+    XORSATFilterQueryAndRetrieveMetadataBlock_##L##_##S##_##M },
+
+static const XORSATFilterKernel pXORSATFilterKernels[] = {
+  XORSATFILTER_KERNELS(XORSATFILTER_KERNEL_ENTRY)
+};
+
+#endif
+
+//Points xsfq at the kernels for its parameters. DW kernels handle any
+//other nLitsPerRow below 3, as the query functions always have.
+static
+void XORSATFilterQuerierSelectKernels(XORSATFilterQuerier *xsfq) {
+  xsfq->pQueryBlock = XORSATFilterQueryBlock_Generic;
+  xsfq->pRetrieveMetadataBlock = XORSATFilterRetrieveMetadataBlock_Generic;
+  xsfq->pQueryAndRetrieveMetadataBlock = XORSATFilterQueryAndRetrieveMetadataBlock_Generic;
+
+#ifndef XORSATFILTER_GENERIC_KERNELS_ONLY
+  uint32_t i;
+  uint8_t nLitsPerRow = (xsfq->nLitsPerRow < 3) ? 2 : xsfq->nLitsPerRow;
+  for(i = 0; i < sizeof(pXORSATFilterKernels) / sizeof(pXORSATFilterKernels[0]); i++) {
+    if(pXORSATFilterKernels[i].nLitsPerRow == nLitsPerRow &&
+       pXORSATFilterKernels[i].nSolutions == xsfq->nSolutions &&
+       pXORSATFilterKernels[i].nMetaDataBytes == xsfq->nMetaDataBytes) {
+      xsfq->pQueryBlock = pXORSATFilterKernels[i].pQueryBlock;
+      xsfq->pRetrieveMetadataBlock = pXORSATFilterKernels[i].pRetrieveMetadataBlock;
+      xsfq->pQueryAndRetrieveMetadataBlock = pXORSATFilterKernels[i].pQueryAndRetrieveMetadataBlock;
+      break;
+    }
+  }
+#endif
 }
 
 inline
-uint8_t XORSATFilterQuery(XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes) {
+uint8_t XORSATFilterQueryHash(const XORSATFilterQuerier *xsfq, XORSATFilterHash pHash) {
   uint8_t bPass;
-  
-  //Generate hashes from element
-  XORSATFilterHash pHash = XORSATFilterGenerateHashesFromElement(pElement, nElementBytes);
+
+  pHash.present = 1;
   
   //Hash to block
-  uint32_t nBlockIndex = XORSATFilterHashToBlock(pHash, xsfq->nBlocks);
+  uint32_t nBlockIndex = XORSATFilterHashToBlock(pHash, xsfq->nBlocks, xsfq->nFormat);
   //Get filter block
 
   uint64_t nBlockStart = XORSATFilterGetBlockIndex(xsfq, nBlockIndex);
   uint32_t nBlockSize  = XORSATFilterGetBlockIndex(xsfq, nBlockIndex+1) - nBlockStart;
-  uint32_t nRHSBits = ((uint32_t) xsfq->nSolutions) + (xsfq->nMetaDataBytes*8);
-  uint32_t nVariables = (nBlockSize / nRHSBits) << 6;
+  uint32_t nVariables = XORSATFilterDivideByRHSBits(xsfq, nBlockSize) << 6;
 
-  uint64_t *pFilterBlock = xsfq->pFilter + nBlockStart;
+  const uint64_t *pFilterBlock = xsfq->pFilter + nBlockStart;
 
   if(pFilterBlock[0] == 0 || nVariables == 0) {
     bPass = 1; //Bad Block
   } else {
     //Query filter block
-    if(xsfq->nLitsPerRow < 3) {
-      bPass = XORSATFilterQueryBlock_DW(xsfq, nVariables, pHash, pFilterBlock);
-    } else {
-      bPass = XORSATFilterQueryBlock_WRS(xsfq, nVariables, pHash, pFilterBlock);
-    }
+    bPass = xsfq->pQueryBlock(xsfq, nVariables, pHash, pFilterBlock);
   }
   
   return bPass;
 }
 
-uint8_t *XORSATFilterRetrieveMetadata(XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes) {
-  uint8_t *bPass;
-  
+inline
+uint8_t XORSATFilterQuery(const XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes) {
   //Generate hashes from element
   XORSATFilterHash pHash = XORSATFilterGenerateHashesFromElement(pElement, nElementBytes);
+
+  return XORSATFilterQueryHash(xsfq, pHash);
+}
+
+//Writes xsfq->nMetaDataBytes bytes to pMetaData. Returns 1 on success
+//and 0 if there is no metadata to retrieve, in which case pMetaData is
+//zeroed.
+uint8_t XORSATFilterRetrieveMetadataHashInto(const XORSATFilterQuerier *xsfq, XORSATFilterHash pHash, uint8_t *pMetaData) {
+  pHash.present = 1;
   
   //Hash to block
-  uint32_t nBlockIndex = XORSATFilterHashToBlock(pHash, xsfq->nBlocks);
+  uint32_t nBlockIndex = XORSATFilterHashToBlock(pHash, xsfq->nBlocks, xsfq->nFormat);
   //Get filter block
 
   uint64_t nBlockStart = XORSATFilterGetBlockIndex(xsfq, nBlockIndex);
   uint32_t nBlockSize  = XORSATFilterGetBlockIndex(xsfq, nBlockIndex+1) - nBlockStart;
-  uint32_t nRHSBits = ((uint32_t) xsfq->nSolutions) + (xsfq->nMetaDataBytes*8);
-  uint32_t nVariables = (nBlockSize / nRHSBits) << 6;
+  uint32_t nVariables = XORSATFilterDivideByRHSBits(xsfq, nBlockSize) << 6;
 
-  uint64_t *pFilterBlock = xsfq->pFilter + nBlockStart;
+  const uint64_t *pFilterBlock = xsfq->pFilter + nBlockStart;
 
   if(pFilterBlock[0] == 0 || nVariables == 0 || xsfq->nMetaDataBytes == 0) {
-    bPass = NULL; //Bad Block
+    memset(pMetaData, 0, xsfq->nMetaDataBytes); //Bad Block
+    return 0;
+  }
+
+  //Query filter block
+  xsfq->pRetrieveMetadataBlock(xsfq, nVariables, pHash, pFilterBlock, pMetaData);
+  
+  return 1;
+}
+
+uint8_t XORSATFilterRetrieveMetadataInto(const XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes, uint8_t *pMetaData) {
+  //Generate hashes from element
+  XORSATFilterHash pHash = XORSATFilterGenerateHashesFromElement(pElement, nElementBytes);
+
+  return XORSATFilterRetrieveMetadataHashInto(xsfq, pHash, pMetaData);
+}
+
+//Queries the filter and, only if the element passes, retrieves its
+//metadata from the same block, hashing and locating the block once.
+//Returns XORSATFILTER_ABSENT, XORSATFILTER_PRESENT or XORSATFILTER_UNKNOWN.
+//Without metadata this is XORSATFilterQueryHash and pMetaData is untouched.
+uint8_t XORSATFilterQueryAndRetrieveMetadataHash(const XORSATFilterQuerier *xsfq, XORSATFilterHash pHash, uint8_t *pMetaData) {
+  pHash.present = 1;
+  
+  //Hash to block
+  uint32_t nBlockIndex = XORSATFilterHashToBlock(pHash, xsfq->nBlocks, xsfq->nFormat);
+  //Get filter block
+
+  uint64_t nBlockStart = XORSATFilterGetBlockIndex(xsfq, nBlockIndex);
+  uint32_t nBlockSize  = XORSATFilterGetBlockIndex(xsfq, nBlockIndex+1) - nBlockStart;
+  uint32_t nVariables = XORSATFilterDivideByRHSBits(xsfq, nBlockSize) << 6;
+
+  const uint64_t *pFilterBlock = xsfq->pFilter + nBlockStart;
+
+  if(pFilterBlock[0] == 0 || nVariables == 0) {
+    memset(pMetaData, 0, xsfq->nMetaDataBytes); //Bad Block
+    return XORSATFILTER_UNKNOWN;
+  }
+
+  if(xsfq->nMetaDataBytes == 0) {
+    return xsfq->pQueryBlock(xsfq, nVariables, pHash, pFilterBlock) ? XORSATFILTER_PRESENT : XORSATFILTER_ABSENT;
+  }
+
+  //Query filter block
+  if(xsfq->pQueryAndRetrieveMetadataBlock(xsfq, nVariables, pHash, pFilterBlock, pMetaData)) {
+    return XORSATFILTER_PRESENT;
+  }
+
+  memset(pMetaData, 0, xsfq->nMetaDataBytes);
+  return XORSATFILTER_ABSENT;
+}
+
+uint8_t XORSATFilterQueryAndRetrieveMetadata(const XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes, uint8_t *pMetaData) {
+  //Generate hashes from element
+  XORSATFilterHash pHash = XORSATFilterGenerateHashesFromElement(pElement, nElementBytes);
+
+  return XORSATFilterQueryAndRetrieveMetadataHash(xsfq, pHash, pMetaData);
+}
+
+uint8_t *XORSATFilterRetrieveMetadataHash(const XORSATFilterQuerier *xsfq, XORSATFilterHash pHash) {
+  if(xsfq->nMetaDataBytes == 0) return NULL;
+
+  uint8_t *pMetaData = (uint8_t *)malloc(xsfq->nMetaDataBytes * sizeof(uint8_t));
+  if(pMetaData == NULL) return NULL;
+
+  if(XORSATFilterRetrieveMetadataHashInto(xsfq, pHash, pMetaData) == 0) {
+    free(pMetaData);
+    return NULL; //Bad Block
+  }
+
+  return pMetaData;
+}
+
+uint8_t *XORSATFilterRetrieveMetadata(const XORSATFilterQuerier *xsfq, const void *pElement, uint32_t nElementBytes) {
+  //Generate hashes from element
+  XORSATFilterHash pHash = XORSATFilterGenerateHashesFromElement(pElement, nElementBytes);
+
+  return XORSATFilterRetrieveMetadataHash(xsfq, pHash);
+}
+
+/*************************************************************************************
+
+  Batched querying. Each element passes through three stages spaced
+  XORSATFILTER_BATCH_DISTANCE elements apart: (1) hash and prefetch the
+  block offsets, (2) locate the filter block and prefetch the words
+  the row touches, (3) query. Many misses are then in flight at once
+  instead of two dependent misses per element.
+
+  When nLitsPerRow is 2, stage (3) checks XORSATFILTER_DW_LANES rows at
+  once with AVX2 or AVX-512 gathers.
+
+**************************************************************************************/
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define XORSATFILTER_DW_LANES 16
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define XORSATFILTER_DW_LANES 8
+#else
+#define XORSATFILTER_DW_LANES 1
+#endif
+
+#define XORSATFILTER_BATCH_DISTANCE 8
+#define XORSATFILTER_BATCH_RING     64 //Power of two, > 2*XORSATFILTER_BATCH_DISTANCE + XORSATFILTER_DW_LANES
+
+typedef struct XORSATFilterBatchState {
+  XORSATFilterHash pHash;
+  uint32_t nBlockIndex;
+  uint32_t nVariables;
+  uint64_t nBlockStart;
+  XORSATFilterRow xsfrow;
+} XORSATFilterBatchState;
+
+static inline
+void XORSATFilterBatchStage1(const XORSATFilterQuerier *xsfq, XORSATFilterBatchState *pState, XORSATFilterHash pHash) {
+  pState->pHash = pHash;
+  pState->pHash.present = 1;
+  pState->nBlockIndex = XORSATFilterHashToBlock(pState->pHash, xsfq->nBlocks, xsfq->nFormat);
+  __builtin_prefetch(&xsfq->pOffsets[pState->nBlockIndex], 0, 3);
+  __builtin_prefetch(&xsfq->pOffsets[pState->nBlockIndex+1], 0, 3);
+}
+
+static inline
+void XORSATFilterBatchStage2(const XORSATFilterQuerier *xsfq, XORSATFilterBatchState *pState, uint8_t bRetrieve) {
+  uint32_t i;
+  uint32_t nRHSBits = xsfq->nRHSBits;
+
+  pState->nBlockStart = XORSATFilterGetBlockIndex(xsfq, pState->nBlockIndex);
+  uint32_t nBlockSize = XORSATFilterGetBlockIndex(xsfq, pState->nBlockIndex+1) - pState->nBlockStart;
+  pState->nVariables = XORSATFilterDivideByRHSBits(xsfq, nBlockSize) << 6;
+
+  const uint64_t *pFilterBlock = xsfq->pFilter + pState->nBlockStart;
+  __builtin_prefetch(pFilterBlock, 0, 3);
+  if(pState->nVariables == 0) return;
+
+  if(xsfq->nLitsPerRow == XORSATFILTER_RIBBON) {
+    XORSATFilterRibbonRow xsfrow = XORSATFilterRowFromHash_Ribbon(pState->pHash, pState->nVariables, xsfq->nFormat);
+    uint32_t nFirst = bRetrieve ? xsfq->nSolutions : 0;
+    uint32_t nLast = bRetrieve ? nRHSBits : xsfq->nSolutions;
+    if(nFirst == nLast) return;
+    //The band's planes lie in one run of at most 3*nRHSBits words
+    const uint64_t *pWords = pFilterBlock + ((size_t) (xsfrow.nStart >> 6) * nRHSBits);
+    uint32_t nWords = 2*nRHSBits + nLast;
+    for(i = nFirst; i < nWords; i += 8) {
+      __builtin_prefetch(&pWords[i], 0, 3);
+    }
+    __builtin_prefetch(&pWords[nWords-1], 0, 3);
+  } else if(xsfq->nLitsPerRow < 3) {
+    pState->xsfrow = XORSATFilterRowFromHash_DW(pState->pHash, pState->nVariables, xsfq->nFormat);
+    size_t nStart1 = XORSATFilterDWChunkStart(xsfq, xsfq->nRHSBits, pState->xsfrow.b1);
+    size_t nStart2 = XORSATFilterDWChunkStart(xsfq, xsfq->nRHSBits, pState->xsfrow.b2);
+    uint32_t nStride = XORSATFilterDWChunkStride(xsfq, pState->nVariables);
+    uint32_t nFirst = bRetrieve ? xsfq->nSolutions : 0;
+    uint32_t nLast = bRetrieve ? nRHSBits : xsfq->nSolutions;
+    if(nFirst == nLast) return;
+    //Queries read the solution chunks, retrievals the metadata chunks.
+    //Interleaved chunks share cache lines, so one prefetch per line will do.
+    uint32_t nStep = (xsfq->nFormat & XORSATFILTER_FORMAT_DW_INTERLEAVED) ? 32 : 1;
+    for(i = nFirst; i < nLast; i += nStep) {
+      __builtin_prefetch(&pFilterBlock[((i * nStride) + nStart1) >> 6], 0, 3);
+      __builtin_prefetch(&pFilterBlock[((i * nStride) + nStart2) >> 6], 0, 3);
+    }
+    if(nStep > 1) {
+      __builtin_prefetch(&pFilterBlock[(((nLast-1) * nStride) + nStart1) >> 6], 0, 3);
+      __builtin_prefetch(&pFilterBlock[(((nLast-1) * nStride) + nStart2) >> 6], 0, 3);
+    }
   } else {
-    //Query filter block
-    if(xsfq->nLitsPerRow < 3) {
-      bPass = XORSATFilterRetrieveMetadataBlock_DW(xsfq, nVariables, pHash, pFilterBlock);
+    uint32_t pRow[xsfq->nLitsPerRow + 1];
+    XORSATFilterRowFromHash_WRS(pState->pHash, pState->nVariables, pRow, xsfq->nLitsPerRow, xsfq->nFormat, xsfq->nWRSWindowSlice);
+    for(i = 0; i < xsfq->nLitsPerRow; i++) {
+      __builtin_prefetch(&pFilterBlock[(pRow[i] * nRHSBits) >> 6], 0, 3);
+      if(bRetrieve) {
+        __builtin_prefetch(&pFilterBlock[((pRow[i] + 1) * nRHSBits - 1) >> 6], 0, 3);
+      }
+    }
+  }
+}
+
+static inline
+uint8_t XORSATFilterBatchStage3(const XORSATFilterQuerier *xsfq, XORSATFilterBatchState *pState) {
+  const uint64_t *pFilterBlock = xsfq->pFilter + pState->nBlockStart;
+
+  if(pFilterBlock[0] == 0 || pState->nVariables == 0) {
+    return 1; //Bad Block
+  }
+  return xsfq->pQueryBlock(xsfq, pState->nVariables, pState->pHash, pFilterBlock);
+}
+
+static inline
+uint8_t XORSATFilterBatchStage3Retrieve(const XORSATFilterQuerier *xsfq, XORSATFilterBatchState *pState, uint8_t *pMetaData) {
+  const uint64_t *pFilterBlock = xsfq->pFilter + pState->nBlockStart;
+
+  if(pFilterBlock[0] == 0 || pState->nVariables == 0) {
+    memset(pMetaData, 0, xsfq->nMetaDataBytes); //Bad Block
+    return 0;
+  }
+  xsfq->pRetrieveMetadataBlock(xsfq, pState->nVariables, pState->pHash, pFilterBlock, pMetaData);
+  return 1;
+}
+
+#if XORSATFILTER_DW_LANES > 1
+//Checks XORSATFILTER_DW_LANES precomputed DW rows without branching.
+//Each lane gathers the 16-bit chunks at 16-bit index
+//  4*nBlockStart + (XORSATFilterDWChunkStart() + i * XORSATFilterDWChunkStride()) / 16
+//for solution i. Gathers read 32 bits, so the filter must be followed
+//by at least 2 readable bytes (see XORSATFilterQuerierAlloc).
+//Bit k of the return value is set if row k passes.
+static
+uint32_t XORSATFilterQueryRows_DW(const XORSATFilterQuerier *xsfq, XORSATFilterBatchState **ppStates) {
+  uint32_t k;
+  uint64_t pIndex1[XORSATFILTER_DW_LANES], pIndex2[XORSATFILTER_DW_LANES], pStride[XORSATFILTER_DW_LANES];
+  uint32_t pMask1[XORSATFILTER_DW_LANES], pMask2[XORSATFILTER_DW_LANES], pRHS[XORSATFILTER_DW_LANES];
+  uint32_t nBadBlocks = 0;
+
+  for(k = 0; k < XORSATFILTER_DW_LANES; k++) {
+    XORSATFilterBatchState *pState = ppStates[k];
+    if(pState->nVariables == 0 || xsfq->pFilter[pState->nBlockStart] == 0) {
+      nBadBlocks |= 1 << k;
+      pIndex1[k] = pIndex2[k] = pStride[k] = 0;
+      pMask1[k] = pMask2[k] = pRHS[k] = 0;
     } else {
-      bPass = XORSATFilterRetrieveMetadataBlock_WRS(xsfq, nVariables, pHash, pFilterBlock);
+      pIndex1[k] = (pState->nBlockStart << 2) + (XORSATFilterDWChunkStart(xsfq, xsfq->nRHSBits, pState->xsfrow.b1) >> 4);
+      pIndex2[k] = (pState->nBlockStart << 2) + (XORSATFilterDWChunkStart(xsfq, xsfq->nRHSBits, pState->xsfrow.b2) >> 4);
+      pStride[k] = XORSATFilterDWChunkStride(xsfq, pState->nVariables) >> 4;
+      pMask1[k] = pState->xsfrow.p1;
+      pMask2[k] = pState->xsfrow.p2;
+      pRHS[k] = pState->xsfrow.rhs;
     }
   }
-  
-  return bPass;
+
+  const int *pBase = (const int *) xsfq->pFilter;
+  uint32_t i;
+
+#if defined(__AVX512F__)
+  __m512i vIndex1lo = _mm512_loadu_si512(pIndex1), vIndex1hi = _mm512_loadu_si512(pIndex1 + 8);
+  __m512i vIndex2lo = _mm512_loadu_si512(pIndex2), vIndex2hi = _mm512_loadu_si512(pIndex2 + 8);
+  __m512i vStridelo = _mm512_loadu_si512(pStride), vStridehi = _mm512_loadu_si512(pStride + 8);
+  __m512i vMask1 = _mm512_loadu_si512(pMask1);
+  __m512i vMask2 = _mm512_loadu_si512(pMask2);
+  __m512i vRHS = _mm512_loadu_si512(pRHS);
+  __m512i vOne = _mm512_set1_epi32(1);
+  __m512i vFail = _mm512_setzero_si512();
+
+  for(i = 0; i < xsfq->nSolutions; i++) {
+    __m512i vChunk1 = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_i64gather_epi32(vIndex1lo, pBase, 2)), _mm512_i64gather_epi32(vIndex1hi, pBase, 2), 1);
+    __m512i vChunk2 = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_i64gather_epi32(vIndex2lo, pBase, 2)), _mm512_i64gather_epi32(vIndex2hi, pBase, 2), 1);
+    __m512i vChunk = _mm512_xor_si512(_mm512_slli_epi32(_mm512_and_si512(vChunk1, vMask1), 16), _mm512_and_si512(vChunk2, vMask2));
+#if defined(__AVX512VPOPCNTDQ__)
+    vChunk = _mm512_popcnt_epi32(vChunk);
+#else
+    vChunk = _mm512_xor_si512(vChunk, _mm512_srli_epi32(vChunk, 16));
+    vChunk = _mm512_xor_si512(vChunk, _mm512_srli_epi32(vChunk, 8));
+    vChunk = _mm512_xor_si512(vChunk, _mm512_srli_epi32(vChunk, 4));
+    vChunk = _mm512_xor_si512(vChunk, _mm512_srli_epi32(vChunk, 2));
+    vChunk = _mm512_xor_si512(vChunk, _mm512_srli_epi32(vChunk, 1));
+#endif
+    vFail = _mm512_or_si512(vFail, _mm512_and_si512(_mm512_xor_si512(vChunk, vRHS), vOne));
+    vRHS = _mm512_srli_epi32(vRHS, 1);
+    vIndex1lo = _mm512_add_epi64(vIndex1lo, vStridelo); vIndex1hi = _mm512_add_epi64(vIndex1hi, vStridehi);
+    vIndex2lo = _mm512_add_epi64(vIndex2lo, vStridelo); vIndex2hi = _mm512_add_epi64(vIndex2hi, vStridehi);
+  }
+
+  return ((uint32_t) _mm512_cmpeq_epi32_mask(vFail, _mm512_setzero_si512())) | nBadBlocks;
+#else
+  __m256i vIndex1lo = _mm256_loadu_si256((__m256i *) pIndex1), vIndex1hi = _mm256_loadu_si256((__m256i *) (pIndex1 + 4));
+  __m256i vIndex2lo = _mm256_loadu_si256((__m256i *) pIndex2), vIndex2hi = _mm256_loadu_si256((__m256i *) (pIndex2 + 4));
+  __m256i vStridelo = _mm256_loadu_si256((__m256i *) pStride), vStridehi = _mm256_loadu_si256((__m256i *) (pStride + 4));
+  __m256i vMask1 = _mm256_loadu_si256((__m256i *) pMask1);
+  __m256i vMask2 = _mm256_loadu_si256((__m256i *) pMask2);
+  __m256i vRHS = _mm256_loadu_si256((__m256i *) pRHS);
+  __m256i vOne = _mm256_set1_epi32(1);
+  __m256i vFail = _mm256_setzero_si256();
+
+  for(i = 0; i < xsfq->nSolutions; i++) {
+    __m256i vChunk1 = _mm256_set_m128i(_mm256_i64gather_epi32(pBase, vIndex1hi, 2), _mm256_i64gather_epi32(pBase, vIndex1lo, 2));
+    __m256i vChunk2 = _mm256_set_m128i(_mm256_i64gather_epi32(pBase, vIndex2hi, 2), _mm256_i64gather_epi32(pBase, vIndex2lo, 2));
+    __m256i vChunk = _mm256_xor_si256(_mm256_slli_epi32(_mm256_and_si256(vChunk1, vMask1), 16), _mm256_and_si256(vChunk2, vMask2));
+    vChunk = _mm256_xor_si256(vChunk, _mm256_srli_epi32(vChunk, 16));
+    vChunk = _mm256_xor_si256(vChunk, _mm256_srli_epi32(vChunk, 8));
+    vChunk = _mm256_xor_si256(vChunk, _mm256_srli_epi32(vChunk, 4));
+    vChunk = _mm256_xor_si256(vChunk, _mm256_srli_epi32(vChunk, 2));
+    vChunk = _mm256_xor_si256(vChunk, _mm256_srli_epi32(vChunk, 1));
+    vFail = _mm256_or_si256(vFail, _mm256_and_si256(_mm256_xor_si256(vChunk, vRHS), vOne));
+    vRHS = _mm256_srli_epi32(vRHS, 1);
+    vIndex1lo = _mm256_add_epi64(vIndex1lo, vStridelo); vIndex1hi = _mm256_add_epi64(vIndex1hi, vStridehi);
+    vIndex2lo = _mm256_add_epi64(vIndex2lo, vStridelo); vIndex2hi = _mm256_add_epi64(vIndex2hi, vStridehi);
+  }
+
+  return ((uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(vFail, _mm256_setzero_si256())))) | nBadBlocks;
+#endif
+}
+#endif
+
+//Elements are hashed in stage (1) unless pHashes is given.
+static
+uint32_t XORSATFilterQueryBatchInternal(const XORSATFilterQuerier *xsfq, const void * const *ppElements, const uint32_t *pElementBytes, const XORSATFilterHash *pHashes, uint32_t nElements, uint8_t *pResults) {
+  XORSATFilterBatchState pStates[XORSATFILTER_BATCH_RING];
+  uint64_t i;
+  uint32_t nPassed = 0;
+
+  memset(pResults, 0, (nElements + 7) >> 3);
+
+  for(i = 0; i < (uint64_t) nElements + 2*XORSATFILTER_BATCH_DISTANCE; i++) {
+    if(i < nElements) {
+      XORSATFilterHash pHash = (pHashes != NULL) ? pHashes[i] : XORSATFilterGenerateHashesFromElement(ppElements[i], pElementBytes[i]);
+      XORSATFilterBatchStage1(xsfq, &pStates[i & (XORSATFILTER_BATCH_RING-1)], pHash);
+    }
+
+    if(i >= XORSATFILTER_BATCH_DISTANCE && i - XORSATFILTER_BATCH_DISTANCE < nElements) {
+      uint64_t j = i - XORSATFILTER_BATCH_DISTANCE;
+      XORSATFilterBatchStage2(xsfq, &pStates[j & (XORSATFILTER_BATCH_RING-1)], 0);
+    }
+
+    if(i >= 2*XORSATFILTER_BATCH_DISTANCE) {
+      uint64_t j = i - 2*XORSATFILTER_BATCH_DISTANCE;
+#if XORSATFILTER_DW_LANES > 1
+      if(xsfq->nLitsPerRow < 3 && xsfq->nSolutions > 0) {
+        //Wait for a full group of lanes, then check them all at once
+        if((j % XORSATFILTER_DW_LANES) != XORSATFILTER_DW_LANES-1) continue;
+        uint64_t k, nFirst = j - (XORSATFILTER_DW_LANES-1);
+        XORSATFilterBatchState *ppGroup[XORSATFILTER_DW_LANES];
+        for(k = 0; k < XORSATFILTER_DW_LANES; k++) {
+          ppGroup[k] = &pStates[(nFirst + k) & (XORSATFILTER_BATCH_RING-1)];
+        }
+        uint32_t nPass = XORSATFilterQueryRows_DW(xsfq, ppGroup);
+        for(k = 0; k < XORSATFILTER_DW_LANES; k++) {
+          uint8_t bPass = (nPass >> k) & 1;
+          pResults[(nFirst + k) >> 3] |= bPass << ((nFirst + k) & 0x7);
+          nPassed += bPass;
+        }
+        continue;
+      }
+#endif
+      uint8_t bPass = XORSATFilterBatchStage3(xsfq, &pStates[j & (XORSATFILTER_BATCH_RING-1)]);
+      pResults[j >> 3] |= bPass << (j & 0x7);
+      nPassed += bPass;
+    }
+  }
+
+#if XORSATFILTER_DW_LANES > 1
+  if(xsfq->nLitsPerRow < 3 && xsfq->nSolutions > 0) {
+    //Finish the final, partial group one element at a time
+    for(i = nElements - (nElements % XORSATFILTER_DW_LANES); i < nElements; i++) {
+      uint8_t bPass = XORSATFilterBatchStage3(xsfq, &pStates[i & (XORSATFILTER_BATCH_RING-1)]);
+      pResults[i >> 3] |= bPass << (i & 0x7);
+      nPassed += bPass;
+    }
+  }
+#endif
+
+  return nPassed;
+}
+
+//Bit i of pResults (pResults[i>>3] & (1<<(i&7))) is set if element i may be in the filter.
+//Returns the number of elements that may be in the filter.
+uint32_t XORSATFilterQueryBatch(const XORSATFilterQuerier *xsfq, const void * const *ppElements, const uint32_t *pElementBytes, uint32_t nElements, uint8_t *pResults) {
+  return XORSATFilterQueryBatchInternal(xsfq, ppElements, pElementBytes, NULL, nElements, pResults);
+}
+
+uint32_t XORSATFilterQueryHashBatch(const XORSATFilterQuerier *xsfq, const XORSATFilterHash *pHashes, uint32_t nHashes, uint8_t *pResults) {
+  return XORSATFilterQueryBatchInternal(xsfq, NULL, NULL, pHashes, nHashes, pResults);
+}
+
+//Same pipeline as XORSATFilterQueryBatchInternal, retrieving metadata in stage (3).
+static
+uint32_t XORSATFilterRetrieveMetadataBatchInternal(const XORSATFilterQuerier *xsfq, const void * const *ppElements, const uint32_t *pElementBytes, const XORSATFilterHash *pHashes, uint32_t nElements, uint8_t *pMetaData) {
+  XORSATFilterBatchState pStates[XORSATFILTER_BATCH_RING];
+  uint64_t i;
+  uint32_t nRetrieved = 0;
+
+  if(xsfq->nMetaDataBytes == 0) return 0;
+
+  for(i = 0; i < (uint64_t) nElements + 2*XORSATFILTER_BATCH_DISTANCE; i++) {
+    if(i < nElements) {
+      XORSATFilterHash pHash = (pHashes != NULL) ? pHashes[i] : XORSATFilterGenerateHashesFromElement(ppElements[i], pElementBytes[i]);
+      XORSATFilterBatchStage1(xsfq, &pStates[i & (XORSATFILTER_BATCH_RING-1)], pHash);
+    }
+
+    if(i >= XORSATFILTER_BATCH_DISTANCE && i - XORSATFILTER_BATCH_DISTANCE < nElements) {
+      uint64_t j = i - XORSATFILTER_BATCH_DISTANCE;
+      XORSATFilterBatchStage2(xsfq, &pStates[j & (XORSATFILTER_BATCH_RING-1)], 1);
+    }
+
+    if(i >= 2*XORSATFILTER_BATCH_DISTANCE) {
+      uint64_t j = i - 2*XORSATFILTER_BATCH_DISTANCE;
+      nRetrieved += XORSATFilterBatchStage3Retrieve(xsfq, &pStates[j & (XORSATFILTER_BATCH_RING-1)], pMetaData + (j * xsfq->nMetaDataBytes));
+    }
+  }
+
+  return nRetrieved;
+}
+
+//Writes the metadata of element i to pMetaData[i*nMetaDataBytes ... (i+1)*nMetaDataBytes - 1].
+//Returns the number of elements for which metadata was retrieved (see XORSATFilterRetrieveMetadataHashInto).
+uint32_t XORSATFilterRetrieveMetadataBatch(const XORSATFilterQuerier *xsfq, const void * const *ppElements, const uint32_t *pElementBytes, uint32_t nElements, uint8_t *pMetaData) {
+  return XORSATFilterRetrieveMetadataBatchInternal(xsfq, ppElements, pElementBytes, NULL, nElements, pMetaData);
+}
+
+uint32_t XORSATFilterRetrieveMetadataHashBatch(const XORSATFilterQuerier *xsfq, const XORSATFilterHash *pHashes, uint32_t nHashes, uint8_t *pMetaData) {
+  return XORSATFilterRetrieveMetadataBatchInternal(xsfq, NULL, NULL, pHashes, nHashes, pMetaData);
 }
 
 /*************************************************************************************
@@ -392,36 +1232,256 @@ uint8_t *XORSATFilterRetrieveMetadata(XORSATFilterQuerier *xsfq, const void *pEl
 
 **************************************************************************************/
 
-uint32_t XORSATFilterQueryRate(XORSATFilterQuerier *xsfq) {
+//Rates are measured in wall-clock time; clock() sums CPU time over all threads.
+double XORSATFilterWallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + ((double) ts.tv_nsec * 1e-9);
+}
+
+uint32_t XORSATFilterQueryRate(const XORSATFilterQuerier *xsfq) {
   uint32_t i, j;
   uint32_t nElementsQueried = 10000000;
 
-  clock_t start = clock();
+  double start = XORSATFilterWallTime();
   for(i = 0; i < nElementsQueried; i++) {
     uint8_t volatile ret = XORSATFilterQuery(xsfq, &i, sizeof(uint32_t));
   }
-  clock_t end = clock();
+  double end = XORSATFilterWallTime();
   
-  double time_elapsed_in_seconds = ((double) (end - start)) / (double) CLOCKS_PER_SEC;
+  double time_elapsed_in_seconds = end - start;
   return (uint32_t) (((double) nElementsQueried) / time_elapsed_in_seconds);
 }
 
-uint32_t XORSATFilterMetadataRetrievalRate(XORSATFilterQuerier *xsfq, uint32_t nElementBytes) {
+uint32_t XORSATFilterQueryBatchRate(const XORSATFilterQuerier *xsfq) {
+  uint32_t i, j;
+  uint32_t nElementsQueried = 10000000;
+  uint32_t nBatchSize = 4096;
+
+  uint32_t *pElements = (uint32_t *)malloc(nBatchSize * sizeof(uint32_t));
+  const void **ppElements = (const void **)malloc(nBatchSize * sizeof(void *));
+  uint32_t *pElementBytes = (uint32_t *)malloc(nBatchSize * sizeof(uint32_t));
+  uint8_t *pResults = (uint8_t *)malloc((nBatchSize + 7) >> 3);
+  if(pElements == NULL || ppElements == NULL || pElementBytes == NULL || pResults == NULL) {
+    free(pElements); free(ppElements); free(pElementBytes); free(pResults);
+    return 0;
+  }
+
+  for(j = 0; j < nBatchSize; j++) {
+    ppElements[j] = &pElements[j];
+    pElementBytes[j] = sizeof(uint32_t);
+  }
+
+  uint32_t volatile nSink = 0;
+  double start = XORSATFilterWallTime();
+  for(i = 0; i < nElementsQueried; i += nBatchSize) {
+    for(j = 0; j < nBatchSize; j++) {
+      pElements[j] = i + j;
+    }
+    nSink = XORSATFilterQueryBatch(xsfq, ppElements, pElementBytes, nBatchSize, pResults);
+  }
+  double end = XORSATFilterWallTime();
+  (void) nSink;
+
+  free(pElements);
+  free(ppElements);
+  free(pElementBytes);
+  free(pResults);
+
+  double time_elapsed_in_seconds = end - start;
+  return (uint32_t) (((double) i) / time_elapsed_in_seconds);
+}
+
+//Threads of XORSATFilterQueryRateThreads wait for bGo before querying
+typedef struct XORSATFilterRateStart {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint8_t bGo;
+} XORSATFilterRateStart;
+
+//Per-thread state for XORSATFilterQueryRateThreads, one cache line
+//each so threads recording their times don't share lines.
+typedef struct XORSATFilterRateThread {
+  const XORSATFilterQuerier *xsfq;
+  const cpu_set_t *pCPUs;
+  XORSATFilterRateStart *pStart;
+  uint32_t nFirstElement;
+  uint32_t nElementsQueried;
+  double fStart;
+  double fEnd;
+} __attribute__((aligned(64))) XORSATFilterRateThread;
+
+static
+void *XORSATFilterQueryRateThread(void *pArg) {
+  XORSATFilterRateThread *pThread = (XORSATFilterRateThread *) pArg;
+  uint32_t i;
+  uint32_t nLast = pThread->nFirstElement + pThread->nElementsQueried;
+
+  if(pThread->pCPUs != NULL) {
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), pThread->pCPUs);
+  }
+
+  pthread_mutex_lock(&pThread->pStart->mutex);
+  while(!pThread->pStart->bGo) {
+    pthread_cond_wait(&pThread->pStart->cond, &pThread->pStart->mutex);
+  }
+  pthread_mutex_unlock(&pThread->pStart->mutex);
+
+  //Stores to a volatile sink keep the queries from being optimized out
+  uint8_t volatile nSink = 0;
+  pThread->fStart = XORSATFilterWallTime();
+  for(i = pThread->nFirstElement; i < nLast; i++) {
+    nSink = XORSATFilterQuery(pThread->xsfq, &i, sizeof(uint32_t));
+  }
+  pThread->fEnd = XORSATFilterWallTime();
+  (void) nSink;
+
+  return NULL;
+}
+
+//Queries from nThreads threads at once, thread t querying
+//ppQueriers[t] with its own elements, pinned to ppCPUs[t] if ppCPUs is
+//not NULL. Returns the aggregate number of queries per second over the
+//wall-clock time from the first thread starting to the last one
+//finishing, or 0 on error. If pThreadRates is not NULL, pThreadRates[t]
+//is set to thread t's rate. Shared by XORSATFilterQueryRateParallel and
+//XORSATFilterNUMAQueryRate.
+uint64_t XORSATFilterQueryRateThreads(const XORSATFilterQuerier **ppQueriers, const cpu_set_t **ppCPUs, uint32_t nThreads, uint32_t *pThreadRates) {
+  uint32_t t, nCreated;
+  uint32_t nElementsPerThread = 4000000;
+  XORSATFilterRateThread *pThreads;
+  pthread_t *pThreadIDs;
+  XORSATFilterRateStart start = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .bGo = 0};
+
+  if(nThreads == 0) return 0;
+
+  if(posix_memalign((void **) &pThreads, 64, nThreads * sizeof(XORSATFilterRateThread)) != 0) return 0;
+  pThreadIDs = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
+  if(pThreadIDs == NULL) {
+    free(pThreads);
+    return 0;
+  }
+
+  for(nCreated = 0; nCreated < nThreads; nCreated++) {
+    pThreads[nCreated].xsfq = ppQueriers[nCreated];
+    pThreads[nCreated].pCPUs = (ppCPUs != NULL) ? ppCPUs[nCreated] : NULL;
+    pThreads[nCreated].pStart = &start;
+    pThreads[nCreated].nFirstElement = nCreated * nElementsPerThread;
+    pThreads[nCreated].nElementsQueried = nElementsPerThread;
+    if(pthread_create(&pThreadIDs[nCreated], NULL, XORSATFilterQueryRateThread, &pThreads[nCreated]) != 0) {
+      break;
+    }
+  }
+
+  //Release all threads together
+  pthread_mutex_lock(&start.mutex);
+  start.bGo = 1;
+  pthread_cond_broadcast(&start.cond);
+  pthread_mutex_unlock(&start.mutex);
+
+  double fFirstStart = 0.0, fLastEnd = 0.0;
+  for(t = 0; t < nCreated; t++) {
+    pthread_join(pThreadIDs[t], NULL);
+    if(t == 0 || pThreads[t].fStart < fFirstStart) fFirstStart = pThreads[t].fStart;
+    if(t == 0 || pThreads[t].fEnd > fLastEnd) fLastEnd = pThreads[t].fEnd;
+    if(pThreadRates != NULL) {
+      pThreadRates[t] = (uint32_t) (((double) nElementsPerThread) / (pThreads[t].fEnd - pThreads[t].fStart));
+    }
+  }
+
+  free(pThreadIDs);
+  free(pThreads);
+
+  if(nCreated != nThreads) {
+    fprintf(stderr, "Error: could only create %u of %u query threads\n", nCreated, nThreads);
+    return 0;
+  }
+
+  return (uint64_t) (((double) nElementsPerThread * nThreads) / (fLastEnd - fFirstStart));
+}
+
+//Queries from nThreads threads at once, each querying its own elements.
+//Returns the aggregate number of queries per second over the wall-clock
+//time from the first thread starting to the last one finishing, or 0 on error.
+//If pThreadRates is not NULL, pThreadRates[t] is set to thread t's rate.
+uint64_t XORSATFilterQueryRateParallel(const XORSATFilterQuerier *xsfq, uint32_t nThreads, uint32_t *pThreadRates) {
+  uint32_t t;
+
+  if(nThreads == 0) return 0;
+
+  const XORSATFilterQuerier **ppQueriers = (const XORSATFilterQuerier **)malloc(nThreads * sizeof(XORSATFilterQuerier *));
+  if(ppQueriers == NULL) return 0;
+  for(t = 0; t < nThreads; t++) {
+    ppQueriers[t] = xsfq;
+  }
+
+  uint64_t nRate = XORSATFilterQueryRateThreads(ppQueriers, NULL, nThreads, pThreadRates);
+  free(ppQueriers);
+
+  return nRate;
+}
+
+uint32_t XORSATFilterMetadataRetrievalRate(const XORSATFilterQuerier *xsfq, uint32_t nElementBytes) {
   uint32_t i, j;
   uint32_t nElementsQueried = 10000000;
 
-  clock_t start = clock();
+  uint8_t *pMetaData = (uint8_t *)malloc(xsfq->nMetaDataBytes + 1);
+  if(pMetaData == NULL) return 0;
+
+  uint8_t volatile nSink = 0;
+  double start = XORSATFilterWallTime();
   for(i = 0; i < nElementsQueried; i++) {
-    uint8_t * volatile ret = XORSATFilterRetrieveMetadata(xsfq, &i, nElementBytes);
-    free(ret);
+    nSink = XORSATFilterRetrieveMetadataInto(xsfq, &i, nElementBytes, pMetaData);
   }
-  clock_t end = clock();
+  double end = XORSATFilterWallTime();
+  (void) nSink;
+
+  free(pMetaData);
   
-  double time_elapsed_in_seconds = ((double) (end - start)) / (double) CLOCKS_PER_SEC;
+  double time_elapsed_in_seconds = end - start;
   return (uint32_t) (((double) nElementsQueried) / time_elapsed_in_seconds);
 }
 
-double XORSATFilterFalsePositiveRate(XORSATFilterQuerier *xsfq) {
+uint32_t XORSATFilterMetadataRetrievalBatchRate(const XORSATFilterQuerier *xsfq) {
+  uint32_t i, j;
+  uint32_t nElementsQueried = 10000000;
+  uint32_t nBatchSize = 4096;
+
+  uint32_t *pElements = (uint32_t *)malloc(nBatchSize * sizeof(uint32_t));
+  const void **ppElements = (const void **)malloc(nBatchSize * sizeof(void *));
+  uint32_t *pElementBytes = (uint32_t *)malloc(nBatchSize * sizeof(uint32_t));
+  uint8_t *pMetaData = (uint8_t *)malloc(nBatchSize * xsfq->nMetaDataBytes + 1);
+  if(pElements == NULL || ppElements == NULL || pElementBytes == NULL || pMetaData == NULL) {
+    free(pElements); free(ppElements); free(pElementBytes); free(pMetaData);
+    return 0;
+  }
+
+  for(j = 0; j < nBatchSize; j++) {
+    ppElements[j] = &pElements[j];
+    pElementBytes[j] = sizeof(uint32_t);
+  }
+
+  uint32_t volatile nSink = 0;
+  double start = XORSATFilterWallTime();
+  for(i = 0; i < nElementsQueried; i += nBatchSize) {
+    for(j = 0; j < nBatchSize; j++) {
+      pElements[j] = i + j;
+    }
+    nSink = XORSATFilterRetrieveMetadataBatch(xsfq, ppElements, pElementBytes, nBatchSize, pMetaData);
+  }
+  double end = XORSATFilterWallTime();
+  (void) nSink;
+
+  free(pElements);
+  free(ppElements);
+  free(pElementBytes);
+  free(pMetaData);
+
+  double time_elapsed_in_seconds = end - start;
+  return (uint32_t) (((double) i) / time_elapsed_in_seconds);
+}
+
+double XORSATFilterFalsePositiveRate(const XORSATFilterQuerier *xsfq) {
   uint32_t nNoes = 0;
   uint32_t i = 0;
   uint32_t nElementBytes = sizeof(uint32_t);
@@ -436,7 +1496,7 @@ double XORSATFilterFalsePositiveRate(XORSATFilterQuerier *xsfq) {
   return p;
 }
 
-uint64_t XORSATAncillarySize(XORSATFilterQuerier *xsfq) {
+uint64_t XORSATAncillarySize(const XORSATFilterQuerier *xsfq) {
   uint64_t i;
   uint64_t nAncillaryBits = 0;
   nAncillaryBits += ((uint64_t) xsfq->nBlocks + 1) * (uint64_t) 16;
@@ -445,7 +1505,7 @@ uint64_t XORSATAncillarySize(XORSATFilterQuerier *xsfq) {
   return nAncillaryBits;
 }
 
-uint64_t XORSATFilterSize(XORSATFilterQuerier *xsfq) {
+uint64_t XORSATFilterSize(const XORSATFilterQuerier *xsfq) {
   uint64_t i;
   uint64_t nFilterBits = 0;
   uint32_t nRHSBits = ((uint32_t) xsfq->nSolutions) + (xsfq->nMetaDataBytes*8);
@@ -459,7 +1519,7 @@ uint64_t XORSATFilterSize(XORSATFilterQuerier *xsfq) {
   return nFilterBits;
 }
 
-uint64_t XORSATMetaDataSize(XORSATFilterQuerier *xsfq) {
+uint64_t XORSATMetaDataSize(const XORSATFilterQuerier *xsfq) {
   uint64_t i;
   uint64_t nMetaDataBits = 0;
   uint32_t nRHSBits = ((uint32_t) xsfq->nSolutions) + (xsfq->nMetaDataBytes*8);
@@ -473,7 +1533,7 @@ uint64_t XORSATMetaDataSize(XORSATFilterQuerier *xsfq) {
   return nMetaDataBits;
 }
 
-double XORSATFilterEfficiency(XORSATFilterQuerier *xsfq, uint64_t nElements, double p) {
+double XORSATFilterEfficiency(const XORSATFilterQuerier *xsfq, uint64_t nElements, double p) {
   if(p == 0.0) {
     p = XORSATFilterFalsePositiveRate(xsfq);
   }
@@ -484,7 +1544,7 @@ double XORSATFilterEfficiency(XORSATFilterQuerier *xsfq, uint64_t nElements, dou
   return (-(log(p) / log(2))) * (((double)nElements) / ((double)nFilterBits));
 }
 
-double XORSATMetaDataEfficiency(XORSATFilterQuerier *xsfq, uint64_t nElements) {
+double XORSATMetaDataEfficiency(const XORSATFilterQuerier *xsfq, uint64_t nElements) {
   uint64_t nMetaDataBits = XORSATMetaDataSize(xsfq);
   nMetaDataBits += XORSATAncillarySize(xsfq);
 
@@ -0,0 +1,109 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#include "xorsat_filter.h"
+
+//Solves a block of ribbon rows (nLitsPerRow XORSATFILTER_RIBBON)
+//without building a dense matrix, by the on-the-fly Gaussian
+//elimination of Dietzfelbinger and Walzer. Every variable has a slot
+//for at most one row whose band starts there. A row is inserted at
+//the start of its band; if that slot is taken, the stored row is
+//XORed in, which clears the row's first bit, and the row moves on to
+//its new first variable. Each insertion visits at most
+//XORSATFILTER_RIBBON_WIDTH slots and back substitution reads each
+//stored band once, so solving takes O(m * XORSATFILTER_RIBBON_WIDTH)
+//time instead of the O(m * n^2 / 64) of gf2_semi_ech.
+//
+//Fills pBlock->pSolutionsCompressed, nRHSBits per variable. Returns 1
+//on success, 0 if the rows are unsatisfiable (the block needs more
+//variables) and 2 if memory couldn't be allocated. Works in pScratch.
+uint8_t XORSATFilterFindRibbonSolutions(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch) {
+  size_t i;
+  uint32_t j, k;
+  uint32_t nVariables = pBlock->nVariables;
+  uint32_t nRHSBits = pBlock->nSolutions + (pBlock->nMetaDataBytes * 8);
+  uint32_t nRHSWords = (nRHSBits + 63) >> 6;
+  uint64_t pRowRHS[nRHSWords + 1];
+
+  if(nVariables < XORSATFILTER_RIBBON_WIDTH) return 0;
+
+  //Slot v holds a row's band (bit 0 set, so 0 means empty) and its right
+  //hand side, which back substitution replaces with variable v's solution
+  uint64_t *pBands = (uint64_t *)XORSATFilterScratchZeroed(pScratch, XORSATFILTER_SCRATCH_BANDS, (size_t) nVariables * 2 * sizeof(uint64_t));
+  uint64_t *pRHS = (uint64_t *)XORSATFilterScratchZeroed(pScratch, XORSATFILTER_SCRATCH_SOLUTIONS, (size_t) nVariables * nRHSWords * sizeof(uint64_t));
+  if(pBands == NULL || pRHS == NULL) return 2;
+
+  for(i = 0; i < pBlock->pHashes.nLength; i++) {
+    XORSATFilterRibbonRow xsfrow = XORSATFilterRowFromHash_Ribbon(pBlock->pHashes.pList[i], nVariables, pBlock->nFormat);
+    uint64_t c0 = xsfrow.c[0];
+    uint64_t c1 = xsfrow.c[1];
+    uint32_t v = xsfrow.nStart;
+    XORSATFilterBlockRowRHS(pBlock, i, xsfrow.rhs, pRowRHS, nRHSWords);
+
+    while(1) {
+      uint64_t *pBand = pBands + ((size_t) v * 2);
+      uint64_t *pSlotRHS = pRHS + ((size_t) v * nRHSWords);
+      if(pBand[0] == 0) {
+        pBand[0] = c0;
+        pBand[1] = c1;
+        memcpy(pSlotRHS, pRowRHS, nRHSWords * sizeof(uint64_t));
+        break;
+      }
+
+      c0 ^= pBand[0];
+      c1 ^= pBand[1];
+      uint64_t nRHSDiff = 0;
+      for(k = 0; k < nRHSWords; k++) {
+        pRowRHS[k] ^= pSlotRHS[k];
+        nRHSDiff |= pRowRHS[k];
+      }
+
+      if(c0 == 0) {
+        if(c1 == 0) {
+          if(nRHSDiff == 0) break; //Implied by rows already inserted
+          return 0; //UNSAT
+        }
+        c0 = c1;
+        c1 = 0;
+        v += 64;
+      }
+
+      j = __builtin_ctzll(c0);
+      c0 = (c0 >> j) | ((c1 << 1) << (63 - j));
+      c1 >>= j;
+      v += j;
+    }
+  }
+
+  //Back substitution, last variable first. Free variables are random.
+  for(i = nVariables; i-- > 0; ) {
+    const uint64_t *pBand = pBands + (i * 2);
+    uint64_t *pSolution = pRHS + (i * nRHSWords);
+
+    if(pBand[0] == 0) {
+      for(k = 0; k < nRHSWords; k++) {
+        pSolution[k] = XORSATFilterRandom(&pBlock->nRandomState);
+      }
+      continue;
+    }
+
+    uint64_t c = pBand[0] & ~(uint64_t) 1;
+    for(j = 0; j < 2; j++) {
+      while(c) {
+        const uint64_t *pOther = pSolution + ((size_t) ((j << 6) + __builtin_ctzll(c)) * nRHSWords);
+        for(k = 0; k < nRHSWords; k++) {
+          pSolution[k] ^= pOther[k];
+        }
+        c &= c - 1;
+      }
+      c = pBand[1];
+    }
+  }
+
+  if(XORSATFilterBlockCompressSolutions(pBlock, pRHS, nRHSWords) != 0) return 2;
+
+  return 1;
+}
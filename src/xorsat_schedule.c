@@ -0,0 +1,296 @@
+/**************************************************************************************
+
+  XORSAT Filter: A library for building and querying k-XORSAT set-membership filters.
+
+**************************************************************************************/
+
+#define _GNU_SOURCE //sched_getaffinity, pthread_setaffinity_np
+#include <sched.h>
+
+#include "xorsat_filter.h"
+
+//How long a block takes to solve grows with its number of elements in
+//every format, faster than linearly for dense elimination. Blocks are
+//handed out most elements first from a single shared cursor, so every
+//idle worker takes the largest block left. The blocks that would
+//otherwise be solved last, while the other workers wait, are the
+//smallest. Blocks are independent, their sizes are known before any
+//is solved and each takes far longer than taking it from the cursor,
+//so per-worker queues with stealing would balance them no better.
+
+/*************************************************************************************
+
+  Scratch
+
+**************************************************************************************/
+
+//Returns nBuffer of pScratch, grown to at least nBytes. Its contents
+//are whatever was left there. Buffers are aligned to 64 bytes, as
+//gf2_init aligns the matrices it allocates. Returns NULL if it couldn't
+//be grown.
+void *XORSATFilterScratchBuffer(XORSATFilterScratch *pScratch, uint32_t nBuffer, size_t nBytes) {
+  if(nBytes == 0) nBytes = 1; //So that NULL only means failure
+  if(nBytes > pScratch->pBufferBytes[nBuffer]) {
+    //The contents aren't kept, so there's nothing for realloc to copy
+    free(pScratch->ppBuffers[nBuffer]);
+    if(nBytes < 2 * pScratch->pBufferBytes[nBuffer]) nBytes = 2 * pScratch->pBufferBytes[nBuffer];
+    if(posix_memalign(&pScratch->ppBuffers[nBuffer], 64, nBytes) != 0) pScratch->ppBuffers[nBuffer] = NULL;
+    pScratch->pBufferBytes[nBuffer] = (pScratch->ppBuffers[nBuffer] == NULL) ? 0 : nBytes;
+  }
+  return pScratch->ppBuffers[nBuffer];
+}
+
+//As XORSATFilterScratchBuffer, with its first nBytes set to zero
+void *XORSATFilterScratchZeroed(XORSATFilterScratch *pScratch, uint32_t nBuffer, size_t nBytes) {
+  void *pBuffer = XORSATFilterScratchBuffer(pScratch, nBuffer, nBytes);
+  if(pBuffer != NULL) memset(pBuffer, 0, nBytes);
+  return pBuffer;
+}
+
+void XORSATFilterScratchFree(XORSATFilterScratch *pScratch) {
+  uint32_t i;
+  for(i = 0; i < XORSATFILTER_SCRATCH_BUFFERS; i++) {
+    free(pScratch->ppBuffers[i]);
+    pScratch->ppBuffers[i] = NULL;
+    pScratch->pBufferBytes[i] = 0;
+  }
+}
+
+/*************************************************************************************
+
+  Scheduler
+
+**************************************************************************************/
+
+typedef struct XORSATFilterSchedule {
+  XORSATFilterBlock *pBlocks;
+  uint32_t nBlocks;
+  const uint64_t *pOrder;  //Elements << 32 | block, most elements first. NULL for block order
+  uint32_t nNext;          //Next entry of pOrder to solve
+} XORSATFilterSchedule;
+
+typedef struct XORSATFilterWorker {
+  XORSATFilterSchedule *pSchedule;
+  XORSATFilterScratch *pScratch;
+  int32_t nCPU;
+} XORSATFilterWorker;
+
+static
+void *XORSATFilterWorkerRun(void *pArg) {
+  XORSATFilterWorker *pWorker = (XORSATFilterWorker *) pArg;
+  XORSATFilterSchedule *pSchedule = pWorker->pSchedule;
+
+  if(pWorker->nCPU >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(pWorker->nCPU, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+  }
+
+  while(1) {
+    uint32_t i = __atomic_fetch_add(&pSchedule->nNext, 1, __ATOMIC_RELAXED);
+    if(i >= pSchedule->nBlocks) break;
+    uint32_t nBlock = (pSchedule->pOrder == NULL) ? i : (uint32_t) pSchedule->pOrder[i];
+    XORSATFilterSolveBlock(&pSchedule->pBlocks[nBlock], pWorker->pScratch);
+  }
+
+  return NULL;
+}
+
+static
+int XORSATFilterCompareDescending(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x < y) - (x > y);
+}
+
+//Returns a scheduler of nThreads workers (see XORSATFilterScheduler),
+//or NULL if it couldn't be allocated.
+XORSATFilterScheduler *XORSATFilterSchedulerAlloc(uint32_t nThreads, uint8_t bPinThreads) {
+  uint32_t i;
+
+  if(nThreads == 0) nThreads = 1;
+
+  XORSATFilterScheduler *pScheduler = (XORSATFilterScheduler *)malloc(sizeof(XORSATFilterScheduler));
+  if(pScheduler == NULL) return NULL;
+  pScheduler->nThreads = nThreads;
+  pScheduler->pCPUs = (int32_t *)malloc(nThreads * sizeof(int32_t));
+  pScheduler->pScratch = (XORSATFilterScratch *)calloc(nThreads, sizeof(XORSATFilterScratch));
+  if(pScheduler->pCPUs == NULL || pScheduler->pScratch == NULL) {
+    XORSATFilterSchedulerFree(pScheduler);
+    return NULL;
+  }
+
+  for(i = 0; i < nThreads; i++) {
+    pScheduler->pCPUs[i] = -1;
+  }
+
+  cpu_set_t cpus;
+  if(bPinThreads && sched_getaffinity(0, sizeof(cpu_set_t), &cpus) == 0 && CPU_COUNT(&cpus) > 0) {
+    int32_t nCPU = -1;
+    for(i = 0; i < nThreads; i++) {
+      do {
+        nCPU = (nCPU + 1) % CPU_SETSIZE;
+      } while(!CPU_ISSET(nCPU, &cpus));
+      pScheduler->pCPUs[i] = nCPU;
+    }
+  }
+
+  return pScheduler;
+}
+
+//Solves nBlocks blocks with XORSATFilterSolveBlock on the scheduler's
+//workers, those with the most elements first. If no thread can be
+//started, the blocks are solved on the calling thread instead.
+void XORSATFilterSchedulerRun(XORSATFilterScheduler *pScheduler, XORSATFilterBlock *pBlocks, uint32_t nBlocks) {
+  uint32_t i, nCreated = 0;
+  uint32_t nThreads = (nBlocks < pScheduler->nThreads) ? nBlocks : pScheduler->nThreads;
+
+  if(nBlocks == 0) return;
+
+  //Without the order, blocks are solved as they come
+  uint64_t *pOrder = (uint64_t *)malloc(nBlocks * sizeof(uint64_t));
+  if(pOrder != NULL) {
+    for(i = 0; i < nBlocks; i++) {
+      pOrder[i] = ((uint64_t) pBlocks[i].pHashes.nLength << 32) | i;
+    }
+    qsort(pOrder, nBlocks, sizeof(uint64_t), XORSATFilterCompareDescending);
+  }
+
+  XORSATFilterSchedule sSchedule = {.pBlocks = pBlocks, .nBlocks = nBlocks, .pOrder = pOrder, .nNext = 0};
+  XORSATFilterWorker pWorkers[nThreads];
+  pthread_t pThreadIDs[nThreads];
+
+  for(i = 0; i < nThreads; i++) {
+    pWorkers[i].pSchedule = &sSchedule;
+    pWorkers[i].pScratch = &pScheduler->pScratch[i];
+    pWorkers[i].nCPU = pScheduler->pCPUs[i];
+  }
+
+  for(; nCreated < nThreads; nCreated++) {
+    if(pthread_create(&pThreadIDs[nCreated], NULL, XORSATFilterWorkerRun, &pWorkers[nCreated]) != 0) break;
+  }
+
+  if(nCreated == 0) {
+    //The calling thread keeps its own affinity
+    pWorkers[0].nCPU = -1;
+    XORSATFilterWorkerRun(&pWorkers[0]);
+  }
+
+  for(i = 0; i < nCreated; i++) {
+    pthread_join(pThreadIDs[i], NULL);
+  }
+
+  free(pOrder);
+}
+
+void XORSATFilterSchedulerFree(XORSATFilterScheduler *pScheduler) {
+  uint32_t i;
+
+  if(pScheduler == NULL) return;
+
+  if(pScheduler->pScratch != NULL) {
+    for(i = 0; i < pScheduler->nThreads; i++) {
+      XORSATFilterScratchFree(&pScheduler->pScratch[i]);
+    }
+  }
+  free(pScheduler->pScratch);
+  free(pScheduler->pCPUs);
+  free(pScheduler);
+}
+
+/*************************************************************************************
+
+  Thread count
+
+**************************************************************************************/
+
+//CPUs' worth of time per period a cgroup v2 cpu.max allows, 0 if it
+//isn't limited or the file can't be read
+static
+double XORSATFilterCgroupV2CPUs(const char *pDirectory) {
+  char pPath[4096];
+  char pQuota[32];
+  double fPeriod;
+  double fCPUs = 0;
+
+  //A truncated path would name some other file
+  if(snprintf(pPath, sizeof(pPath), "%s/cpu.max", pDirectory) >= (int) sizeof(pPath)) return 0;
+  FILE *pFile = fopen(pPath, "r");
+  if(pFile == NULL) return 0;
+  if(fscanf(pFile, "%31s %lf", pQuota, &fPeriod) == 2 && strcmp(pQuota, "max") != 0 && fPeriod > 0) {
+    fCPUs = atof(pQuota) / fPeriod;
+  }
+  fclose(pFile);
+
+  return fCPUs;
+}
+
+//CPUs' worth of time the cgroup of the process may use, 0 if unlimited
+//or unknown. Under cgroup v2 the limits of the process's cgroup and of
+//each cgroup above it apply, and the smallest is returned. Under v1
+//only the limit of the cpu controller's mount is read.
+static
+double XORSATFilterCgroupCPUs(void) {
+  char pLine[4096];
+  char pDirectory[4096];
+  double fCPUs = 0, fLimit;
+
+  FILE *pFile = fopen("/proc/self/cgroup", "r");
+  if(pFile != NULL) {
+    while(fgets(pLine, sizeof(pLine), pFile) != NULL) {
+      if(strncmp(pLine, "0::", 3) != 0) continue;
+      pLine[strcspn(pLine, "\n")] = '\0';
+      //Skip a cgroup whose path doesn't fit rather than probe a truncated one
+      if(snprintf(pDirectory, sizeof(pDirectory), "/sys/fs/cgroup%s", pLine + 3) >= (int) sizeof(pDirectory)) break;
+      while(strlen(pDirectory) > strlen("/sys/fs/cgroup")) {
+        fLimit = XORSATFilterCgroupV2CPUs(pDirectory);
+        if(fLimit > 0 && (fCPUs == 0 || fLimit < fCPUs)) fCPUs = fLimit;
+        *strrchr(pDirectory, '/') = '\0';
+      }
+      break;
+    }
+    fclose(pFile);
+  }
+
+  //A container usually sees its own cgroup as the root
+  fLimit = XORSATFilterCgroupV2CPUs("/sys/fs/cgroup");
+  if(fLimit > 0 && (fCPUs == 0 || fLimit < fCPUs)) fCPUs = fLimit;
+  if(fCPUs > 0) return fCPUs;
+
+  long long nQuota = -1, nPeriod = 0;
+  pFile = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+  if(pFile != NULL) {
+    if(fscanf(pFile, "%lld", &nQuota) != 1) nQuota = -1;
+    fclose(pFile);
+  }
+  pFile = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+  if(pFile != NULL) {
+    if(fscanf(pFile, "%lld", &nPeriod) != 1) nPeriod = 0;
+    fclose(pFile);
+  }
+  if(nQuota > 0 && nPeriod > 0) return (double) nQuota / (double) nPeriod;
+
+  return 0;
+}
+
+//Threads to build with when none are given: the CPUs the process may
+//run on, or fewer if its cgroup's CPU quota allows less time than that
+//(rounded up, so a quota of 1.5 CPUs gives 2 threads). At least 1.
+uint32_t XORSATFilterDefaultThreads(void) {
+  uint32_t nThreads = 0;
+
+  cpu_set_t cpus;
+  if(sched_getaffinity(0, sizeof(cpu_set_t), &cpus) == 0) {
+    nThreads = (uint32_t) CPU_COUNT(&cpus);
+  }
+  if(nThreads == 0) {
+    long nOnline = sysconf(_SC_NPROCESSORS_ONLN);
+    nThreads = (nOnline > 0) ? (uint32_t) nOnline : 1;
+  }
+
+  double fCPUs = XORSATFilterCgroupCPUs();
+  if(fCPUs > 0 && ceil(fCPUs) < nThreads) nThreads = (uint32_t) ceil(fCPUs);
+
+  return (nThreads == 0) ? 1 : nThreads;
+}
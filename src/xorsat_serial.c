@@ -6,7 +6,7 @@
 
 #include "xorsat_filter.h"
 
-uint8_t XORSATFilterSerialize(FILE *pXORSATFilterFile, XORSATFilterQuerier *xsfq) {
+uint8_t XORSATFilterSerialize(FILE *pXORSATFilterFile, const XORSATFilterQuerier *xsfq) {
   if(pXORSATFilterFile == NULL) return 1; //Failure
 
   size_t write;
@@ -17,25 +17,90 @@ uint8_t XORSATFilterSerialize(FILE *pXORSATFilterFile, XORSATFilterQuerier *xsfq
   write = fwrite(xsfq->pFilter, sizeof(uint64_t), nFilterWords, pXORSATFilterFile);
   if(write != nFilterWords) return 1; //Failure
 
+  return XORSATFilterSerializeOffsets(pXORSATFilterFile, xsfq);
+}
+
+//Writes what follows the filter's words in a serialized filter: the
+//block offsets and the header. Builds that write the filter's words
+//themselves (see XORSATFilterBuilderFinalizeToFile) finish with this.
+uint8_t XORSATFilterSerializeOffsets(FILE *pXORSATFilterFile, const XORSATFilterQuerier *xsfq) {
+  size_t write;
+
   //Write block offsets from expected
   write = fwrite(xsfq->pOffsets, sizeof(int16_t), xsfq->nBlocks+1, pXORSATFilterFile);
   if(write != (xsfq->nBlocks+1)) return 1; //Failure
 
-  //Write filter header
-  XORSATFilterSerialData xsfsd = {.nBlocks = xsfq->nBlocks,
-				  .nAvgVarsPerBlock = xsfq->nAvgVarsPerBlock,
-				  .nSolutions = xsfq->nSolutions,
-				  .nMetaDataBytes = xsfq->nMetaDataBytes,
-				  .nLitsPerRow = xsfq->nLitsPerRow};
+  //Write filter header, its padding zeroed so equal filters serialize to equal bytes
+  XORSATFilterSerialData xsfsd;
+  memset(&xsfsd, 0, sizeof(XORSATFilterSerialData));
+  xsfsd.nBlocks = xsfq->nBlocks;
+  xsfsd.nAvgVarsPerBlock = xsfq->nAvgVarsPerBlock;
+  xsfsd.nSolutions = xsfq->nSolutions;
+  xsfsd.nMetaDataBytes = xsfq->nMetaDataBytes;
+  xsfsd.nLitsPerRow = xsfq->nLitsPerRow | (xsfq->nFormat << XORSATFILTER_SERIAL_FORMAT_SHIFT);
   write = fwrite(&xsfsd, sizeof(XORSATFilterSerialData), 1, pXORSATFilterFile);
   if(write != 1) return 1; //Failure
 
   return 0; //Success
 }
 
+//Reads one word from every page of its share of the mapping
+typedef struct XORSATFilterPretouchThread {
+  const volatile uint8_t *pStart;
+  size_t nBytes;
+} XORSATFilterPretouchThread;
+
+static
+void *XORSATFilterPretouchRange(void *pArg) {
+  XORSATFilterPretouchThread *pThread = (XORSATFilterPretouchThread *) pArg;
+  size_t i;
+  uint8_t nSum = 0;
+  for(i = 0; i < pThread->nBytes; i += 4096) {
+    nSum += pThread->pStart[i];
+  }
+  return (void *) (uintptr_t) nSum;
+}
+
+static
+void XORSATFilterPretouch(const uint8_t *pMap, size_t nBytes, uint32_t nThreads) {
+  uint32_t t;
+  if(nThreads == 0) nThreads = 1;
+
+  XORSATFilterPretouchThread pThreads[nThreads];
+  pthread_t pThreadIDs[nThreads];
+  uint8_t pCreated[nThreads];
+  //Split at page boundaries
+  size_t nPerThread = (((nBytes / nThreads) + 4095) / 4096) * 4096;
+
+  for(t = 0; t < nThreads; t++) {
+    size_t nStart = (size_t) t * nPerThread;
+    pThreads[t].pStart = pMap + nStart;
+    pThreads[t].nBytes = (nStart >= nBytes) ? 0 : ((nBytes - nStart < nPerThread) ? nBytes - nStart : nPerThread);
+    pCreated[t] = (t > 0) && (pthread_create(&pThreadIDs[t], NULL, XORSATFilterPretouchRange, &pThreads[t]) == 0);
+  }
+
+  //The calling thread takes the first range, and any whose thread failed to start
+  XORSATFilterPretouchRange(&pThreads[0]);
+  for(t = 1; t < nThreads; t++) {
+    if(pCreated[t]) {
+      pthread_join(pThreadIDs[t], NULL);
+    } else {
+      XORSATFilterPretouchRange(&pThreads[t]);
+    }
+  }
+}
+
 XORSATFilterQuerier *XORSATFilterDeserialize(FILE *pXORSATFilterFile) {
+  return XORSATFilterDeserializeWithOptions(pXORSATFilterFile, NULL);
+}
+
+//pOptions may be NULL for the default, lazily paged, private mapping.
+XORSATFilterQuerier *XORSATFilterDeserializeWithOptions(FILE *pXORSATFilterFile, XORSATFilterLoadOptions *pOptions) {
   if(pXORSATFilterFile == NULL) return NULL;
 
+  double fStart = XORSATFilterWallTime();
+  uint32_t nFlags = (pOptions != NULL) ? pOptions->nFlags : 0;
+
   int seek = fseek(pXORSATFilterFile, -(sizeof(uint16_t) + sizeof(XORSATFilterSerialData)), SEEK_END);
   if(seek != 0) return NULL;
 
@@ -59,6 +124,23 @@ XORSATFilterQuerier *XORSATFilterDeserialize(FILE *pXORSATFilterFile) {
     return NULL;
   }
 
+  if(xsfsd.nSolutions == 0 && xsfsd.nMetaDataBytes == 0) {
+    fprintf(stderr, "Error: filter has neither solutions nor metadata\n");
+    return NULL;
+  }
+
+  uint8_t nLitsPerRow = xsfsd.nLitsPerRow & XORSATFILTER_SERIAL_LITS_MASK;
+  if(nLitsPerRow == 0 || (nLitsPerRow > 20 && nLitsPerRow != XORSATFILTER_RIBBON)) {
+    fprintf(stderr, "Error: filter has an invalid number of literals per row\n");
+    return NULL;
+  }
+
+  uint8_t nFormat = xsfsd.nLitsPerRow >> XORSATFILTER_SERIAL_FORMAT_SHIFT;
+  if(nFormat & ~XORSATFILTER_FORMAT_ALL) {
+    fprintf(stderr, "Error: filter uses a format unknown to this version of the library\n");
+    return NULL;
+  }
+
   /*
   if(xsfsd.nSolutions + (xsfsd.nMetaDataBytes * 8) > 64) {
     fprintf(stderr, "Error: nSolutions + (nMetaDataBytes * 8) cannot be greater than 64\n"); //For now
@@ -72,7 +154,9 @@ XORSATFilterQuerier *XORSATFilterDeserialize(FILE *pXORSATFilterFile) {
   xsfq->nAvgVarsPerBlock = xsfsd.nAvgVarsPerBlock;
   xsfq->nSolutions = xsfsd.nSolutions;
   xsfq->nMetaDataBytes = xsfsd.nMetaDataBytes;
-  xsfq->nLitsPerRow = xsfsd.nLitsPerRow;
+  xsfq->nLitsPerRow = nLitsPerRow;
+  xsfq->nFormat = nFormat;
+  XORSATFilterQuerierInitConstants(xsfq);
 
   //Compute the size of the filter
   //See xorsat_query::XORSATFilterGetBlockIndex for more info
@@ -87,12 +171,67 @@ XORSATFilterQuerier *XORSATFilterDeserialize(FILE *pXORSATFilterFile) {
     return NULL;
   }
   
-  //Read filter and block offsets from expected
-  xsfq->pFilter = (uint64_t *)mmap(0, (nFilterWords * sizeof(uint64_t)) + ((xsfq->nBlocks+1) * sizeof(int16_t)), PROT_READ, MAP_PRIVATE, fileno(pXORSATFilterFile), 0);
-
-  xsfq->pOffsets = (int16_t *) (xsfq->pFilter + nFilterWords);
+  size_t nFilterBytes = nFilterWords * sizeof(uint64_t);
+  size_t nDataBytes = nFilterBytes + ((xsfq->nBlocks+1) * sizeof(int16_t));
+  uint32_t nCopy = nFlags & (XORSATFILTER_LOAD_COPY_2MB | XORSATFILTER_LOAD_COPY_1GB);
+
+  if(nCopy) {
+    //Filter, a padding word for vectorized queries, then offsets
+    xsfq->pFilter = XORSATFilterMapAnonymous(nDataBytes + sizeof(uint64_t), nCopy, &xsfq->nMappedBytes);
+    if(xsfq->pFilter == NULL) {
+      fprintf(stderr, "Error: could not allocate memory for the filter\n");
+      free(xsfq);
+      return NULL;
+    }
+    xsfq->pOffsets = (int16_t *) (xsfq->pFilter + nFilterWords + 1);
+
+    //Read the file in pieces straight into place
+    int fd = fileno(pXORSATFilterFile);
+    size_t nDone = 0;
+    while(nDone < nDataBytes) {
+      uint8_t *pDest = (nDone < nFilterBytes) ? ((uint8_t *) xsfq->pFilter) + nDone : ((uint8_t *) xsfq->pOffsets) + (nDone - nFilterBytes);
+      size_t nWant = (nDone < nFilterBytes) ? nFilterBytes - nDone : nDataBytes - nDone;
+      if(nWant > ((size_t) 1 << 30)) nWant = (size_t) 1 << 30;
+      ssize_t nRead = pread(fd, pDest, nWant, nDone);
+      if(nRead <= 0) {
+	fprintf(stderr, "Error: could not read filter file\n");
+	munmap(xsfq->pFilter, xsfq->nMappedBytes);
+	free(xsfq);
+	return NULL;
+      }
+      nDone += nRead;
+    }
+  } else {
+    //Read filter and block offsets from expected
+    int nMapFlags = (nFlags & XORSATFILTER_LOAD_SHARED) ? MAP_SHARED : MAP_PRIVATE;
+    if(nFlags & XORSATFILTER_LOAD_POPULATE) nMapFlags |= MAP_POPULATE;
+    void *pMap = mmap(0, nDataBytes, PROT_READ, nMapFlags, fileno(pXORSATFilterFile), 0);
+    if(pMap == MAP_FAILED) {
+      fprintf(stderr, "Error: could not map filter file\n");
+      free(xsfq);
+      return NULL;
+    }
+    xsfq->pFilter = (uint64_t *) pMap;
+    xsfq->nMappedBytes = nDataBytes;
+    xsfq->pOffsets = (int16_t *) (xsfq->pFilter + nFilterWords);
+
+    if(nFlags & XORSATFILTER_LOAD_HUGEPAGE) madvise(pMap, nDataBytes, MADV_HUGEPAGE);
+    if(nFlags & XORSATFILTER_LOAD_WILLNEED) madvise(pMap, nDataBytes, MADV_WILLNEED);
+  }
 
   xsfq->bMMAP = 1;
 
+  if(nFlags & XORSATFILTER_LOAD_PRETOUCH) {
+    XORSATFilterPretouch((const uint8_t *) xsfq->pFilter, xsfq->nMappedBytes, pOptions->nPretouchThreads);
+  }
+
+  if(nFlags & XORSATFILTER_LOAD_MLOCK) {
+    if(mlock(xsfq->pFilter, xsfq->nMappedBytes) != 0) {
+      fprintf(stderr, "Warning: could not lock the filter in memory (see RLIMIT_MEMLOCK)\n");
+    }
+  }
+
+  if(pOptions != NULL) pOptions->fLoadSeconds = XORSATFilterWallTime() - fStart;
+
   return xsfq;
 }
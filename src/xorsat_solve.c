@@ -6,96 +6,155 @@
 
 #include "xorsat_filter.h"
 
-uint8_t XORSATFilterSolveBlock(XORSATFilterBlock *pBlock) {
-  uint8_t ret = 1;
-  uint32_t i, j;
+//Removes every element whose hash matches that of an earlier element
+//of the block, keeping the first. An open-addressed table of the kept
+//elements' indices makes this linear in the size of the block. A
+//removed element's place is taken by the block's last element (and its
+//metadata), which is then checked in turn. Removals are counted in
+//pBlock->nDuplicates, and those whose presence or metadata differ from
+//the kept element in pBlock->nConflictingDuplicates. The table is kept
+//in pScratch. Returns 0 on success and 1 if it couldn't be allocated.
+static
+uint8_t XORSATFilterBlockRemoveDuplicates(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch) {
+  size_t i;
+  size_t nMetaDataBytes = pBlock->nMetaDataBytes;
+  uint8_t nTableBits = 4;
 
-  //Remove duplicate hashes
-  uint8_t duplicate_message_printed = 0;
-  if(pBlock->pHashes.nLength > 1) {
-    for(i = 0; i < pBlock->pHashes.nLength-1; i++) {
-      XORSATFilterHash xsfh = pBlock->pHashes.pList[i];
-      for(j = i+1; j < pBlock->pHashes.nLength; j++) {
-	if(xsfh.h1 == pBlock->pHashes.pList[j].h1) {
-	  //Removing duplicate
-	  pBlock->pHashes.pList[j] = pBlock->pHashes.pList[--pBlock->pHashes.nLength];
-	  j--;
-	  if(duplicate_message_printed == 0) {
-	    fprintf(stderr, "Hash collision or duplicate element detected. Possible loss of data. Consider using a better hash function\n");
-	    duplicate_message_printed = 1;
-	  }
-	}
-      }
+  pBlock->nDuplicates = 0;
+  pBlock->nConflictingDuplicates = 0;
+  if(pBlock->pHashes.nLength < 2) return 0;
+
+  //At most half full
+  while((((size_t) 1) << nTableBits) < 2 * pBlock->pHashes.nLength) nTableBits++;
+  size_t nTableMask = (((size_t) 1) << nTableBits) - 1;
+  uint32_t *pTable = (uint32_t *)XORSATFilterScratchZeroed(pScratch, XORSATFILTER_SCRATCH_DUPLICATES, (nTableMask + 1) * sizeof(uint32_t)); //Index + 1 of a kept element, 0 if empty
+  if(pTable == NULL) return 1;
+
+  for(i = 0; i < pBlock->pHashes.nLength; ) {
+    XORSATFilterHash xsfh = pBlock->pHashes.pList[i];
+    //Elements were assigned to blocks by their hash, so mix it before taking slots from it
+    uint64_t nMixed = xsfh.h1;
+    nMixed = (nMixed ^ (nMixed >> 31)) * (uint64_t)0xbf58476d1ce4e5b9;
+    size_t nSlot = (nMixed >> (64 - nTableBits)) & nTableMask;
+    while(pTable[nSlot] != 0 && pBlock->pHashes.pList[pTable[nSlot] - 1].h1 != xsfh.h1) {
+      nSlot = (nSlot + 1) & nTableMask;
+    }
+
+    if(pTable[nSlot] == 0) {
+      pTable[nSlot] = (uint32_t) (i + 1);
+      i++;
+      continue;
+    }
+
+    size_t nKept = pTable[nSlot] - 1;
+    pBlock->nDuplicates++;
+    if(xsfh.present != pBlock->pHashes.pList[nKept].present ||
+       (nMetaDataBytes > 0 && memcmp(pBlock->pMetaData + (i * nMetaDataBytes), pBlock->pMetaData + (nKept * nMetaDataBytes), nMetaDataBytes) != 0)) {
+      pBlock->nConflictingDuplicates++;
+    }
+
+    //The last element, and its metadata, take its place
+    size_t nLast = --pBlock->pHashes.nLength;
+    pBlock->pHashes.pList[i] = pBlock->pHashes.pList[nLast];
+    if(nMetaDataBytes > 0) {
+      memmove(pBlock->pMetaData + (i * nMetaDataBytes), pBlock->pMetaData + (nLast * nMetaDataBytes), nMetaDataBytes);
     }
   }
+
+  return 0;
+}
+
+//Solves a block of DW rows (nLitsPerRow 2) by eliminating them as one
+//dense IMMIR matrix. Returns as XORSATFilterFindRibbonSolutions does.
+static
+uint8_t XORSATFilterFindDWSolutions(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch) {
+  uint32_t nRHSWords = (pBlock->nSolutions + (pBlock->nMetaDataBytes * 8) + 63) >> 6;
+
+  gf2_t *pMatrix = XORSATFilterBuildIMMIRMatrix_DW(pBlock, pScratch);
+  uint64_t *pSolutions = (uint64_t *)XORSATFilterScratchBuffer(pScratch, XORSATFILTER_SCRATCH_SOLUTIONS, (size_t) pBlock->nVariables * nRHSWords * sizeof(uint64_t));
+  if(pMatrix == NULL || pSolutions == NULL) return 2;
+
+  uint8_t ret = XORSATFilterFindIMMIRSolutions(pMatrix, pSolutions, nRHSWords, &pBlock->nRandomState);
+
+  if(ret == 1 && XORSATFilterBlockCompressSolutions(pBlock, pSolutions, nRHSWords) != 0) ret = 2;
+
+  return ret;
+}
+
+//Solves pBlock, growing it a word at a time until its rows are
+//satisfiable, with pScratch as the solvers' working memory. A block
+//that can't be solved for lack of memory is marked bBadBlock, and the
+//build must then fail (see XORSATFilterBlocksFailed). Always returns 0.
+uint8_t XORSATFilterSolveBlock(XORSATFilterBlock *pBlock, XORSATFilterScratch *pScratch) {
+  uint8_t ret;
+
+  //Remove duplicate hashes
+  if(XORSATFilterBlockRemoveDuplicates(pBlock, pScratch) != 0) {
+    pBlock->bBadBlock = 1;
+    return 0;
+  }
   
   while (1) {
-    gf2_t *pMatrix;
-    if(pBlock->nLitsPerRow < 3) {
-      pMatrix = XORSATFilterBuildIMMIRMatrix_DW(pBlock);
+    //Banded rows are solved directly, without a dense matrix. WRS rows
+    //are peeled and only their 2-core is eliminated.
+    if(pBlock->nLitsPerRow == XORSATFILTER_RIBBON) {
+      ret = XORSATFilterFindRibbonSolutions(pBlock, pScratch);
+    } else if(pBlock->nLitsPerRow >= 3) {
+      ret = XORSATFilterFindPeeledSolutions(pBlock, pScratch);
     } else {
-      pMatrix = XORSATFilterBuildIMMIRMatrix_WRS(pBlock);
+      ret = XORSATFilterFindDWSolutions(pBlock, pScratch);
     }
 
-    //If unsat, mark as bad block and return
-    if(ret == 0) {
+    if(ret == 2) {
       pBlock->bBadBlock = 1;
-    } else {
-      //find pBlock->nSolutions solutions
-      bitvector_t *pSolutions = (bitvector_t *)malloc(pBlock->nVariables * sizeof(bitvector_t));
-      if(pSolutions == NULL) {
-	pBlock->bBadBlock = 1;
-	gf2_clear(pMatrix); free(pMatrix);
-	return 0;
-      }
-      for(i = 0; i < pBlock->nVariables; i++) {
-	bitvector_t *pBitVector = bitvector_t_alloc(pBlock->nSolutions + (pBlock->nMetaDataBytes * 8)); //Vectors are zeroized
-	if(pBitVector == NULL)  {
-	  pBlock->bBadBlock = 1;
-	  for(; i != 0; i--) uint64_t_list_free(&pSolutions[i-1].bits, NULL);
-	  free(pSolutions);
-	  gf2_clear(pMatrix); free(pMatrix);
-	  return 0;
-	}
-	pSolutions[i] = *pBitVector;
-	free(pBitVector);
-      }
-      
-      ret = XORSATFilterFindIMMIRSolutions(pMatrix, pSolutions);
-
-      pBlock->pSolutionsCompressed = *bitvector_t_alloc(pBlock->nVariables * (pBlock->nSolutions + (pBlock->nMetaDataBytes * 8)));
-      for(i = 0; i < pBlock->nVariables; i++) {
-	for(j = 0; j < pBlock->nSolutions + (pBlock->nMetaDataBytes * 8); j++) {
-	  uint8_t bit = bitvector_t_getBit(&pSolutions[i], j);
-	  bitvector_t_setBit(&pBlock->pSolutionsCompressed, i*(pBlock->nSolutions + (pBlock->nMetaDataBytes*8)) + j, bit);
-	}
-      }
-      
-      for(i = 0; i < pBlock->nVariables; i++) {
-	uint64_t_list_free(&pSolutions[i].bits, NULL);
-      }
-      free(pSolutions);
-      
-      if(ret != 1) {
-        pBlock->bBadBlock = 1; //UNSAT
-      }
+      return 0;
     }
+    if(ret == 1) break;
 
-    gf2_clear(pMatrix); free(pMatrix);
-    
-    if(pBlock->bBadBlock) {
-      ret = 1;
-      pBlock->bBadBlock = 0;
-      XORSATFilterBlockFillToWord(pBlock, 1);
-      //fprintf(stderr, "%u\n", pBlock->nVariables);
-    } else {
-      //fprintf(stderr, "\nFinished %u\n", pBlock->nVariables);
-      break;
-    }
+    //UNSAT, try again with another word of variables
+    pBlock->nRetries++;
+    XORSATFilterBlockFillToWord(pBlock, 1);
   }
   
-  XORSATFilterHash_list_free(&pBlock->pHashes, NULL);
-  XORSATFilterMetaData_list_free(&pBlock->pMetaData, NULL); //Don't free data, pointer is just copied.
+  XORSATFilterBlockReleaseElements(pBlock);
   
   return 0;
 }
+
+//Solves nBlocks blocks on pScheduler's workers and returns the words, beyond the size
+//fEfficiency gives, that blocks after the first
+//XORSATFILTER_CALIBRATION_BLOCKS started with. If nPredictedWords is
+//UINT32_MAX those first blocks are solved on their own to learn it (see
+//XORSATFilterBlockPredictWords); otherwise every block starts with
+//nPredictedWords more words.
+uint32_t XORSATFilterSolveBlocks(XORSATFilterBlock *pBlocks, uint32_t nBlocks, uint32_t nPredictedWords, XORSATFilterScheduler *pScheduler) {
+  uint32_t i = 0;
+
+  if(nPredictedWords == UINT32_MAX) {
+    i = (nBlocks < XORSATFILTER_CALIBRATION_BLOCKS) ? nBlocks : XORSATFILTER_CALIBRATION_BLOCKS;
+    XORSATFilterSchedulerRun(pScheduler, pBlocks, i);
+    nPredictedWords = XORSATFilterBlockPredictWords(pBlocks, i);
+  }
+
+  uint32_t nFirst = i;
+  for(; i < nBlocks; i++) {
+    XORSATFilterBlockResize(&pBlocks[i], pBlocks[i].nVariables + (nPredictedWords * 64));
+  }
+  XORSATFilterSchedulerRun(pScheduler, pBlocks + nFirst, nBlocks - nFirst);
+
+  return nPredictedWords;
+}
+
+//Returns the number of nBlocks blocks that couldn't be solved. Storing
+//such a block would answer every query to it wrongly, so a build with
+//any fails.
+uint32_t XORSATFilterBlocksFailed(const XORSATFilterBlock *pBlocks, uint32_t nBlocks) {
+  uint32_t i, nFailed = 0;
+  for(i = 0; i < nBlocks; i++) {
+    if(pBlocks[i].bBadBlock) nFailed++;
+  }
+  if(nFailed > 0) {
+    fprintf(stderr, "Error: %u blocks could not be solved, malloc() failed\n", nFailed);
+  }
+  return nFailed;
+}
@@ -12,12 +12,138 @@
 
 #include "xorsat_filter.h"
 
+//Adds nElements random elements, generated from random_seed, to
+//xsfb. Every tenth is added as an absence, as in main.
+static uint8_t AddTestElements(XORSATFilterBuilder *xsfb, uint64_t nElements, size_t nElementBytes, size_t nMetaDataBytes, uint32_t random_seed) {
+  uint8_t pElement[nElementBytes];
+  uint8_t pMetaData[nMetaDataBytes + 1];
+  uint64_t i, j;
+  srand(random_seed);
+  for(i = 0; i < nElements; i++) {
+    for(j = 0; j < nElementBytes; j++) {
+      pElement[j] = (uint8_t)(rand()%256);
+    }
+    for(j = 0; j < nMetaDataBytes; j++) {
+      pMetaData[j] = (uint8_t)(rand()%256);
+    }
+    uint8_t ret = (i % 10 == 0) ? XORSATFilterBuilderAddAbsence(xsfb, pElement, nElementBytes) : XORSATFilterBuilderAddElement(xsfb, pElement, nElementBytes, pMetaData);
+    if(ret != 0) return ret;
+  }
+  return 0;
+}
+
+//Returns a memory budget for external builds of nElements elements,
+//small enough to build several ranges at a time but never below the
+//smallest budget XORSATFilterBuilderAllocExternal accepts.
+static size_t TestMemoryBudget(uint64_t nElements) {
+  return (nElements * 8 < (1<<16)) ? (1<<16) : nElements * 8;
+}
+
+//Returns the fraction of the elements of AddTestElements that xsfq
+//answers correctly, counting wrong metadata as a failure.
+static double TestElements(const XORSATFilterQuerier *xsfq, uint64_t nElements, size_t nElementBytes, size_t nMetaDataBytes, uint32_t random_seed) {
+  uint8_t pElement[nElementBytes];
+  uint8_t pMetaData[nMetaDataBytes + 1];
+  uint8_t pMetaData_retrieved[nMetaDataBytes + 1];
+  uint64_t i, j, nNoes = 0;
+  srand(random_seed);
+  for(i = 0; i < nElements; i++) {
+    for(j = 0; j < nElementBytes; j++) {
+      pElement[j] = (uint8_t)(rand()%256);
+    }
+    for(j = 0; j < nMetaDataBytes; j++) {
+      pMetaData[j] = (uint8_t)(rand()%256);
+    }
+    uint8_t ret = XORSATFilterQueryAndRetrieveMetadata(xsfq, pElement, nElementBytes, pMetaData_retrieved);
+    if(i % 10 == 0) {
+      if(ret != XORSATFILTER_ABSENT) nNoes++;
+    } else if(ret != XORSATFILTER_PRESENT || memcmp(pMetaData_retrieved, pMetaData, nMetaDataBytes) != 0) {
+      nNoes++;
+    }
+  }
+  return 1.0 - (i==0 ? 0.0 : ((double)nNoes)/((double)i));
+}
+
+//Builds a filter of the elements of AddTestElements with sParams and
+//checks it the way main checks its filter: every element passes with
+//its metadata, before and after a serialization round trip, and, if
+//bExternal is set, building it again with a small memory budget gives
+//the same bytes. Returns 0 if all checks pass.
+static int TestParameters(const char *pName, XORSATFilterParameters sParams, uint64_t nElements, size_t nElementBytes, size_t nMetaDataBytes, uint32_t nThreads, uint32_t random_seed, uint8_t bExternal) {
+  fprintf(stdout, "\nBuilding filter with %s parameters, nFormat 0x%x\n", pName, sParams.nFormat);
+
+  XORSATFilterBuilder *xsfb = XORSATFilterBuilderAlloc(nElements, nMetaDataBytes);
+  if(xsfb == NULL || AddTestElements(xsfb, nElements, nElementBytes, nMetaDataBytes, random_seed) != 0) {
+    fprintf(stderr, "Element insertion failed...exiting\n");
+    return -1;
+  }
+  XORSATFilterQuerier *xsfq = XORSATFilterBuilderFinalize(xsfb, sParams, nThreads);
+  XORSATFilterBuilderFree(xsfb);
+  if(xsfq == NULL) {
+    fprintf(stderr, "Finalization failed...exiting\n");
+    return -1;
+  }
+
+  double p = TestElements(xsfq, nElements, nElementBytes, nMetaDataBytes, random_seed);
+  fprintf(stdout, "Percent passed = %4.4lf%%, %4.2lf bits per element\n", p*100.0, ((double) XORSATFilterSize(xsfq)) / (double) nElements);
+
+  FILE *fout = fopen("filter_params.xor", "w+");
+  if(fout == NULL || XORSATFilterSerialize(fout, xsfq) != 0) {
+    fprintf(stderr, "Serialization failed...exiting\n");
+    return -1;
+  }
+  XORSATFilterQuerierFree(xsfq);
+  if(p != 1.0) return -1;
+
+  rewind(fout);
+  xsfq = XORSATFilterDeserialize(fout);
+  if(xsfq == NULL || xsfq->nLitsPerRow != sParams.nLitsPerRow || xsfq->nFormat != sParams.nFormat) {
+    fprintf(stderr, "Deserialization failed...exiting\n");
+    return -1;
+  }
+  p = TestElements(xsfq, nElements, nElementBytes, nMetaDataBytes, random_seed);
+  fprintf(stdout, "Percent passed after deserializing = %4.4lf%%\n", p*100.0);
+  XORSATFilterQuerierFree(xsfq);
+  if(p != 1.0) return -1;
+
+  if(bExternal) {
+    xsfb = XORSATFilterBuilderAllocExternal(nMetaDataBytes, TestMemoryBudget(nElements), NULL);
+    if(xsfb == NULL || AddTestElements(xsfb, nElements, nElementBytes, nMetaDataBytes, random_seed) != 0) {
+      fprintf(stderr, "External element insertion failed...exiting\n");
+      return -1;
+    }
+    FILE *fext = fopen("filter_params_external.xor", "w+");
+    if(fext == NULL || XORSATFilterBuilderFinalizeToFile(xsfb, sParams, nThreads, fext) != 0) {
+      fprintf(stderr, "External finalization failed...exiting\n");
+      return -1;
+    }
+    XORSATFilterBuilderFree(xsfb);
+    rewind(fout);
+    rewind(fext);
+    int c, c_external;
+    do {
+      c = fgetc(fout);
+      c_external = fgetc(fext);
+    } while(c == c_external && c != EOF);
+    fclose(fext);
+    remove("filter_params_external.xor");
+    fprintf(stdout, "External build %s in-memory build\n", (c == c_external) ? "matches" : "differs from");
+    if(c != c_external) return -1;
+  }
+
+  fclose(fout);
+  remove("filter_params.xor");
+  return 0;
+}
+
 int main(int argc, char **argv) {
   uint64_t nElements = 1000000;
   size_t nElementBytes = 10;
   size_t nMetaDataBytes = 10;
   uint32_t nThreads = 16;
   uint64_t i, j;
+
+  if(argc > 1) nElements = strtoull(argv[1], NULL, 10);
   
   struct timeval tv1;
   struct timezone tzp1;  
@@ -26,6 +152,9 @@ int main(int argc, char **argv) {
   
   fprintf(stderr, "random seed = %d\n", random_seed);
   srand(random_seed);
+
+  //Checks that disagree are counted, so the run can fail once they are all reported
+  uint64_t nFailures = 0;
   
   XORSATFilterBuilder *xsfb = XORSATFilterBuilderAlloc(nElements, nMetaDataBytes);
   if(xsfb == NULL) {
@@ -47,6 +176,12 @@ int main(int argc, char **argv) {
     return -1;
   }
   
+  uint8_t *pMetaData_fused = malloc(nMetaDataBytes * sizeof(uint8_t));
+  if(pMetaData_fused == NULL) {
+    fprintf(stderr, "malloc() failed...exiting\n");
+    return -1;
+  }
+  
   time_t start_wall = time(NULL);
   clock_t start_cpu = clock();
   
@@ -72,21 +207,23 @@ int main(int argc, char **argv) {
 
   fprintf(stdout, "\nBuilding filter\n");
 
-  XORSATFilterQuerier *xsfq =
-    XORSATFilterBuilderFinalize(xsfb,
-                                //XORSATFilterEfficientParameters,
-                                //XORSATFilterPaperParameters,
-                                //XORSATFilterFastParameters,
-                                //XORSATFilterDWEfficientParameters,
-                                XORSATFilterDWPaperParameters,
-                                //XORSATFilterDWFastParameters,
-                                nThreads);
+  XORSATFilterParameters sParams =
+    //XORSATFilterEfficientParameters;
+    //XORSATFilterPaperParameters;
+    //XORSATFilterFastParameters;
+    //XORSATFilterDWEfficientParameters;
+    XORSATFilterDWPaperParameters;
+    //XORSATFilterDWFastParameters;
+    //XORSATFilterRibbonParameters;
+
+  XORSATFilterQuerier *xsfq = XORSATFilterBuilderFinalize(xsfb, sParams, nThreads);
 
   clock_t end_cpu = clock();
   time_t end_wall = time(NULL);
   double time_wall = difftime(end_wall, start_wall);
   double time_cpu = ((double) (end_cpu - start_cpu)) / (double) CLOCKS_PER_SEC;
 
+  XORSATFilterBuildStats sStats = XORSATFilterBuilderStats(xsfb);
   XORSATFilterBuilderFree(xsfb);
 
   if(xsfq == NULL) {
@@ -95,6 +232,8 @@ int main(int argc, char **argv) {
   }
 
   fprintf(stdout, "Building took %1.0lf wallclock seconds and %1.0lf CPU seconds\n", time_wall, time_cpu);
+  fprintf(stdout, "%"PRIu64" elements, %"PRIu64" duplicates removed (%"PRIu64" conflicting)\n", sStats.nElements, sStats.nDuplicates, sStats.nConflictingDuplicates);
+  fprintf(stdout, "%"PRIu64" blocks, %"PRIu64" retried, %"PRIu64" retries, %"PRIu64" predicted extra words\n", sStats.nBlocks, sStats.nBlocksRetried, sStats.nRetries, sStats.nPredictedWords);
   
   FILE *fout = fopen("filter.xor", "w");
   if(XORSATFilterSerialize(fout, xsfq) != 0) {
@@ -104,7 +243,54 @@ int main(int argc, char **argv) {
   fclose(fout);
   XORSATFilterQuerierFree(xsfq);
 
+  //Build the same filter again, spilling to disk with a memory budget
+  //small enough that its blocks are built several ranges at a time, on
+  //the default number of threads, each pinned to a CPU, eliminating with
+  //plain word XORs in place of the SIMD kernels the first build used
+  fprintf(stdout, "\nBuilding filter again with a memory budget of %zu bytes on %u pinned threads without SIMD\n", TestMemoryBudget(nElements), XORSATFilterDefaultThreads());
+  xsfb = XORSATFilterBuilderAllocExternal(nMetaDataBytes, TestMemoryBudget(nElements), NULL);
+  if(xsfb == NULL) {
+    fprintf(stderr, "External builder allocation failed...exiting\n");
+    return -1;
+  }
+  srand(random_seed);
+  for(i = 0; i < nElements; i++) {
+    for(j = 0; j < nElementBytes; j++) {
+      pElement[j] = (uint8_t)(rand()%256);
+    }
+    for(j = 0; j < nMetaDataBytes; j++) {
+      pMetaData[j] = (uint8_t)(rand()%256);
+    }
+    uint8_t ret = (i % 10 == 0) ? XORSATFilterBuilderAddAbsence(xsfb, pElement, nElementBytes) : XORSATFilterBuilderAddElement(xsfb, pElement, nElementBytes, pMetaData);
+    if(ret != 0) {
+      fprintf(stderr, "Element insertion failed...exiting\n");
+      return -1;
+    }
+  }
+  fout = fopen("filter_external.xor", "w+");
+  sParams.bPinThreads = 1;
+  int nSIMD = gf2_simd(GF2_SIMD_WORD);
+  if(XORSATFilterBuilderFinalizeToFile(xsfb, sParams, 0, fout) != 0) {
+    fprintf(stderr, "External finalization failed...exiting\n");
+    return -1;
+  }
+  gf2_simd(nSIMD);
+  XORSATFilterBuilderFree(xsfb);
+
   FILE *fin = fopen("filter.xor", "r");
+  rewind(fout);
+  int c, c_external;
+  do {
+    c = fgetc(fin);
+    c_external = fgetc(fout);
+  } while(c == c_external && c != EOF);
+  fclose(fin);
+  fclose(fout);
+  remove("filter_external.xor");
+  fprintf(stdout, "External build %s in-memory build\n", (c == c_external) ? "matches" : "differs from");
+  if(c != c_external) nFailures++;
+
+  fin = fopen("filter.xor", "r");
   xsfq = XORSATFilterDeserialize(fin);
   if(xsfq == NULL) {
     fprintf(stderr, "Deserialization failed...exiting\n");
@@ -127,6 +313,13 @@ int main(int argc, char **argv) {
     }
     uint8_t ret = XORSATFilterQuery(xsfq, pElement, nElementBytes);
 
+    uint8_t ret_fused = XORSATFilterQueryAndRetrieveMetadata(xsfq, pElement, nElementBytes, pMetaData_fused);
+    if((ret_fused != XORSATFILTER_ABSENT) != ret ||
+       (ret_fused == XORSATFILTER_PRESENT && memcmp(pMetaData_fused, pMetaData, nMetaDataBytes) != 0)) {
+      fprintf(stderr, "Fused query and metadata retrieval disagrees with query.\n");
+      nFailures++;
+    }
+
     if(i % 10 == 0) {
       if(ret == 1) {
         nNoes++;
@@ -141,6 +334,7 @@ int main(int argc, char **argv) {
         if((nMetaDataBytes > 0 && pMetaData_retrieved == NULL) ||
            (strncmp((const char *)pMetaData_retrieved, (const char *)pMetaData, nMetaDataBytes) != 0)) {
           fprintf(stderr, "Metadata retrieval failed.\n");
+          nFailures++;
         }
         free(pMetaData_retrieved);
       }
@@ -149,15 +343,94 @@ int main(int argc, char **argv) {
 
   double p = 1.0 - (i==0 ? 0.0 : ((double)nNoes)/((double)i));
   fprintf(stdout, "Percent passed = %4.4lf%%\n", p*100.0);
-  assert(p == 1.0);
+  if(p != 1.0) nFailures++;
   free(pElement);
-  free(pMetaData);
+
+  fprintf(stdout, "\nTesting batch query against single queries\n");
+
+  uint32_t nBatchSize = 100000;
+  uint32_t *pBatchElements = malloc(nBatchSize * sizeof(uint32_t));
+  const void **ppBatchElements = malloc(nBatchSize * sizeof(void *));
+  uint32_t *pBatchElementBytes = malloc(nBatchSize * sizeof(uint32_t));
+  uint8_t *pBatchResults = malloc((nBatchSize + 7) / 8);
+  if(pBatchElements == NULL || ppBatchElements == NULL || pBatchElementBytes == NULL || pBatchResults == NULL) {
+    fprintf(stderr, "malloc() failed...exiting\n");
+    return -1;
+  }
+  for(i = 0; i < nBatchSize; i++) {
+    pBatchElements[i] = (uint32_t) rand();
+    ppBatchElements[i] = &pBatchElements[i];
+    pBatchElementBytes[i] = sizeof(uint32_t);
+  }
+  XORSATFilterQueryBatch(xsfq, ppBatchElements, pBatchElementBytes, nBatchSize, pBatchResults);
+  for(i = 0; i < nBatchSize; i++) {
+    uint8_t ret = XORSATFilterQuery(xsfq, ppBatchElements[i], pBatchElementBytes[i]);
+    if(ret != ((pBatchResults[i/8] >> (i%8)) & 1)) {
+      fprintf(stderr, "Batch query disagrees with single query.\n");
+      nFailures++;
+    }
+  }
+  if(nMetaDataBytes > 0) {
+    uint8_t *pBatchMetaData = malloc(nBatchSize * nMetaDataBytes);
+    if(pBatchMetaData == NULL) {
+      fprintf(stderr, "malloc() failed...exiting\n");
+      return -1;
+    }
+    XORSATFilterRetrieveMetadataBatch(xsfq, ppBatchElements, pBatchElementBytes, nBatchSize, pBatchMetaData);
+    for(i = 0; i < nBatchSize; i++) {
+      XORSATFilterRetrieveMetadataInto(xsfq, ppBatchElements[i], pBatchElementBytes[i], pMetaData);
+      if(memcmp(pMetaData, pBatchMetaData + (i * nMetaDataBytes), nMetaDataBytes) != 0) {
+        fprintf(stderr, "Batch metadata retrieval disagrees with single retrieval.\n");
+        nFailures++;
+      }
+    }
+    free(pBatchMetaData);
+  }
+
+  fprintf(stdout, "\nTesting NUMA replicated querier against single queries\n");
+
+  XORSATFilterNUMAQuerier *xsfnq = XORSATFilterNUMAQuerierAlloc(xsfq);
+  if(xsfnq == NULL || XORSATFilterNUMAQuerierReload(xsfnq, xsfq) != 0) {
+    fprintf(stderr, "NUMA querier creation failed...exiting\n");
+    return -1;
+  }
+  for(i = 0; i < nBatchSize; i++) {
+    if(XORSATFilterNUMAQuery(xsfnq, ppBatchElements[i], pBatchElementBytes[i]) != ((pBatchResults[i/8] >> (i%8)) & 1)) {
+      fprintf(stderr, "NUMA query disagrees with single query.\n");
+      nFailures++;
+    }
+  }
+  fprintf(stdout, "Testing NUMA query speed with util func (%u nodes): %"PRIu64" queries per second\n", xsfnq->nNodes, XORSATFilterNUMAQueryRate(xsfnq, 1, 0, NULL));
+  XORSATFilterNUMAQuerierFree(xsfnq);
+
+  free(pBatchElements);
+  free(ppBatchElements);
+  free(pBatchElementBytes);
+  free(pBatchResults);
 
   fprintf(stdout, "\nTesting query speed with util func: %u queries per second\n", XORSATFilterQueryRate(xsfq));
+  fprintf(stdout, "Testing batch query speed with util func: %u queries per second\n", XORSATFilterQueryBatchRate(xsfq));
+
+  long nOnline = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t nRateThreads = (nOnline > 1) ? (uint32_t) nOnline : 2;
+  uint32_t *pThreadRates = malloc(nRateThreads * sizeof(uint32_t));
+  if(pThreadRates != NULL) {
+    fprintf(stdout, "Testing parallel query speed with util func (%u threads): %"PRIu64" queries per second\n", nRateThreads, XORSATFilterQueryRateParallel(xsfq, nRateThreads, pThreadRates));
+    for(i = 0; i < nRateThreads; i++) {
+      fprintf(stdout, "  thread %"PRIu64": %u queries per second\n", i, pThreadRates[i]);
+    }
+    free(pThreadRates);
+  }
+
+  fprintf(stdout, "\nTesting bulk ingestion speed with util func (%u threads): %"PRIu64" elements per second\n", nRateThreads, XORSATFilterIngestionRate(nRateThreads, nMetaDataBytes, 0));
+  fprintf(stdout, "Testing sharded ingestion speed with util func (%u threads): %"PRIu64" elements per second\n", nRateThreads, XORSATFilterIngestionRate(nRateThreads, nMetaDataBytes, 1));
 
   if(nMetaDataBytes > 0) {
     fprintf(stdout, "\nTesting metadata retrieval speed with util func: %u retrievals per second\n", XORSATFilterMetadataRetrievalRate(xsfq, nElementBytes));
+    fprintf(stdout, "Testing batch metadata retrieval speed with util func: %u retrievals per second\n", XORSATFilterMetadataRetrievalBatchRate(xsfq));
   }
+  free(pMetaData);
+  free(pMetaData_fused);
 
   p = XORSATFilterFalsePositiveRate(xsfq);
   fprintf(stdout, "Testing false positive rate with util func: %4.8lf%%\n", p * 100.0);
@@ -171,6 +444,43 @@ int main(int argc, char **argv) {
   fprintf(stdout, "Seralized object uses %"PRIu64" bits\n", XORSATAncillarySize(xsfq) + XORSATMetaDataSize(xsfq) + XORSATFilterSize(xsfq));
   
   XORSATFilterQuerierFree(xsfq);
-  
+
+  if(TestParameters("ribbon", XORSATFilterRibbonParameters, nElements, nElementBytes, nMetaDataBytes, nThreads, random_seed, 1) != 0) {
+    return -1;
+  }
+
+  //Every format flag at once, so their header bits and mappings are
+  //built, serialized and reloaded, on DW rows and on WRS rows
+  sParams = XORSATFilterDWPaperParameters;
+  sParams.nFormat = XORSATFILTER_FORMAT_ALL;
+  if(TestParameters("DW paper", sParams, nElements, nElementBytes, nMetaDataBytes, nThreads, random_seed, 0) != 0) {
+    return -1;
+  }
+  sParams = XORSATFilterFastParameters;
+  sParams.nFormat = XORSATFILTER_FORMAT_ALL;
+  if(TestParameters("fast", sParams, nElements, nElementBytes, nMetaDataBytes, nThreads, random_seed, 0) != 0) {
+    return -1;
+  }
+
+  fprintf(stdout, "\nChecking that unknown format flags are rejected\n");
+  xsfb = XORSATFilterBuilderAlloc(0, nMetaDataBytes);
+  if(xsfb == NULL || AddTestElements(xsfb, 1000, nElementBytes, nMetaDataBytes, random_seed) != 0) {
+    fprintf(stderr, "Element insertion failed...exiting\n");
+    return -1;
+  }
+  sParams.nFormat = XORSATFILTER_FORMAT_ALL + 1;
+  xsfq = XORSATFilterBuilderFinalize(xsfb, sParams, nThreads);
+  XORSATFilterBuilderFree(xsfb);
+  if(xsfq != NULL) {
+    fprintf(stderr, "Unknown format flags were accepted...exiting\n");
+    XORSATFilterQuerierFree(xsfq);
+    return -1;
+  }
+
+  if(nFailures > 0) {
+    fprintf(stderr, "%"PRIu64" checks failed...exiting\n", nFailures);
+    return -1;
+  }
+
   return 0;
 }